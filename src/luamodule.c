@@ -1,13 +1,33 @@
 #include "luamodule.h"
 #include <Python.h>
 #include <structmember.h>
+#include <stddef.h>
+#include <limits.h>
+#include <float.h>
+#include <time.h>
 #include <lua.h>
 #include <lualib.h>
 #include <lauxlib.h>
 
 #define PYOBJECT "PyObject"
+#define PYBUFFER "PyBuffer"
+#define PYARRAY "PyArray"
+#define PYDICT "PyDict"
+#define PYLIST "PyList"
+#define PYFUNCTION "PyFunction"
+#define PYCHANNEL "PyChannel"
 
-PyThreadState *_save;
+static PyObject *mmap_type;
+static PyObject *array_type;
+static PyTypeObject *methoddescr_type; /* not exported by Python 2 */
+static PyTypeObject LuaIterType;
+static PyTypeObject LuaCallIterType;
+static PyTypeObject LuaTaskType;
+static PyTypeObject LuaChannelType;
+static PyTypeObject LuaCoroutineType;
+static char lua_profilekey;     /* registry key of the profile samples */
+static char lua_statekey;       /* registry key of the owning LuaState */
+static PyObject *LuaLimitError;
 
 /* Debug functions **********************************************************/
 
@@ -36,18 +56,158 @@ void LogLuaTop(const char *str, lua_State *L)
     Log("  Top %s %d\n", str, lua_gettop(L));
 }
 
+/* Lua allocator ************************************************************/
+
+static void *LuaAlloc_alloc(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+    LuaAlloc *a = (LuaAlloc *)ud;
+    void *p;
+
+    if (ptr == NULL)
+        osize = 0;
+
+    if (nsize == 0)
+    {
+        if (ptr == NULL)
+            return NULL;
+        if (a->pooled && osize <= LUA_POOL_MAXSIZE)
+            LuaAlloc_put(a, ptr, osize);
+        else
+            free(ptr);
+        a->live -= osize;
+        a->frees++;
+        return NULL;
+    }
+
+    // Lua assumes shrinking never fails, so only growth is capped
+    if (a->limit && a->guarded && nsize > osize
+            && a->live - osize + nsize > a->limit)
+        return NULL;
+
+    if (!a->pooled || (osize > LUA_POOL_MAXSIZE && nsize > LUA_POOL_MAXSIZE))
+    {
+        p = realloc(ptr, nsize);
+    }
+    else if (ptr != NULL && osize <= LUA_POOL_MAXSIZE
+            && nsize <= LUA_POOL_MAXSIZE
+            && (osize - 1) / LUA_POOL_GRAIN == (nsize - 1) / LUA_POOL_GRAIN)
+    {
+        p = ptr;
+    }
+    else
+    {
+        // moving between a pool and the system heap, or between classes
+        p = nsize <= LUA_POOL_MAXSIZE ? LuaAlloc_get(a, nsize) :
+            malloc(nsize);
+        if (p != NULL && ptr != NULL)
+        {
+            memcpy(p, ptr, osize < nsize ? osize : nsize);
+            if (osize <= LUA_POOL_MAXSIZE)
+                LuaAlloc_put(a, ptr, osize);
+            else
+                free(ptr);
+        }
+    }
+    if (p == NULL)
+        return NULL;
+
+    if (ptr == NULL)
+        a->allocs++;
+    a->live += nsize - osize;
+    if (a->live > a->peak)
+        a->peak = a->live;
+    return p;
+}
+
+static void *LuaAlloc_get(LuaAlloc *a, size_t size)
+{
+    int c = (size - 1) / LUA_POOL_GRAIN;
+    void *p = a->freelist[c];
+    LuaPoolBlock *block;
+
+    if (p != NULL)
+    {
+        a->freelist[c] = *(void **)p;
+        return p;
+    }
+
+    size = (c + 1) * LUA_POOL_GRAIN;
+    if (a->bump + size > a->bumpend)
+    {
+        block = malloc(sizeof(LuaPoolBlock) + LUA_POOL_BLOCKSIZE);
+        if (block == NULL)
+            return NULL;
+        block->next = a->blocks;
+        a->blocks = block;
+        a->bump = (char *)(block + 1);
+        a->bumpend = a->bump + LUA_POOL_BLOCKSIZE;
+    }
+    p = a->bump;
+    a->bump += size;
+    return p;
+}
+
+static void LuaAlloc_put(LuaAlloc *a, void *p, size_t size)
+{
+    int c = (size - 1) / LUA_POOL_GRAIN;
+
+    *(void **)p = a->freelist[c];
+    a->freelist[c] = p;
+}
+
+static void LuaAlloc_close(LuaAlloc *a)
+{
+    LuaPoolBlock *block;
+
+    while (a->blocks != NULL)
+    {
+        block = a->blocks;
+        a->blocks = block->next;
+        free(block);
+    }
+}
+
+static int lua_panic(lua_State *L)
+{
+    fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n",
+            lua_tostring(L, -1));
+    return 0;
+}
+
 /* LuaObject type *********************************************************/
 
 static void LuaObject_dealloc(LuaObject *self)
 {
-    lua_State *L = self->lua->L;
+    lua_State *L;
 
-    lua_pushlightuserdata(L, self);
-    lua_pushnil(L);
-    lua_rawset(L, LUA_REGISTRYINDEX);
+    if (self->lua)
+    {
+        L = self->lua->L;
+        Lua_lock(self->lua);
 
-    Py_DECREF(self->lua);
-    self->ob_type->tp_free(self);
+        // drop the identity map entry, unless a new wrapper took it over
+        lua_rawgeti(L, LUA_REGISTRYINDEX, self->lua->wrappers);
+        lua_rawgeti(L, LUA_REGISTRYINDEX, self->ref);
+        lua_pushvalue(L, -1);
+        lua_rawget(L, -3);
+        if (lua_touserdata(L, -1) == self)
+        {
+            lua_pop(L, 1);
+            lua_pushnil(L);
+            lua_rawset(L, -3);
+            lua_pop(L, 1);
+        }
+        else
+        {
+            lua_pop(L, 3);
+        }
+
+        luaL_unref(L, LUA_REGISTRYINDEX, self->ref);
+        STATS_INC(self->lua, unwrapped);
+        Lua_unlock(self->lua);
+        Py_DECREF(self->lua);
+    }
+    Py_TYPE(self)->tp_free(self);
 }
 
 static int LuaObject_init(LuaObject *self, PyObject *args, PyObject *kwds)
@@ -56,31 +216,63 @@ static int LuaObject_init(LuaObject *self, PyObject *args, PyObject *kwds)
     return -1;
 }
 
-static PyObject *LuaObject_call(LuaObject *self, PyObject *args, PyObject
-        *kwds)
+static PyObject *LuaObject_callvector(LuaObject *self, PyObject *const *argv,
+        Py_ssize_t n, long budget, double timeout)
 {
-    size_t n;
-    int oldtop;
     PyObject *result;
     lua_State *L = self->lua->L;
+    LuaLimit saved;
+    int limited = budget > 0 || timeout > 0;
+    STATS_DECLARE(t)
 
-    oldtop = lua_gettop(L);
-
+    STATS_START(t);
+    Lua_lock(self->lua);
     lua_pushluaobject(L, self);
     if (!lua_iscallable(L, -1))
     {
         PyErr_SetString(PyExc_ValueError, "this LuaObject isn't callable");
-        lua_settop(L, oldtop);
+        lua_pop(L, 1);
+        Lua_unlock(self->lua);
+        STATS_STOP(self->lua, call, t);
         return NULL;
     }
 
-    n = Lua_pushpyobject_tuple(self->lua, args);
-    lua_pcall(L, n, LUA_MULTRET, 0);
-    result = Lua_topython_multiple(self->lua, lua_gettop(L) - oldtop);
-    lua_settop(L, oldtop);
+    if (limited)
+        Lua_setlimit(self->lua, &saved, budget, timeout, NULL);
+    result = Lua_callvector(self->lua, argv, n);
+    if (limited)
+        Lua_restorelimit(self->lua, &saved);
+    Lua_unlock(self->lua);
+    STATS_STOP(self->lua, call, t);
     return result;
 }
 
+#ifdef LUA_FASTCALL
+static PyObject *LuaObject_vectorcall(PyObject *self, PyObject *const *args,
+        size_t nargsf, PyObject *kwnames)
+{
+    Py_ssize_t n = PyVectorcall_NARGS(nargsf);
+    long budget;
+    double timeout;
+
+    if (!Lua_parselimitkw(args + n, kwnames, &budget, &timeout))
+        return NULL;
+    return LuaObject_callvector((LuaObject *)self, args, n, budget, timeout);
+}
+#endif
+
+static PyObject *LuaObject_call(LuaObject *self, PyObject *args, PyObject
+        *kwds)
+{
+    long budget;
+    double timeout;
+
+    if (!Lua_parselimit(kwds, &budget, &timeout))
+        return NULL;
+    return LuaObject_callvector(self, &PyTuple_GET_ITEM(args, 0),
+            PyTuple_GET_SIZE(args), budget, timeout);
+}
+
 static PyObject *LuaObject_getattro(LuaObject *self, PyObject *name)
 {
     if (PyString_Check(name))
@@ -89,6 +281,9 @@ static PyObject *LuaObject_getattro(LuaObject *self, PyObject *name)
         str = PyString_AsString(name);
         if (strncmp(str, "__", 2) == 0)
             return PyObject_GenericGetAttr((PyObject *)self, name);
+        // methods shadow Lua fields of the same name
+        if (PyDict_GetItem(Py_TYPE(self)->tp_dict, name) != NULL)
+            return PyObject_GenericGetAttr((PyObject *)self, name);
     }
 
     return LuaObject_subscript(self, name);
@@ -112,10 +307,12 @@ static PyObject *LuaObject_subscript(LuaObject *self, PyObject *ss)
     PyObject *result;
     lua_State *L = self->lua->L;
 
+    Lua_lock(self->lua);
     lua_pushluaobject(L, self);
     if (!lua_isindexable(L, -1))
     {
         lua_pop(L, 1);
+        Lua_unlock(self->lua);
         PyErr_SetString(PyExc_ValueError, "this LuaObject is not indexable");
         return NULL;
     }
@@ -123,6 +320,7 @@ static PyObject *LuaObject_subscript(LuaObject *self, PyObject *ss)
     lua_gettable(L, -2);
     result = Lua_topython(self->lua, -1);
     lua_pop(L, 2);
+    Lua_unlock(self->lua);
     return result;
 }
 
@@ -130,10 +328,12 @@ static int LuaObject_ass_subscript(LuaObject *self, PyObject *ss, PyObject *o)
 {
     lua_State *L = self->lua->L;
 
+    Lua_lock(self->lua);
     lua_pushluaobject(L, self);
     if (!lua_isindexable(L, -1))
     {
         lua_pop(L, 1);
+        Lua_unlock(self->lua);
         PyErr_SetString(PyExc_ValueError, "this LuaObject is not indexable");
         return -1;
     }
@@ -144,18 +344,263 @@ static int LuaObject_ass_subscript(LuaObject *self, PyObject *ss, PyObject *o)
         Lua_pushpyobject(self->lua, o);
     lua_settable(L, -3);
     lua_pop(L, 1);
+    Lua_unlock(self->lua);
     return 0;
 }
 
+static PyObject *LuaObject_convert(LuaObject *self, PyObject *args,
+        PyObject *kwds, int aslist)
+{
+    static char *kwlist[] = {"depth", NULL};
+    int depth = -1;
+    PyObject *memo, *result;
+    lua_State *L = self->lua->L;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|i", kwlist, &depth))
+        return NULL;
+
+    memo = PyDict_New();
+    if (memo == NULL)
+        return NULL;
+
+    Lua_lock(self->lua);
+    lua_pushluaobject(L, self);
+    if (!lua_istable(L, -1))
+    {
+        PyErr_SetString(PyExc_ValueError, "this LuaObject is not a table");
+        result = NULL;
+    }
+    else if (aslist)
+    {
+        result = Lua_tolist(self->lua, -1, depth, memo);
+    }
+    else
+    {
+        result = Lua_todict(self->lua, -1, depth, memo);
+    }
+    lua_pop(L, 1);
+    Lua_unlock(self->lua);
+
+    Py_DECREF(memo);
+    return result;
+}
+
+static PyObject *LuaObject_to_dict(LuaObject *self, PyObject *args, PyObject
+        *kwds)
+{
+    return LuaObject_convert(self, args, kwds, 0);
+}
+
+static PyObject *LuaObject_to_list(LuaObject *self, PyObject *args, PyObject
+        *kwds)
+{
+    return LuaObject_convert(self, args, kwds, 1);
+}
+
+static PyObject *LuaObject_to_array(LuaObject *self, PyObject *args)
+{
+    PyObject *result;
+    lua_State *L = self->lua->L;
+#ifdef PY3
+    int format = 'd';
+
+    if (!PyArg_ParseTuple(args, "|C", &format))
+        return NULL;
+#else
+    char format = 'd';
+
+    if (!PyArg_ParseTuple(args, "|c", &format))
+        return NULL;
+#endif
+    if (array_type == NULL)
+    {
+        PyErr_SetString(PyExc_ImportError, "the array module is missing");
+        return NULL;
+    }
+
+    Lua_lock(self->lua);
+    lua_pushluaobject(L, self);
+    if (!lua_istable(L, -1))
+    {
+        PyErr_SetString(PyExc_ValueError, "this LuaObject is not a table");
+        result = NULL;
+    }
+    else
+    {
+        result = Lua_toarray(self->lua, -1, format);
+    }
+    lua_pop(L, 1);
+    Lua_unlock(self->lua);
+    return result;
+}
+
+static int LuaObject_nonzero(LuaObject *self)
+{
+    // without this, truth testing would fall back to the length
+    return 1;
+}
+
+static Py_ssize_t LuaObject_length(LuaObject *self)
+{
+    Py_ssize_t len = -1;
+    lua_State *L = self->lua->L;
+
+    Lua_lock(self->lua);
+    lua_pushluaobject(L, self);
+    if (lua_istable(L, -1))
+        len = lua_objlen(L, -1);
+    else
+        PyErr_SetString(PyExc_TypeError, "this LuaObject is not a table");
+    lua_pop(L, 1);
+    Lua_unlock(self->lua);
+    return len;
+}
+
+static PyObject *LuaObject_iter(LuaObject *self)
+{
+    return LuaIter_new(self, LUA_ITER_KEYS);
+}
+
+static PyObject *LuaObject_keys(LuaObject *self)
+{
+    return LuaIter_new(self, LUA_ITER_KEYS);
+}
+
+static PyObject *LuaObject_values(LuaObject *self)
+{
+    return LuaIter_new(self, LUA_ITER_VALUES);
+}
+
+static PyObject *LuaObject_items(LuaObject *self)
+{
+    return LuaIter_new(self, LUA_ITER_ITEMS);
+}
+
+static PyObject *LuaObject_callbatch(LuaObject *self, PyObject *args,
+        PyObject *kwds, int spread)
+{
+    static char *kwlist[] = {"iterable", "stream", NULL};
+    PyObject *iterable, *it, *item, *value, *result;
+    LuaCallIter *ci;
+    int stream = 0, callable;
+    lua_State *L = self->lua->L;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|i", kwlist, &iterable,
+                &stream))
+        return NULL;
+    if ((it = PyObject_GetIter(iterable)) == NULL)
+        return NULL;
+
+    // callability is checked once for the whole batch; the lock is only
+    // held around each call, since the iterator may run Python code that
+    // uses this state from another thread
+    Lua_lock(self->lua);
+    lua_pushluaobject(L, self);
+    callable = lua_iscallable(L, -1);
+    lua_pop(L, 1);
+    Lua_unlock(self->lua);
+    if (!callable)
+    {
+        Py_DECREF(it);
+        PyErr_SetString(PyExc_ValueError, "this LuaObject isn't callable");
+        return NULL;
+    }
+
+    if (stream)
+    {
+        ci = (LuaCallIter *)LuaCallIterType.tp_alloc(&LuaCallIterType, 0);
+        if (ci == NULL)
+        {
+            Py_DECREF(it);
+            return NULL;
+        }
+        Py_INCREF(self);
+        ci->fn = self;
+        ci->args = it;
+        ci->spread = spread;
+        return (PyObject *)ci;
+    }
+
+    result = PyList_New(0);
+    while (result != NULL && (item = PyIter_Next(it)) != NULL)
+    {
+        value = Lua_callitem(self, item, spread);
+        Py_DECREF(item);
+        if (value == NULL || PyList_Append(result, value) < 0)
+            Py_CLEAR(result);
+        Py_XDECREF(value);
+    }
+
+    Py_DECREF(it);
+    if (result != NULL && PyErr_Occurred())
+        Py_CLEAR(result);
+    return result;
+}
+
+static PyObject *LuaObject_map(LuaObject *self, PyObject *args, PyObject
+        *kwds)
+{
+    return LuaObject_callbatch(self, args, kwds, 0);
+}
+
+static PyObject *LuaObject_call_many(LuaObject *self, PyObject *args,
+        PyObject *kwds)
+{
+    return LuaObject_callbatch(self, args, kwds, 1);
+}
+
+static PyMethodDef LuaObject_methods[] = {
+    {"to_dict", (PyCFunction)LuaObject_to_dict, METH_VARARGS | METH_KEYWORDS,
+        "Copy a Lua table into a dict, converting nested tables up to depth"
+        " levels deep (-1 for no limit)."},
+    {"to_list", (PyCFunction)LuaObject_to_list, METH_VARARGS | METH_KEYWORDS,
+        "Copy the sequence part of a Lua table into a list, converting"
+        " nested tables up to depth levels deep (-1 for no limit)."},
+    {"to_array", (PyCFunction)LuaObject_to_array, METH_VARARGS,
+        "Pack the numbers in the sequence part of a Lua table into an"
+        " array.array of the given typecode (default 'd')."},
+    {"keys", (PyCFunction)LuaObject_keys, METH_NOARGS,
+        "Iterate over the keys of a Lua table."},
+    {"values", (PyCFunction)LuaObject_values, METH_NOARGS,
+        "Iterate over the values of a Lua table."},
+    {"items", (PyCFunction)LuaObject_items, METH_NOARGS,
+        "Iterate over the (key, value) pairs of a Lua table."},
+    {"map", (PyCFunction)LuaObject_map, METH_VARARGS | METH_KEYWORDS,
+        "Call a Lua function once for each item of an iterable and return"
+        " a list of the results, or an iterator over them if stream is"
+        " true."},
+    {"call_many", (PyCFunction)LuaObject_call_many,
+        METH_VARARGS | METH_KEYWORDS,
+        "Call a Lua function once for each tuple of arguments in an"
+        " iterable and return a list of the results, or an iterator over"
+        " them if stream is true."},
+    {NULL}
+};
+
+static PyNumberMethods LuaObject_number = {
+    0,                          /*nb_add*/
+    0,                          /*nb_subtract*/
+    0,                          /*nb_multiply*/
+#ifndef PY3
+    0,                          /*nb_divide*/
+#endif
+    0,                          /*nb_remainder*/
+    0,                          /*nb_divmod*/
+    0,                          /*nb_power*/
+    0,                          /*nb_negative*/
+    0,                          /*nb_positive*/
+    0,                          /*nb_absolute*/
+    (inquiry)LuaObject_nonzero, /*nb_nonzero*/
+};
+
 static PyMappingMethods LuaObject_mapping = {
-    NULL,                                   /*mp_length*/
+    (lenfunc)LuaObject_length,               /*mp_length*/
     (binaryfunc)LuaObject_subscript,         /*mp_subscript*/
     (objobjargproc)LuaObject_ass_subscript,  /*mp_ass_subscript*/
 };
 
 static PyTypeObject LuaObjectType = {
-    PyObject_HEAD_INIT(NULL)
-    0,                          /*ob_size*/
+    PyVarObject_HEAD_INIT(NULL, 0)
     "lua.LuaObject",            /*tp_name*/
     sizeof(LuaObject),          /*tp_basicsize*/
     0,                          /*tp_itemsize*/
@@ -165,7 +610,7 @@ static PyTypeObject LuaObjectType = {
     0,                          /*tp_setattr*/
     0,                          /*tp_compare*/
     0,                          /*tp_repr*/
-    0,                          /*tp_as_number*/
+    &LuaObject_number,          /*tp_as_number*/
     0,                          /*tp_as_sequence*/
     &LuaObject_mapping,         /*tp_as_mapping*/
     0,                          /*tp_hash */
@@ -180,9 +625,9 @@ static PyTypeObject LuaObjectType = {
     0,                          /*tp_clear*/
     0,                          /*tp_richcompare*/
     0,                          /*tp_weaklistoffset*/
-    0,                          /*tp_iter*/
+    (getiterfunc)LuaObject_iter, /*tp_iter*/
     0,                          /*tp_iternext*/
-    0,                          /*tp_methods*/
+    LuaObject_methods,          /*tp_methods*/
     0,                          /*tp_members*/
     0,                          /*tp_getset*/
     0,                          /*tp_base*/
@@ -199,13 +644,119 @@ static PyTypeObject LuaObjectType = {
 
 static void LuaState_dealloc(LuaState *self)
 {
-    lua_close(self->L);
-    self->ob_type->tp_free(self);
+    if (self->L)
+        lua_close(self->L);
+    LuaAlloc_close(&self->alloc);
+    if (self->lock)
+        PyThread_free_lock(self->lock);
+    PyMem_Free(self->chunkused);
+    PyMem_Free(self->bytecodedir);
+    Py_XDECREF(self->keynames);
+    Lua_clearconverters(self);
+    Py_XDECREF(self->converters);
+    Py_TYPE(self)->tp_free(self);
 }
 
 static int LuaState_init(LuaState *self, PyObject *args, PyObject *kwds)
 {
-    self->L = luaL_newstate();
+    static char *kwlist[] = {"cache_size", "allocator", "memory_limit",
+        "buffer_threshold", "bytecode_cache", "integers", NULL};
+    int cachesize = LUA_CHUNKCACHE_SIZE, integers = 0;
+    char *allocator = "system", *bytecodedir = NULL;
+    Py_ssize_t limit = 0, threshold = -1;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|isnnzi", kwlist,
+                &cachesize, &allocator, &limit, &threshold, &bytecodedir,
+                &integers))
+        return -1;
+    if (cachesize < 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "cache_size must not be negative");
+        return -1;
+    }
+    if (strcmp(allocator, "system") != 0 && strcmp(allocator, "pool") != 0)
+    {
+        PyErr_SetString(PyExc_ValueError,
+                "allocator must be one of: system pool");
+        return -1;
+    }
+    if (limit < 0)
+    {
+        PyErr_SetString(PyExc_ValueError,
+                "memory_limit must not be negative");
+        return -1;
+    }
+    if (self->L)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "LuaState is already initialized");
+        return -1;
+    }
+
+    self->chunkused = PyMem_New(unsigned long, cachesize + 1);
+    if (self->chunkused == NULL)
+    {
+        PyErr_NoMemory();
+        return -1;
+    }
+    self->chunkcachesize = cachesize;
+    self->chunkcount = 0;
+    self->chunktick = 0;
+    self->bufferthreshold = threshold;
+    self->integers = integers;
+
+    if (bytecodedir != NULL)
+    {
+        self->bytecodedir = PyMem_Malloc(strlen(bytecodedir) + 1);
+        if (self->bytecodedir == NULL)
+        {
+            PyErr_NoMemory();
+            return -1;
+        }
+        strcpy(self->bytecodedir, bytecodedir);
+    }
+
+    self->lock = PyThread_allocate_lock();
+    if (self->lock == NULL)
+    {
+        PyErr_NoMemory();
+        return -1;
+    }
+    self->lockowner = 0;
+    self->lockdepth = 0;
+    self->tstate = NULL;
+
+    memset(&self->alloc, 0, sizeof(self->alloc));
+    self->alloc.pooled = strcmp(allocator, "pool") == 0;
+    self->alloc.limit = limit;
+
+    self->L = lua_newstate(LuaAlloc_alloc, &self->alloc);
+    if (self->L == NULL)
+    {
+        PyErr_NoMemory();
+        return -1;
+    }
+    lua_atpanic(self->L, lua_panic);
+    lua_createtable(self->L, 2 * cachesize, cachesize);
+    self->chunkcache = luaL_ref(self->L, LUA_REGISTRYINDEX);
+    lua_newtable(self->L);
+    self->wrappers = luaL_ref(self->L, LUA_REGISTRYINDEX);
+    lua_newtable(self->L);
+    self->keycache = luaL_ref(self->L, LUA_REGISTRYINDEX);
+    if ((self->keynames = PyList_New(0)) == NULL)
+        return -1;
+    lua_newtable(self->L);
+    lua_createtable(self->L, 0, 1);
+    lua_pushstring(self->L, "k");
+    lua_setfield(self->L, -2, "__mode");
+    lua_setmetatable(self->L, -2);
+    self->methodcache = luaL_ref(self->L, LUA_REGISTRYINDEX);
+    self->bundle = LUA_NOREF;
+    self->bundlesearcher = LUA_NOREF;
+    self->limit.budget = -1;
+    lua_pushlightuserdata(self->L, &lua_statekey);
+    lua_pushlightuserdata(self->L, self);
+    lua_rawset(self->L, LUA_REGISTRYINDEX);
+    Lua_newpymetatable(self);
     return 0;
 }
 
@@ -215,7 +766,12 @@ static PyMemberDef LuaState_members[] = {
 
 static PyObject *LuaState_openlibs(LuaState *self)
 {
+    Lua_lock(self);
     luaL_openlibs(self->L);
+    Lua_installpairs(self);
+    Lua_installresume(self);
+    Lua_installsearcher(self);
+    Lua_unlock(self);
     Py_RETURN_NONE;
 }
 
@@ -253,9 +809,18 @@ static PyObject *LuaState_openlib(LuaState *self, PyObject *args)
     {
         if (strcmp(libs->pyname, lib) == 0)
         {
+            Lua_lock(self);
             lua_pushcfunction(L, libs->func);
             lua_pushstring(L, libs->name);
             lua_call(L, 1, 0);
+            if (libs->func == luaopen_base)
+            {
+                Lua_installpairs(self);
+                Lua_installresume(self);
+            }
+            if (libs->func == luaopen_package)
+                Lua_installsearcher(self);
+            Lua_unlock(self);
             Py_RETURN_NONE;
         }
     }
@@ -274,406 +839,6067 @@ static PyObject *LuaState_openlib(LuaState *self, PyObject *args)
 
 static PyObject *LuaState_gettop(LuaState *self)
 {
-    return PyInt_FromLong(lua_gettop(self->L));
+    int top;
+
+    Lua_lock(self);
+    top = lua_gettop(self->L);
+    Lua_unlock(self);
+    return PyInt_FromLong(top);
 }
 
-static PyObject *LuaState_eval(LuaState *self, PyObject *args)
+static PyObject *LuaState_eval(LuaState *self, LUA_FASTARGS_KW)
 {
-    char *code;
+    const char *code;
+    Py_ssize_t len;
+    long budget;
+    double timeout;
+    LuaLimit saved;
 
-    int oldtop, numresults, ret;
+    int oldtop, numresults, status, limited;
     PyObject *result;
 
-    if (!PyArg_ParseTuple(args, "s", &code))
+#ifdef LUA_FASTCALL
+    if (!Lua_fastcode("eval", args, nargs, &code, &len)
+            || !Lua_parselimitkw(args + nargs, kwnames, &budget, &timeout))
+        return NULL;
+#else
+    if (!PyArg_ParseTuple(args, "s#", &code, &len)
+            || !Lua_parselimit(kwds, &budget, &timeout))
         return NULL;
+#endif
+    limited = budget > 0 || timeout > 0;
 
+    Lua_lock(self);
     oldtop = lua_gettop(self->L);
 
-    if (luaL_loadstring(self->L, code))
+    if ((status = Lua_loadchunk(self, code, len)))
     {
-        lua_pushstring(self->L, "error loading Lua code: ");
-        lua_insert(self->L, -2);
-        lua_concat(self->L, 2);
-        PyErr_SetString(PyExc_SyntaxError, lua_tostring(self->L, -1));
-        lua_pop(self->L, 1);
+        Lua_seterror(self, status, PyExc_SyntaxError,
+                "error loading Lua code: ");
+        Lua_unlock(self);
         return NULL;
     }
 
-    if (lua_pcall(self->L, 0, LUA_MULTRET, 0))
+    if (limited)
+        Lua_setlimit(self, &saved, budget, timeout, NULL);
+    status = Lua_pcall(self, 0, LUA_MULTRET);
+    if (status)
+        Lua_seterror(self, status, PyExc_RuntimeError, "lua error: ");
+    if (limited)
+        Lua_restorelimit(self, &saved);
+    if (status)
     {
-        lua_pushstring(self->L, "lua error: ");
-        lua_insert(self->L, -2);
-        lua_concat(self->L, 2);
-        PyErr_SetString(PyExc_RuntimeError, lua_tostring(self->L, -1));
-        lua_pop(self->L, 1);
+        Lua_unlock(self);
         return NULL;
     }
 
     numresults = lua_gettop(self->L) - oldtop;
     result = Lua_topython_multiple(self, numresults);
     lua_pop(self->L, numresults);
+    Lua_unlock(self);
+    return result;
+}
+
+static PyObject *LuaState_compile(LuaState *self, LUA_FASTARGS)
+{
+    const char *code;
+    Py_ssize_t len;
+    int status;
+    PyObject *result;
+
+#ifdef LUA_FASTCALL
+    if (!Lua_fastcode("compile", args, nargs, &code, &len))
+        return NULL;
+#else
+    if (!PyArg_ParseTuple(args, "s#", &code, &len))
+        return NULL;
+#endif
+
+    Lua_lock(self);
+    if ((status = Lua_loadsource(self, code, len)))
+    {
+        Lua_seterror(self, status, PyExc_SyntaxError,
+                "error loading Lua code: ");
+        Lua_unlock(self);
+        return NULL;
+    }
+
+    result = Lua_topython(self, -1);
+    lua_pop(self->L, 1);
+    Lua_unlock(self);
     return result;
 }
 
 static PyObject *LuaState_globals(LuaState *self, PyObject *args)
 {
     PyObject *ret;
+    Lua_lock(self);
     lua_pushvalue(self->L, LUA_GLOBALSINDEX);
     ret = Lua_topython(self, -1);
     lua_pop(self->L, 1);
+    Lua_unlock(self);
     return ret;
 }
 
-static PyMethodDef LuaState_methods[] = {
+static PyObject *LuaState_table(LuaState *self, PyObject *args, PyObject
+        *kwds)
+{
+    static char *kwlist[] = {"obj", "deep", "depth", NULL};
+    PyObject *o, *result = NULL;
+    int deep = 1, depth = -1, memo;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|ii", kwlist, &o, &deep,
+                &depth))
+        return NULL;
+    if (!PyDict_Check(o) && !PyList_Check(o) && !PyTuple_Check(o))
+    {
+        PyErr_SetString(PyExc_TypeError,
+                "table() needs a dict, list or tuple");
+        return NULL;
+    }
+    if (!deep)
+        depth = 1;
+
+    Lua_lock(self);
+    lua_newtable(self->L);
+    memo = lua_gettop(self->L);
+    if (Lua_pushtable(self, o, depth, memo))
+    {
+        result = Lua_topython(self, -1);
+        lua_pop(self->L, 1);
+    }
+    lua_pop(self->L, 1);
+    Lua_unlock(self);
+    return result;
+}
+
+static PyObject *LuaState_memstats(LuaState *self)
+{
+    return Py_BuildValue("{s:n,s:n,s:n,s:k,s:k}",
+            "live", (Py_ssize_t)self->alloc.live,
+            "peak", (Py_ssize_t)self->alloc.peak,
+            "limit", (Py_ssize_t)self->alloc.limit,
+            "allocs", self->alloc.allocs,
+            "frees", self->alloc.frees);
+}
+
+static PyObject *LuaState_load(LuaState *self, PyObject *args, PyObject
+        *kwds)
+{
+    static char *kwlist[] = {"source", "chunkname", NULL};
+    PyObject *o, *path = NULL, *name = NULL, *attr, *result = NULL;
+    const char *chunkname = NULL;
+    LuaReader r;
+    Py_buffer view;
+    const void *data;
+    Py_ssize_t len;
+    int exported = 0, status;
+#ifndef PY3
+    int pyfile = 0;
+#endif
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|z", kwlist, &o,
+                &chunkname))
+        return NULL;
+
+    memset(&r, 0, offsetof(LuaReader, buf));
+    if (PyUnicode_Check(o))
+    {
+#ifdef PY3
+        path = PyUnicode_EncodeFSDefault(o);
+#else
+        path = PyUnicode_AsEncodedString(o, Py_FileSystemDefaultEncoding,
+                NULL);
+#endif
+        if (path == NULL)
+            return NULL;
+    }
+    else if (PyBytes_Check(o))
+    {
+        Py_INCREF(o);
+        path = o;
+    }
+
+    if (path != NULL)
+    {
+        Py_BEGIN_ALLOW_THREADS
+        r.file = fopen(PyBytes_AS_STRING(path), "rb");
+        Py_END_ALLOW_THREADS
+        if (r.file == NULL)
+        {
+            PyErr_SetFromErrnoWithFilename(PyExc_IOError,
+                    PyBytes_AS_STRING(path));
+            goto done;
+        }
+        name = PyString_FromFormat("@%s", PyBytes_AS_STRING(path));
+    }
+#ifndef PY3
+    else if (PyFile_Check(o))
+    {
+        // read straight from the FILE behind a Python file object
+        if ((r.file = PyFile_AsFile(o)) == NULL)
+        {
+            PyErr_SetString(PyExc_ValueError, "I/O operation on closed file");
+            goto done;
+        }
+        PyFile_IncUseCount((PyFileObject *)o);
+        pyfile = 1;
+        name = PyString_FromFormat("@%s",
+                PyString_AsString(PyFile_Name(o)));
+    }
+#endif
+    else if (Lua_isbufferobject(o))
+    {
+        if (PyObject_CheckBuffer(o))
+        {
+            if (PyObject_GetBuffer(o, &view, PyBUF_SIMPLE) < 0)
+                goto done;
+            exported = 1;
+            data = view.buf;
+            len = view.len;
+        }
+#ifndef PY3
+        else if (PyObject_AsReadBuffer(o, &data, &len) < 0)
+        {
+            goto done;
+        }
+#else
+        else
+        {
+            PyErr_Format(PyExc_TypeError, "cannot load from %.200s",
+                    Py_TYPE(o)->tp_name);
+            goto done;
+        }
+#endif
+        r.data = data;
+        r.len = len;
+    }
+    else
+    {
+        r.read = PyObject_GetAttrString(o, "read");
+        if (r.read == NULL)
+        {
+            PyErr_Clear();
+            r.read = PyObject_GetAttrString(o, "recv");
+        }
+        if (r.read == NULL)
+        {
+            PyErr_SetString(PyExc_TypeError,
+                    "load() needs a path, buffer or file-like object");
+            goto done;
+        }
+        attr = PyObject_GetAttrString(o, "name");
+        if (attr != NULL && PyString_Check(attr))
+            name = PyString_FromFormat("@%s", PyString_AS_STRING(attr));
+        Py_XDECREF(attr);
+        PyErr_Clear();
+    }
+    if (PyErr_Occurred())
+        goto done;
+    if (chunkname == NULL)
+        chunkname = name != NULL ? PyString_AS_STRING(name) : "=(load)";
+
+    Lua_lock(self);
+    status = Lua_loadreader(self, &r, chunkname);
+    if (r.failed)
+    {
+        // the exception raised while reading wins over the Lua result
+        lua_pop(self->L, 1);
+    }
+    else if (status)
+    {
+        Lua_seterror(self, status, PyExc_SyntaxError,
+                "error loading Lua code: ");
+    }
+    else
+    {
+        result = Lua_topython(self, -1);
+        lua_pop(self->L, 1);
+    }
+    Lua_unlock(self);
+
+done:
+    if (path != NULL && r.file != NULL)
+        fclose(r.file);
+#ifndef PY3
+    if (pyfile)
+        PyFile_DecUseCount((PyFileObject *)o);
+#endif
+    if (exported)
+        PyBuffer_Release(&view);
+    Py_XDECREF(path);
+    Py_XDECREF(name);
+    Py_XDECREF(r.read);
+    Py_XDECREF(r.block);
+    return result;
+}
+
+static PyObject *LuaState_dump(LuaState *self, PyObject *args)
+{
+    LuaObject *f;
+    LuaDump d = {NULL, 0, 0};
+    int status;
+    PyObject *result;
+    lua_State *L = self->L;
+
+    if (!PyArg_ParseTuple(args, "O!", &LuaObjectType, &f))
+        return NULL;
+    if (f->lua != self)
+    {
+        PyErr_SetString(PyExc_ValueError,
+                "dump() needs a function from this LuaState");
+        return NULL;
+    }
+
+    Lua_lock(self);
+    lua_pushluaobject(L, f);
+    if (!lua_isfunction(L, -1) || lua_iscfunction(L, -1))
+    {
+        lua_pop(L, 1);
+        Lua_unlock(self);
+        PyErr_SetString(PyExc_TypeError, "dump() needs a Lua function");
+        return NULL;
+    }
+    status = lua_dump(L, lua_dumpwriter, &d);
+    lua_pop(L, 1);
+    Lua_unlock(self);
+
+    if (status)
+        result = PyErr_NoMemory();
+    else
+        result = PyBytes_FromStringAndSize(d.data, d.len);
+    PyMem_Free(d.data);
+    return result;
+}
+
+static PyObject *LuaState_load_bytecode(LuaState *self, PyObject *args,
+        PyObject *kwds)
+{
+    static char *kwlist[] = {"data", "name", NULL};
+    PyObject *o, *result = NULL;
+    char *name = "=bytecode";
+    Py_buffer view;
+    const void *data;
+    Py_ssize_t len;
+    int exported = 0, status;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|s", kwlist, &o, &name))
+        return NULL;
+
+    // the bytecode is read in place, so an mmap'd file is never copied
+    if (PyObject_CheckBuffer(o))
+    {
+        if (PyObject_GetBuffer(o, &view, PyBUF_SIMPLE) < 0)
+            return NULL;
+        exported = 1;
+        data = view.buf;
+        len = view.len;
+    }
+#ifdef PY3
+    else
+    {
+        PyErr_SetString(PyExc_TypeError, "bytecode must be a buffer");
+        return NULL;
+    }
+#else
+    else if (PyObject_AsReadBuffer(o, &data, &len) < 0)
+    {
+        return NULL;
+    }
+#endif
+
+    if (len < (Py_ssize_t)sizeof(LUA_SIGNATURE) - 1
+            || memcmp(data, LUA_SIGNATURE, sizeof(LUA_SIGNATURE) - 1) != 0)
+    {
+        PyErr_SetString(PyExc_ValueError,
+                "load_bytecode() needs precompiled Lua code");
+    }
+    else
+    {
+        Lua_lock(self);
+        if ((status = Lua_loadbuffer(self, data, len, name)))
+        {
+            Lua_seterror(self, status, PyExc_SyntaxError,
+                    "error loading Lua bytecode: ");
+        }
+        else
+        {
+            result = Lua_topython(self, -1);
+            lua_pop(self->L, 1);
+        }
+        Lua_unlock(self);
+    }
+
+    if (exported)
+        PyBuffer_Release(&view);
+    return result;
+}
+
+static PyObject *LuaState_register(LuaState *self, PyObject *args,
+        PyObject *kwds)
+{
+    static char *kwlist[] = {"name", "func", "argtypes", "restype", NULL};
+    PyObject *func, *argtypes = Py_None, *restype = NULL, *seq = NULL;
+    LuaPyFunction *f;
+    char *name;
+    char types[LUA_REGISTER_MAXARGS];
+    int nargs = -1, res, type, i;
+    lua_State *L = self->L;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "sO|OO", kwlist, &name,
+                &func, &argtypes, &restype))
+        return NULL;
+    if (!PyCallable_Check(func))
+    {
+        PyErr_SetString(PyExc_TypeError, "func must be callable");
+        return NULL;
+    }
+    if (argtypes != Py_None)
+    {
+        seq = PySequence_Fast(argtypes, "argtypes must be a sequence");
+        if (seq == NULL)
+            return NULL;
+        if (PySequence_Fast_GET_SIZE(seq) > LUA_REGISTER_MAXARGS)
+        {
+            Py_DECREF(seq);
+            PyErr_Format(PyExc_ValueError, "at most %d argtypes",
+                    LUA_REGISTER_MAXARGS);
+            return NULL;
+        }
+        nargs = (int)PySequence_Fast_GET_SIZE(seq);
+        for (i = 0; i < nargs; ++i)
+        {
+            type = Lua_parsetype(PySequence_Fast_GET_ITEM(seq, i), 0);
+            if (type < 0)
+            {
+                Py_DECREF(seq);
+                return NULL;
+            }
+            types[i] = (char)type;
+        }
+        Py_DECREF(seq);
+    }
+    res = Lua_parsetype(restype, 1);
+    if (res < 0)
+        return NULL;
+
+    Lua_lock(self);
+    lua_pushlightuserdata(L, self);
+    f = (LuaPyFunction *)lua_newuserdata(L, sizeof(LuaPyFunction));
+    Py_INCREF(func);
+    f->func = func;
+    f->args = NULL;
+    f->nargs = nargs;
+    if (nargs > 0)
+        memcpy(f->argtypes, types, nargs);
+    f->restype = res;
+    luaL_getmetatable(L, PYFUNCTION);
+    lua_setmetatable(L, -2);
+    lua_pushcclosure(L, lua_func_call, 2);
+    lua_setglobal(L, name);
+    Lua_unlock(self);
+    Py_RETURN_NONE;
+}
+
+static PyObject *LuaState_add_converter(LuaState *self, PyObject *args)
+{
+    PyObject *type, *func;
+    int ret;
+
+    if (!PyArg_ParseTuple(args, "O!O", &PyType_Type, &type, &func))
+        return NULL;
+    if (func != Py_None && !PyCallable_Check(func))
+    {
+        PyErr_SetString(PyExc_TypeError, "converter must be callable");
+        return NULL;
+    }
+
+    Lua_lock(self);
+    if (self->converters == NULL)
+        self->converters = PyDict_New();
+    if (self->converters == NULL)
+        ret = -1;
+    else if (func == Py_None)
+        ret = PyDict_DelItem(self->converters, type);
+    else
+        ret = PyDict_SetItem(self->converters, type, func);
+    // subclasses may be affected too, so start over
+    Lua_clearconverters(self);
+    Lua_unlock(self);
+    if (ret == -1)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject *LuaState_add_bundle(LuaState *self, PyObject *args)
+{
+    PyObject *o, *items, *item;
+    Py_ssize_t i, n;
+    lua_State *L = self->L;
+    int ok = 1;
+
+    if (!PyArg_ParseTuple(args, "O", &o))
+        return NULL;
+
+    Lua_lock(self);
+    if (self->bundle == LUA_NOREF)
+    {
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        self->bundle = luaL_ref(L, LUA_REGISTRYINDEX);
+        lua_pushcclosure(L, lua_bundle_searcher, 1);
+        self->bundlesearcher = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+
+    if (PyDict_Check(o) || (PyMapping_Check(o) && !PyBytes_Check(o)
+                && !PyUnicode_Check(o) && !Lua_isbufferobject(o)
+                && PyObject_HasAttrString(o, "items")))
+    {
+        items = PyMapping_Items(o);
+        n = items != NULL ? PyList_GET_SIZE(items) : 0;
+        ok = items != NULL;
+        for (i = 0; ok && i < n; ++i)
+        {
+            item = PyList_GET_ITEM(items, i);
+            ok = Lua_addmodule(self, PyTuple_GET_ITEM(item, 0),
+                    PyTuple_GET_ITEM(item, 1), 0);
+        }
+        Py_XDECREF(items);
+    }
+    else
+    {
+        ok = Lua_addzipbundle(self, o);
+    }
+
+    Lua_installsearcher(self);
+    Lua_unlock(self);
+    if (!ok)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject *LuaState_profile_start(LuaState *self, PyObject *args,
+        PyObject *kwds)
+{
+    static char *kwlist[] = {"interval", "lines", NULL};
+    int interval = 1000, lines = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|ii", kwlist, &interval,
+                &lines))
+        return NULL;
+    if (interval <= 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "interval must be positive");
+        return NULL;
+    }
+    if (self->profiling)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "the profiler is already running");
+        return NULL;
+    }
+
+    Lua_lock(self);
+    lua_pushlightuserdata(self->L, &lua_profilekey);
+    lua_newtable(self->L);
+    lua_rawset(self->L, LUA_REGISTRYINDEX);
+    self->profiling = 1;
+    self->profileinterval = interval;
+    self->profilelines = lines;
+    self->profileleft = interval;
+    Lua_updatehook(self, self->L);
+    self->pycalls = 0;
+    self->pytime = 0;
+    Lua_unlock(self);
+    Py_RETURN_NONE;
+}
+
+static PyObject *LuaState_profile_stop(LuaState *self)
+{
+    PyObject *stacks, *keys, *key, *value, *collapsed, *line;
+    Py_ssize_t i, n;
+    long samples = 0;
+    int ok = 1;
+    lua_State *L = self->L;
+
+    if (!self->profiling)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "the profiler is not running");
+        return NULL;
+    }
+
+    Lua_lock(self);
+    self->profiling = 0;
+    Lua_updatehook(self, L);
+    lua_pushlightuserdata(L, &lua_profilekey);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    stacks = PyDict_New();
+    lua_pushnil(L);
+    while (lua_next(L, -2))
+    {
+        if (ok && stacks != NULL)
+        {
+            key = PyString_FromString(lua_tostring(L, -2));
+            value = PyInt_FromLong((long)lua_tointeger(L, -1));
+            ok = key != NULL && value != NULL
+                && PyDict_SetItem(stacks, key, value) == 0;
+            samples += (long)lua_tointeger(L, -1);
+            Py_XDECREF(key);
+            Py_XDECREF(value);
+        }
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+    lua_pushlightuserdata(L, &lua_profilekey);
+    lua_pushnil(L);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+    Lua_unlock(self);
+    if (!ok)
+        Py_CLEAR(stacks);
+    if (stacks == NULL)
+        return NULL;
+
+    // one "frame;frame;frame count" line per stack, as flamegraph.pl wants
+    keys = PyDict_Keys(stacks);
+    collapsed = PyString_FromString("");
+    if (keys == NULL || PyList_Sort(keys) < 0)
+        Py_CLEAR(collapsed);
+    n = keys != NULL ? PyList_GET_SIZE(keys) : 0;
+    for (i = 0; collapsed != NULL && i < n; ++i)
+    {
+        key = PyList_GET_ITEM(keys, i);
+        line = PyString_FromFormat("%s %ld\n", PyString_AS_STRING(key),
+                PyInt_AS_LONG(PyDict_GetItem(stacks, key)));
+        PyString_ConcatAndDel(&collapsed, line);
+    }
+    Py_XDECREF(keys);
+    if (collapsed == NULL)
+    {
+        Py_DECREF(stacks);
+        return NULL;
+    }
+
+    return Py_BuildValue("{s:N,s:N,s:l,s:k,s:d}",
+            "stacks", stacks,
+            "collapsed", collapsed,
+            "samples", samples,
+            "python_calls", self->pycalls,
+            "python_time", self->pytime);
+}
+
+static PyObject *LuaState_stats(LuaState *self, PyObject *args, PyObject
+        *kwds)
+{
+#ifdef STATS
+    static const char *pytypes[LUA_STAT_PYTYPES] = {"None", "bool", "int",
+        "float", "str", "unicode", "LuaObject", "buffer", "other"};
+    static char *kwlist[] = {"reset", NULL};
+    PyObject *result, *push, *topython, *o;
+    int i, reset = 0, ok;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|i", kwlist, &reset))
+        return NULL;
+
+    Lua_lock(self);
+    result = PyDict_New();
+    push = PyDict_New();
+    topython = PyDict_New();
+    ok = result != NULL && push != NULL && topython != NULL;
+    for (i = 0; ok && i < LUA_STAT_PYTYPES; ++i)
+    {
+        if (self->stats.push[i].count == 0)
+            continue;
+        o = Lua_counter(&self->stats.push[i]);
+        ok = o != NULL && PyDict_SetItemString(push, pytypes[i], o) == 0;
+        Py_XDECREF(o);
+    }
+    for (i = 0; ok && i < LUA_STAT_LUATYPES; ++i)
+    {
+        if (self->stats.topython[i].count == 0)
+            continue;
+        o = Lua_counter(&self->stats.topython[i]);
+        ok = o != NULL && PyDict_SetItemString(topython,
+                i == 0 ? "none" : lua_typename(self->L, i - 1), o) == 0;
+        Py_XDECREF(o);
+    }
+    ok = ok && PyDict_SetItemString(result, "push", push) == 0
+        && PyDict_SetItemString(result, "topython", topython) == 0;
+    if (ok)
+    {
+        o = Py_BuildValue("{s:N,s:N,s:N,s:k,s:k,s:k}",
+                "call", Lua_counter(&self->stats.call),
+                "callback", Lua_counter(&self->stats.callback),
+                "compile", Lua_counter(&self->stats.compile),
+                "cachehits", self->stats.cachehits,
+                "wrapped", self->stats.wrapped,
+                "unwrapped", self->stats.unwrapped);
+        ok = o != NULL && PyDict_Update(result, o) == 0;
+        Py_XDECREF(o);
+    }
+    if (ok && reset)
+        memset(&self->stats, 0, sizeof(self->stats));
+    Lua_unlock(self);
+
+    Py_XDECREF(push);
+    Py_XDECREF(topython);
+    if (!ok)
+        Py_CLEAR(result);
+    return result;
+#else
+    static char *kwlist[] = {"reset", NULL};
+    int reset = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|i", kwlist, &reset))
+        return NULL;
+    return PyDict_New();
+#endif
+}
+
+static PyObject *LuaState_spawn(LuaState *self, PyObject *args)
+{
+    LuaObject *f;
+    LuaTask *task;
+    lua_State *co, *L = self->L;
+    Py_ssize_t i, n = PyTuple_GET_SIZE(args);
+
+    if (n < 1 || !PyObject_TypeCheck(PyTuple_GET_ITEM(args, 0),
+                &LuaObjectType)
+            || ((LuaObject *)PyTuple_GET_ITEM(args, 0))->lua != self)
+    {
+        PyErr_SetString(PyExc_TypeError,
+                "spawn() needs a function from this LuaState");
+        return NULL;
+    }
+    f = (LuaObject *)PyTuple_GET_ITEM(args, 0);
+
+    task = (LuaTask *)LuaTaskType.tp_alloc(&LuaTaskType, 0);
+    if (task == NULL)
+        return NULL;
+
+    Lua_lock(self);
+    co = lua_newthread(L);
+    if (n > INT_MAX - LUA_MINSTACK
+            || !lua_checkstack(L, (int)n + LUA_MINSTACK)
+            || !lua_checkstack(co, (int)n + LUA_MINSTACK))
+    {
+        lua_pop(L, 1);
+        Lua_unlock(self);
+        Py_DECREF(task);
+        PyErr_SetString(PyExc_OverflowError, "too many arguments for Lua");
+        return NULL;
+    }
+    task->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_pushluaobject(L, f);
+    for (i = 1; i < n; ++i)
+        Lua_pushpyobject(self, PyTuple_GET_ITEM(args, i));
+    lua_xmove(L, co, (int)n);
+    Lua_unlock(self);
+
+    Py_INCREF(self);
+    task->lua = self;
+    task->nargs = (int)n - 1;
+    return (PyObject *)task;
+}
+
+static PyObject *LuaState_coroutine(LuaState *self, PyObject *args)
+{
+    LuaObject *f;
+    PyObject *result;
+    lua_State *co, *L = self->L;
+
+    if (!PyArg_ParseTuple(args, "O!", &LuaObjectType, &f))
+        return NULL;
+    if (f->lua != self)
+    {
+        PyErr_SetString(PyExc_ValueError,
+                "coroutine() needs a function from this LuaState");
+        return NULL;
+    }
+
+    Lua_lock(self);
+    lua_pushluaobject(L, f);
+    if (!lua_iscallable(L, -1))
+    {
+        lua_pop(L, 1);
+        Lua_unlock(self);
+        PyErr_SetString(PyExc_ValueError, "this LuaObject isn't callable");
+        return NULL;
+    }
+    co = lua_newthread(L);
+    lua_insert(L, -2);
+    lua_xmove(L, co, 1);
+    result = Lua_topython(self, -1);
+    lua_pop(L, 1);
+    Lua_unlock(self);
+    return result;
+}
+
+static PyMethodDef LuaState_methods[] = {
     {"openlibs", (PyCFunction)LuaState_openlibs, METH_NOARGS,
         "Load the Lua libraries."},
     {"openlib", (PyCFunction)LuaState_openlib, METH_VARARGS,
         "Load a particular Lua library."},
     {"gettop", (PyCFunction)LuaState_gettop, METH_NOARGS,
         "(debug) Gets the top index of the Lua stack."},
-    {"eval", (PyCFunction)LuaState_eval, METH_VARARGS,
-        "Run a piece of Lua code."},
+    {"eval", (PyCFunction)LuaState_eval, LUA_METH_FASTCALL_KW,
+        "Run a piece of Lua code. With max_instructions or timeout (in"
+        " seconds), raise LuaLimitError once it runs over."},
+    {"compile", (PyCFunction)LuaState_compile, LUA_METH_FASTCALL,
+        "Compile a piece of Lua code into a callable LuaObject."},
     {"globals", (PyCFunction)LuaState_globals, METH_NOARGS,
         "Gets the Lua globals table."},
+    {"table", (PyCFunction)LuaState_table, METH_VARARGS | METH_KEYWORDS,
+        "Copy a dict, list or tuple into a new Lua table. Nested containers"
+        " are copied too unless deep is false, up to depth levels deep"
+        " (-1 for no limit)."},
+    {"memstats", (PyCFunction)LuaState_memstats, METH_NOARGS,
+        "Gets memory statistics of the Lua allocator."},
+    {"coroutine", (PyCFunction)LuaState_coroutine, METH_VARARGS,
+        "Create a Lua coroutine running func, like coroutine.create."},
+    {"spawn", (PyCFunction)LuaState_spawn, METH_VARARGS,
+        "Start func(*args) in a new coroutine and return a LuaTask that"
+        " runs it in time slices."},
+    {"stats", (PyCFunction)LuaState_stats, METH_VARARGS | METH_KEYWORDS,
+        "Gets (count, nanoseconds) counters of conversions, calls and"
+        " compiles through the binding, and LuaObject creations and"
+        " deletions, zeroing them if reset is true. Empty unless built"
+        " with STATS defined."},
+    {"profile_start", (PyCFunction)LuaState_profile_start,
+        METH_VARARGS | METH_KEYWORDS,
+        "Start sampling the Lua stack every interval VM instructions, down"
+        " to the current line of the innermost function if lines is"
+        " true."},
+    {"profile_stop", (PyCFunction)LuaState_profile_stop, METH_NOARGS,
+        "Stop the profiler and return a dict with the sample count of each"
+        " stack, the same in collapsed-stack text for flame graphs, and"
+        " the number of and seconds spent in calls into Python."},
+    {"register", (PyCFunction)LuaState_register,
+        METH_VARARGS | METH_KEYWORDS,
+        "register(name, func, argtypes=None, restype=object): Make func the"
+        " Lua global name, called directly rather than through a wrapped"
+        " object. argtypes lists int, float, str, bool or object for each"
+        " argument. int, float and str arguments are required and checked"
+        " like luaL_check*; a missing bool is False and a missing object"
+        " None. restype is one of those or None to return nothing."},
+    {"add_converter", (PyCFunction)LuaState_add_converter, METH_VARARGS,
+        "Convert instances of a type, and of its subclasses, with"
+        " func(obj) whenever they are passed to Lua. The result is passed"
+        " on in its place. None removes the converter."},
+    {"add_bundle", (PyCFunction)LuaState_add_bundle, METH_VARARGS,
+        "Make modules available to require() without searching the"
+        " filesystem. Takes a dict of module names to source or bytecode"
+        " (strings or buffers, e.g. slices of an mmap), or a zip file or"
+        " its path holding .lua and .luac files."},
+    {"load", (PyCFunction)LuaState_load, METH_VARARGS | METH_KEYWORDS,
+        "Compile Lua code from a path, a file-like object with read() or"
+        " recv(), or a buffer, streaming it in blocks, into a callable"
+        " LuaObject. chunkname is used in error messages."},
+    {"dump", (PyCFunction)LuaState_dump, METH_VARARGS,
+        "Precompile a Lua function into a string of bytecode."},
+    {"load_bytecode", (PyCFunction)LuaState_load_bytecode,
+        METH_VARARGS | METH_KEYWORDS,
+        "Load bytecode from dump() out of a string, buffer or mmap without"
+        " copying it, returning the function. Only load trusted bytecode:"
+        " Lua does not verify it fully."},
+    {NULL}
+};
+
+static PyTypeObject LuaStateType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "lua.LuaState",             /*tp_name*/
+    sizeof(LuaState),           /*tp_basicsize*/
+    0,                          /*tp_itemsize*/
+    (destructor)LuaState_dealloc, /*tp_dealloc*/
+    0,                          /*tp_print*/
+    0,                          /*tp_getattr*/
+    0,                          /*tp_setattr*/
+    0,                          /*tp_compare*/
+    0,                          /*tp_repr*/
+    0,                          /*tp_as_number*/
+    0,                          /*tp_as_sequence*/
+    0,                          /*tp_as_mapping*/
+    0,                          /*tp_hash */
+    0,                          /*tp_call*/
+    0,                          /*tp_str*/
+    0,                          /*tp_getattro*/
+    0,                          /*tp_setattro*/
+    0,                          /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,         /*tp_flags*/
+    "Lua state objects",        /*tp_doc*/
+    0,                          /*tp_traverse*/
+    0,                          /*tp_clear*/
+    0,                          /*tp_richcompare*/
+    0,                          /*tp_weaklistoffset*/
+    0,                          /*tp_iter*/
+    0,                          /*tp_iternext*/
+    LuaState_methods,           /*tp_methods*/
+    LuaState_members,           /*tp_members*/
+    0,                          /*tp_getset*/
+    0,                          /*tp_base*/
+    0,                          /*tp_dict*/
+    0,                          /*tp_descr_get*/
+    0,                          /*tp_descr_set*/
+    0,                          /*tp_dictoffset*/
+    (initproc)LuaState_init,    /*tp_init*/
+    0,                          /*tp_alloc*/
+    PyType_GenericNew,          /*tp_new*/
+};
+
+/* LuaStatePool type ********************************************************/
+
+static void LuaStatePool_dealloc(LuaStatePool *self)
+{
+    Py_XDECREF(self->states);
+    Py_XDECREF(self->idle);
+    Py_XDECREF(self->lent);
+    if (self->gate)
+        PyThread_free_lock(self->gate);
+    Py_TYPE(self)->tp_free(self);
+}
+
+static int LuaStatePool_init(LuaStatePool *self, PyObject *args, PyObject
+        *kwds)
+{
+    static char *kwlist[] = {"size", "init", "openlibs", NULL};
+    int size, openlibs = 1, i;
+    PyObject *init = Py_None, *poolkw, *statekw, *noargs, *state, *ret;
+
+    if (self->states)
+    {
+        PyErr_SetString(PyExc_RuntimeError,
+                "LuaStatePool is already initialized");
+        return -1;
+    }
+
+    // our own arguments are picked out; the rest go to LuaState()
+    statekw = kwds ? PyDict_Copy(kwds) : PyDict_New();
+    if (statekw == NULL)
+        return -1;
+    if ((poolkw = PyDict_New()) == NULL)
+        goto fail;
+    for (i = 0; kwlist[i]; ++i)
+    {
+        PyObject *v = PyDict_GetItemString(statekw, kwlist[i]);
+        if (v && (PyDict_SetItemString(poolkw, kwlist[i], v) < 0
+                    || PyDict_DelItemString(statekw, kwlist[i]) < 0))
+        {
+            Py_DECREF(poolkw);
+            goto fail;
+        }
+    }
+    i = PyArg_ParseTupleAndKeywords(args, poolkw, "i|Oi", kwlist, &size,
+            &init, &openlibs);
+    Py_DECREF(poolkw);
+    if (!i)
+        goto fail;
+    if (size < 1)
+    {
+        PyErr_SetString(PyExc_ValueError, "size must be positive");
+        goto fail;
+    }
+
+    self->gate = PyThread_allocate_lock();
+    self->states = PyList_New(0);
+    self->idle = PyList_New(0);
+    self->lent = PyList_New(0);
+    if (!self->gate || !self->states || !self->idle || !self->lent)
+        goto fail;
+
+    if ((noargs = PyTuple_New(0)) == NULL)
+        goto fail;
+    for (i = 0; i < size; ++i)
+    {
+        state = PyObject_Call((PyObject *)&LuaStateType, noargs, statekw);
+        if (state == NULL || PyList_Append(self->states, state) < 0
+                || PyList_Append(self->idle, state) < 0)
+        {
+            Py_XDECREF(state);
+            Py_DECREF(noargs);
+            goto fail;
+        }
+        Py_DECREF(state);
+
+        if (openlibs)
+        {
+            if ((ret = LuaState_openlibs((LuaState *)state)) == NULL)
+            {
+                Py_DECREF(noargs);
+                goto fail;
+            }
+            Py_DECREF(ret);
+        }
+        if (init != Py_None)
+        {
+            ret = PyObject_CallMethod(state, "eval", "O", init);
+            if (ret == NULL)
+            {
+                Py_DECREF(noargs);
+                goto fail;
+            }
+            Py_DECREF(ret);
+        }
+    }
+    Py_DECREF(noargs);
+
+    Py_DECREF(statekw);
+    return 0;
+
+fail:
+    Py_DECREF(statekw);
+    return -1;
+}
+
+static PyObject *LuaStatePool_take(LuaStatePool *self, int blocking)
+    // new reference; NULL without an exception if none is free
+{
+    PyObject *state;
+    Py_ssize_t n;
+
+    // the gate is held exactly while the idle list is empty
+    if (!PyThread_acquire_lock(self->gate, NOWAIT_LOCK))
+    {
+        if (!blocking)
+            return NULL;
+        Py_BEGIN_ALLOW_THREADS
+        PyThread_acquire_lock(self->gate, WAIT_LOCK);
+        Py_END_ALLOW_THREADS
+    }
+
+    n = PyList_GET_SIZE(self->idle);
+    state = PyList_GET_ITEM(self->idle, n - 1);
+    Py_INCREF(state);
+    PyList_SetSlice(self->idle, n - 1, n, NULL);
+    if (n > 1)
+        PyThread_release_lock(self->gate);
+    return state;
+}
+
+static void LuaStatePool_give(LuaStatePool *self, PyObject *state)
+{
+    PyList_Append(self->idle, state);
+    if (PyList_GET_SIZE(self->idle) == 1)
+        PyThread_release_lock(self->gate);
+}
+
+static PyObject *LuaStatePool_acquire(LuaStatePool *self, PyObject *args)
+{
+    int blocking = 1;
+    PyObject *state;
+
+    if (!PyArg_ParseTuple(args, "|i", &blocking))
+        return NULL;
+
+    state = LuaStatePool_take(self, blocking);
+    if (state == NULL)
+        Py_RETURN_NONE;
+    if (PyList_Append(self->lent, state) < 0)
+    {
+        LuaStatePool_give(self, state);
+        Py_DECREF(state);
+        return NULL;
+    }
+    return state;
+}
+
+static PyObject *LuaStatePool_release(LuaStatePool *self, PyObject *state)
+{
+    Py_ssize_t i, n;
+
+    // only states handed out by acquire() and not yet back, compared by
+    // identity; states that call() is using are not the caller's to give
+    n = self->lent ? PyList_GET_SIZE(self->lent) : 0;
+    for (i = 0; i < n; ++i)
+        if (PyList_GET_ITEM(self->lent, i) == state)
+            break;
+    if (i == n)
+    {
+        PyErr_SetString(PyExc_ValueError,
+                "state was not acquired from this pool");
+        return NULL;
+    }
+
+    LuaStatePool_give(self, state);
+    PyList_SetSlice(self->lent, i, i + 1, NULL);
+    Py_RETURN_NONE;
+}
+
+static PyObject *LuaStatePool_call(LuaStatePool *self, LUA_FASTARGS)
+{
+    const char *name;
+    PyObject *const *argv;
+    Py_ssize_t argc;
+    PyObject *state, *result;
+    LuaState *lua;
+
+#ifdef LUA_FASTCALL
+    argv = args;
+    argc = nargs;
+#else
+    argv = &PyTuple_GET_ITEM(args, 0);
+    argc = PyTuple_GET_SIZE(args);
+#endif
+    if (argc < 1 || !PyString_Check(argv[0]))
+    {
+        PyErr_SetString(PyExc_TypeError,
+                "call() needs the name of a Lua function");
+        return NULL;
+    }
+    name = PyString_AsString(argv[0]);
+    if (name == NULL)
+        return NULL;
+
+    state = LuaStatePool_take(self, 1);
+    lua = (LuaState *)state;
+
+    Lua_lock(lua);
+    lua_getglobal(lua->L, name);
+    if (!lua_iscallable(lua->L, -1))
+    {
+        lua_pop(lua->L, 1);
+        PyErr_Format(PyExc_ValueError, "no Lua function named '%s'", name);
+        result = NULL;
+    }
+    else
+    {
+        result = Lua_callvector(lua, argv + 1, argc - 1);
+    }
+    Lua_unlock(lua);
+
+    LuaStatePool_give(self, state);
+    Py_DECREF(state);
+    return result;
+}
+
+static PyObject *LuaStatePool_size(LuaStatePool *self)
+{
+    return PyInt_FromSsize_t(PyList_GET_SIZE(self->states));
+}
+
+static PyMethodDef LuaStatePool_methods[] = {
+    {"acquire", (PyCFunction)LuaStatePool_acquire, METH_VARARGS,
+        "Take a state out of the pool, waiting for one if blocking is true."},
+    {"release", (PyCFunction)LuaStatePool_release, METH_O,
+        "Return an acquired state to the pool."},
+    {"call", (PyCFunction)LuaStatePool_call, LUA_METH_FASTCALL,
+        "Call a global Lua function on any free state."},
+    {"size", (PyCFunction)LuaStatePool_size, METH_NOARGS,
+        "Gets the number of states in the pool."},
+    {NULL}
+};
+
+static PyTypeObject LuaStatePoolType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "lua.LuaStatePool",         /*tp_name*/
+    sizeof(LuaStatePool),       /*tp_basicsize*/
+    0,                          /*tp_itemsize*/
+    (destructor)LuaStatePool_dealloc, /*tp_dealloc*/
+    0,                          /*tp_print*/
+    0,                          /*tp_getattr*/
+    0,                          /*tp_setattr*/
+    0,                          /*tp_compare*/
+    0,                          /*tp_repr*/
+    0,                          /*tp_as_number*/
+    0,                          /*tp_as_sequence*/
+    0,                          /*tp_as_mapping*/
+    0,                          /*tp_hash */
+    0,                          /*tp_call*/
+    0,                          /*tp_str*/
+    0,                          /*tp_getattro*/
+    0,                          /*tp_setattro*/
+    0,                          /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,         /*tp_flags*/
+    "Pools of initialized Lua states", /*tp_doc*/
+    0,                          /*tp_traverse*/
+    0,                          /*tp_clear*/
+    0,                          /*tp_richcompare*/
+    0,                          /*tp_weaklistoffset*/
+    0,                          /*tp_iter*/
+    0,                          /*tp_iternext*/
+    LuaStatePool_methods,       /*tp_methods*/
+    0,                          /*tp_members*/
+    0,                          /*tp_getset*/
+    0,                          /*tp_base*/
+    0,                          /*tp_dict*/
+    0,                          /*tp_descr_get*/
+    0,                          /*tp_descr_set*/
+    0,                          /*tp_dictoffset*/
+    (initproc)LuaStatePool_init, /*tp_init*/
+    0,                          /*tp_alloc*/
+    PyType_GenericNew,          /*tp_new*/
+};
+
+/* LuaBuffer type ***********************************************************/
+
+static void LuaBuffer_dealloc(LuaBuffer *self)
+{
+    Lua_lock(self->lua);
+    luaL_unref(self->lua->L, LUA_REGISTRYINDEX, self->ref);
+    Lua_unlock(self->lua);
+
+    Py_DECREF(self->lua);
+    Py_TYPE(self)->tp_free(self);
+}
+
+static Py_ssize_t LuaBuffer_length(LuaBuffer *self)
+{
+    return self->len;
+}
+
+static PyObject *LuaBuffer_str(LuaBuffer *self)
+{
+    return PyString_FromStringAndSize(self->data, self->len);
+}
+
+#ifndef PY3
+static Py_ssize_t LuaBuffer_getreadbuffer(LuaBuffer *self, Py_ssize_t segment,
+        void **ptr)
+{
+    if (segment != 0)
+    {
+        PyErr_SetString(PyExc_SystemError,
+                "accessing non-existent LuaBuffer segment");
+        return -1;
+    }
+    *ptr = (void *)self->data;
+    return self->len;
+}
+
+static Py_ssize_t LuaBuffer_getsegcount(LuaBuffer *self, Py_ssize_t *lenp)
+{
+    if (lenp)
+        *lenp = self->len;
+    return 1;
+}
+#endif
+
+static int LuaBuffer_getbuffer(LuaBuffer *self, Py_buffer *view, int flags)
+{
+    return PyBuffer_FillInfo(view, (PyObject *)self, (void *)self->data,
+            self->len, 1, flags);
+}
+
+static PySequenceMethods LuaBuffer_sequence = {
+    (lenfunc)LuaBuffer_length,  /*sq_length*/
+};
+
+static PyBufferProcs LuaBuffer_as_buffer = {
+#ifndef PY3
+    (readbufferproc)LuaBuffer_getreadbuffer, /*bf_getreadbuffer*/
+    0,                                       /*bf_getwritebuffer*/
+    (segcountproc)LuaBuffer_getsegcount,     /*bf_getsegcount*/
+    (charbufferproc)LuaBuffer_getreadbuffer, /*bf_getcharbuffer*/
+#endif
+    (getbufferproc)LuaBuffer_getbuffer,      /*bf_getbuffer*/
+    0,                                       /*bf_releasebuffer*/
+};
+
+static PyTypeObject LuaBufferType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "lua.LuaBuffer",            /*tp_name*/
+    sizeof(LuaBuffer),          /*tp_basicsize*/
+    0,                          /*tp_itemsize*/
+    (destructor)LuaBuffer_dealloc, /*tp_dealloc*/
+    0,                          /*tp_print*/
+    0,                          /*tp_getattr*/
+    0,                          /*tp_setattr*/
+    0,                          /*tp_compare*/
+    0,                          /*tp_repr*/
+    0,                          /*tp_as_number*/
+    &LuaBuffer_sequence,        /*tp_as_sequence*/
+    0,                          /*tp_as_mapping*/
+    0,                          /*tp_hash */
+    0,                          /*tp_call*/
+    (reprfunc)LuaBuffer_str,    /*tp_str*/
+    0,                          /*tp_getattro*/
+    0,                          /*tp_setattro*/
+    &LuaBuffer_as_buffer,       /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER, /*tp_flags*/
+    "Read-only views of Lua strings", /*tp_doc*/
+};
+
+/* LuaIter type *************************************************************/
+
+static PyObject *LuaIter_new(LuaObject *obj, int mode)
+{
+    LuaIter *it;
+    int istable;
+    lua_State *L = obj->lua->L;
+
+    Lua_lock(obj->lua);
+    lua_pushluaobject(L, obj);
+    istable = lua_istable(L, -1);
+    lua_pop(L, 1);
+    Lua_unlock(obj->lua);
+    if (!istable)
+    {
+        PyErr_SetString(PyExc_TypeError, "this LuaObject is not a table");
+        return NULL;
+    }
+
+    it = (LuaIter *)LuaIterType.tp_alloc(&LuaIterType, 0);
+    if (it == NULL)
+        return NULL;
+    Py_INCREF(obj);
+    it->obj = obj;
+    it->mode = mode;
+    it->key = LUA_REFNIL;
+    it->done = 0;
+    it->batch = NULL;
+    it->pos = 0;
+    return (PyObject *)it;
+}
+
+static void LuaIter_dealloc(LuaIter *self)
+{
+    if (self->obj)
+    {
+        Lua_lock(self->obj->lua);
+        luaL_unref(self->obj->lua->L, LUA_REGISTRYINDEX, self->key);
+        Lua_unlock(self->obj->lua);
+        Py_DECREF(self->obj);
+    }
+    Py_XDECREF(self->batch);
+    Py_TYPE(self)->tp_free(self);
+}
+
+static int LuaIter_fill(LuaIter *self)
+    // -1 with an exception set on failure
+{
+    LuaState *lua = self->obj->lua;
+    lua_State *L = lua->L;
+    PyObject *batch, *key, *val, *item;
+    int top, status, n, i;
+
+    Lua_lock(lua);
+    top = lua_gettop(L);
+    lua_pushcfunction(L, lua_nextbatch);
+    lua_pushluaobject(L, self->obj);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, self->key);
+    lua_pushinteger(L, LUA_ITER_BATCH);
+    // protected, as lua_next raises an error if the table was changed
+    if ((status = lua_pcall(L, 3, LUA_MULTRET, 0)))
+    {
+        Lua_seterror(lua, status, PyExc_RuntimeError, "lua error: ");
+        Lua_unlock(lua);
+        return -1;
+    }
+
+    n = (lua_gettop(L) - top) / 2;
+    if (n < LUA_ITER_BATCH)
+        self->done = 1;
+    batch = PyList_New(n);
+    if (batch == NULL)
+        goto fail;
+    for (i = 0; i < n; ++i)
+    {
+        key = val = NULL;
+        if (self->mode != LUA_ITER_VALUES)
+            key = Lua_topython(lua, top + 1 + 2 * i);
+        if (self->mode != LUA_ITER_KEYS)
+            val = Lua_topython(lua, top + 2 + 2 * i);
+        if (self->mode == LUA_ITER_KEYS)
+            item = key;
+        else if (self->mode == LUA_ITER_VALUES)
+            item = val;
+        else if (key && val)
+            item = PyTuple_Pack(2, key, val);
+        else
+            item = NULL;
+        if (self->mode == LUA_ITER_ITEMS)
+        {
+            Py_XDECREF(key);
+            Py_XDECREF(val);
+        }
+        if (item == NULL)
+        {
+            Py_DECREF(batch);
+            goto fail;
+        }
+        PyList_SET_ITEM(batch, i, item);
+    }
+
+    if (n > 0)
+    {
+        luaL_unref(L, LUA_REGISTRYINDEX, self->key);
+        lua_pushvalue(L, top + 2 * n - 1);
+        self->key = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    lua_settop(L, top);
+    Lua_unlock(lua);
+
+    Py_XDECREF(self->batch);
+    self->batch = batch;
+    self->pos = 0;
+    return 0;
+
+fail:
+    lua_settop(L, top);
+    Lua_unlock(lua);
+    return -1;
+}
+
+static PyObject *LuaIter_next(LuaIter *self)
+{
+    PyObject *item;
+
+    if (self->batch == NULL || self->pos >= PyList_GET_SIZE(self->batch))
+    {
+        if (self->done)
+            return NULL;
+        if (LuaIter_fill(self) < 0)
+            return NULL;
+        if (PyList_GET_SIZE(self->batch) == 0)
+            return NULL;
+    }
+
+    item = PyList_GET_ITEM(self->batch, self->pos++);
+    Py_INCREF(item);
+    return item;
+}
+
+static PyTypeObject LuaIterType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "lua.LuaIter",              /*tp_name*/
+    sizeof(LuaIter),            /*tp_basicsize*/
+    0,                          /*tp_itemsize*/
+    (destructor)LuaIter_dealloc, /*tp_dealloc*/
+    0,                          /*tp_print*/
+    0,                          /*tp_getattr*/
+    0,                          /*tp_setattr*/
+    0,                          /*tp_compare*/
+    0,                          /*tp_repr*/
+    0,                          /*tp_as_number*/
+    0,                          /*tp_as_sequence*/
+    0,                          /*tp_as_mapping*/
+    0,                          /*tp_hash */
+    0,                          /*tp_call*/
+    0,                          /*tp_str*/
+    0,                          /*tp_getattro*/
+    0,                          /*tp_setattro*/
+    0,                          /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,         /*tp_flags*/
+    "Iterators over Lua tables", /*tp_doc*/
+    0,                          /*tp_traverse*/
+    0,                          /*tp_clear*/
+    0,                          /*tp_richcompare*/
+    0,                          /*tp_weaklistoffset*/
+    PyObject_SelfIter,          /*tp_iter*/
+    (iternextfunc)LuaIter_next, /*tp_iternext*/
+};
+
+/* LuaCallIter type *********************************************************/
+
+static void LuaCallIter_dealloc(LuaCallIter *self)
+{
+    Py_XDECREF(self->fn);
+    Py_XDECREF(self->args);
+    Py_TYPE(self)->tp_free(self);
+}
+
+static PyObject *LuaCallIter_next(LuaCallIter *self)
+{
+    PyObject *item, *result;
+
+    item = PyIter_Next(self->args);
+    if (item == NULL)
+        return NULL;
+    result = Lua_callitem(self->fn, item, self->spread);
+    Py_DECREF(item);
+    return result;
+}
+
+static PyTypeObject LuaCallIterType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "lua.LuaCallIter",          /*tp_name*/
+    sizeof(LuaCallIter),        /*tp_basicsize*/
+    0,                          /*tp_itemsize*/
+    (destructor)LuaCallIter_dealloc, /*tp_dealloc*/
+    0,                          /*tp_print*/
+    0,                          /*tp_getattr*/
+    0,                          /*tp_setattr*/
+    0,                          /*tp_compare*/
+    0,                          /*tp_repr*/
+    0,                          /*tp_as_number*/
+    0,                          /*tp_as_sequence*/
+    0,                          /*tp_as_mapping*/
+    0,                          /*tp_hash */
+    0,                          /*tp_call*/
+    0,                          /*tp_str*/
+    0,                          /*tp_getattro*/
+    0,                          /*tp_setattro*/
+    0,                          /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,         /*tp_flags*/
+    "Iterators over the results of repeated Lua calls", /*tp_doc*/
+    0,                          /*tp_traverse*/
+    0,                          /*tp_clear*/
+    0,                          /*tp_richcompare*/
+    0,                          /*tp_weaklistoffset*/
+    PyObject_SelfIter,          /*tp_iter*/
+    (iternextfunc)LuaCallIter_next, /*tp_iternext*/
+};
+
+/* LuaCoroutine type *******************************************************/
+
+static PyObject *LuaCoroutine_resume(LuaObject *self, PyObject *args)
+{
+    return Lua_resumecoroutine(self, args);
+}
+
+static PyObject *LuaCoroutine_send(LuaObject *self, PyObject *value)
+{
+    PyObject *args, *result;
+
+    if ((args = PyTuple_Pack(1, value)) == NULL)
+        return NULL;
+    result = Lua_resumecoroutine(self, args);
+    Py_DECREF(args);
+    return result;
+}
+
+static PyObject *LuaCoroutine_next(LuaObject *self)
+{
+    return Lua_resumecoroutine(self, NULL);
+}
+
+static PyObject *LuaCoroutine_status(LuaObject *self)
+{
+    lua_State *co, *L = self->lua->L;
+    lua_Debug ar;
+    const char *status;
+
+    Lua_lock(self->lua);
+    lua_pushluaobject(L, self);
+    co = lua_tothread(L, -1);
+    if (lua_status(co) == LUA_YIELD)
+        status = "suspended";
+    else if (lua_status(co) != 0)
+        status = "dead";
+    else if (lua_getstack(co, 0, &ar))
+        status = "running";
+    else if (lua_gettop(co) == 0)
+        status = "dead";
+    else
+        status = "suspended";
+    lua_pop(L, 1);
+    Lua_unlock(self->lua);
+    return PyString_FromString(status);
+}
+
+#ifdef PY3
+static PyTypeObject LuaAwaitType;
+
+static PyObject *LuaCoroutine_await(LuaObject *self)
+{
+    LuaAwait *await;
+
+    await = PyObject_New(LuaAwait, &LuaAwaitType);
+    if (await == NULL)
+        return NULL;
+    Py_INCREF(self);
+    await->co = self;
+    await->pending = NULL;
+    return (PyObject *)await;
+}
+
+static void LuaAwait_dealloc(LuaAwait *self)
+{
+    Py_XDECREF(self->co);
+    Py_XDECREF(self->pending);
+    PyObject_Del(self);
+}
+
+static PyObject *LuaAwait_send(LuaAwait *self, PyObject *value)
+{
+    PyObject *args = NULL, *result, *asyncio, *future;
+
+    // the event loop wakes us once the future Lua waited on is done; its
+    // result (or exception) is what coroutine.yield() gets back
+    if (self->pending != NULL)
+    {
+        future = self->pending;
+        self->pending = NULL;
+        value = PyObject_CallMethod(future, "result", NULL);
+        Py_DECREF(future);
+        if (value == NULL)
+            return NULL;
+        args = PyTuple_Pack(1, value);
+        Py_DECREF(value);
+        if (args == NULL)
+            return NULL;
+    }
+    else if (value != Py_None && (args = PyTuple_Pack(1, value)) == NULL)
+        return NULL;
+    result = Lua_resumecoroutine(self->co, args);
+    Py_XDECREF(args);
+    if (result == NULL || result == Py_None)
+        return result;          // done, or a bare yield to the event loop
+
+    // anything else yielded is awaited on Lua's behalf
+    asyncio = PyImport_ImportModule("asyncio");
+    if (asyncio == NULL)
+    {
+        Py_DECREF(result);
+        return NULL;
+    }
+    future = PyObject_CallMethod(asyncio, "ensure_future", "O", result);
+    Py_DECREF(asyncio);
+    Py_DECREF(result);
+    if (future == NULL)
+        return NULL;
+    if (PyObject_SetAttrString(future, "_asyncio_future_blocking",
+                Py_True) < 0)
+    {
+        Py_DECREF(future);
+        return NULL;
+    }
+    Py_INCREF(future);
+    self->pending = future;
+    return future;
+}
+
+static PyObject *LuaAwait_next(LuaAwait *self)
+{
+    return LuaAwait_send(self, Py_None);
+}
+
+static PyObject *LuaAwait_throw(LuaAwait *self, PyObject *args)
+{
+    PyObject *type, *value = NULL, *tb = NULL;
+
+    // Lua can't catch Python exceptions, so cancellation and the like
+    // leave the coroutine suspended and go straight to the awaiter
+    if (!PyArg_ParseTuple(args, "O|OO:throw", &type, &value, &tb))
+        return NULL;
+    Py_CLEAR(self->pending);
+    if (PyExceptionInstance_Check(type))
+        PyErr_SetObject((PyObject *)Py_TYPE(type), type);
+    else if (PyExceptionClass_Check(type))
+        PyErr_SetObject(type, value);
+    else
+        PyErr_SetString(PyExc_TypeError,
+                "exceptions must derive from BaseException");
+    return NULL;
+}
+
+static PyMethodDef LuaAwait_methods[] = {
+    {"send", (PyCFunction)LuaAwait_send, METH_O,
+        "Resume the coroutine, as generator.send does."},
+    {"throw", (PyCFunction)LuaAwait_throw, METH_VARARGS,
+        "Raise an exception in the awaiting task."},
+    {NULL}
+};
+
+static PyTypeObject LuaAwaitType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "lua.LuaAwait",             /*tp_name*/
+    sizeof(LuaAwait),           /*tp_basicsize*/
+    0,                          /*tp_itemsize*/
+    (destructor)LuaAwait_dealloc, /*tp_dealloc*/
+    0,                          /*tp_print*/
+    0,                          /*tp_getattr*/
+    0,                          /*tp_setattr*/
+    0,                          /*tp_compare*/
+    0,                          /*tp_repr*/
+    0,                          /*tp_as_number*/
+    0,                          /*tp_as_sequence*/
+    0,                          /*tp_as_mapping*/
+    0,                          /*tp_hash */
+    0,                          /*tp_call*/
+    0,                          /*tp_str*/
+    0,                          /*tp_getattro*/
+    0,                          /*tp_setattro*/
+    0,                          /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,         /*tp_flags*/
+    "Awaits a Lua coroutine from asyncio", /*tp_doc*/
+    0,                          /*tp_traverse*/
+    0,                          /*tp_clear*/
+    0,                          /*tp_richcompare*/
+    0,                          /*tp_weaklistoffset*/
+    PyObject_SelfIter,          /*tp_iter*/
+    (iternextfunc)LuaAwait_next, /*tp_iternext*/
+    LuaAwait_methods,           /*tp_methods*/
+};
+
+static PyAsyncMethods LuaCoroutine_async = {
+    (unaryfunc)LuaCoroutine_await, /*am_await*/
+};
+#endif
+
+static PyMethodDef LuaCoroutine_methods[] = {
+    {"resume", (PyCFunction)LuaCoroutine_resume, METH_VARARGS,
+        "Resume the coroutine with the given values and return what it"
+        " yields. Raises StopIteration with its return value once it has"
+        " finished."},
+    {"send", (PyCFunction)LuaCoroutine_send, METH_O,
+        "Resume the coroutine with a value, as generator.send does."},
+    {"status", (PyCFunction)LuaCoroutine_status, METH_NOARGS,
+        "Gets 'suspended', 'running' or 'dead', like coroutine.status."},
+    {NULL}
+};
+
+static PyTypeObject LuaCoroutineType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "lua.LuaCoroutine",         /*tp_name*/
+    sizeof(LuaObject),          /*tp_basicsize*/
+    0,                          /*tp_itemsize*/
+    0,                          /*tp_dealloc*/
+    0,                          /*tp_print*/
+    0,                          /*tp_getattr*/
+    0,                          /*tp_setattr*/
+#ifdef PY3
+    &LuaCoroutine_async,        /*tp_as_async*/
+#else
+    0,                          /*tp_compare*/
+#endif
+    0,                          /*tp_repr*/
+    0,                          /*tp_as_number*/
+    0,                          /*tp_as_sequence*/
+    0,                          /*tp_as_mapping*/
+    0,                          /*tp_hash */
+    0,                          /*tp_call*/
+    0,                          /*tp_str*/
+    0,                          /*tp_getattro*/
+    0,                          /*tp_setattro*/
+    0,                          /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,         /*tp_flags*/
+    "Lua coroutines, resumed like Python generators", /*tp_doc*/
+    0,                          /*tp_traverse*/
+    0,                          /*tp_clear*/
+    0,                          /*tp_richcompare*/
+    0,                          /*tp_weaklistoffset*/
+    PyObject_SelfIter,          /*tp_iter*/
+    (iternextfunc)LuaCoroutine_next, /*tp_iternext*/
+    LuaCoroutine_methods,       /*tp_methods*/
+    0,                          /*tp_members*/
+    0,                          /*tp_getset*/
+    &LuaObjectType,             /*tp_base*/
+};
+
+/* LuaTask type *************************************************************/
+
+static void LuaTask_dealloc(LuaTask *self)
+{
+    if (self->lua)
+    {
+        Lua_lock(self->lua);
+        luaL_unref(self->lua->L, LUA_REGISTRYINDEX, self->ref);
+        Lua_unlock(self->lua);
+        Py_DECREF(self->lua);
+    }
+    Py_XDECREF(self->result);
+    Py_TYPE(self)->tp_free(self);
+}
+
+static PyObject *LuaTask_step(LuaTask *self, PyObject *args, PyObject *kwds)
+{
+    long budget;
+    double timeout;
+    LuaLimit saved;
+    int n, status;
+    lua_State *co, *L = self->lua->L;
+
+    if (!PyArg_ParseTuple(args, "") || !Lua_parselimit(kwds, &budget,
+                &timeout))
+        return NULL;
+    if (self->done)
+    {
+        if (self->result != NULL)
+            Py_RETURN_TRUE;
+        PyErr_SetString(PyExc_RuntimeError, "the task has failed");
+        return NULL;
+    }
+
+    Lua_lock(self->lua);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, self->ref);
+    co = lua_tothread(L, -1);
+    lua_pop(L, 1);
+
+    // values passed to coroutine.yield() by the task itself are dropped
+    n = self->nargs;
+    if (n < 0)
+    {
+        lua_settop(co, 0);
+        n = 0;
+    }
+    self->nargs = -1;
+
+    Lua_setlimit(self->lua, &saved, budget, timeout,
+            budget > 0 || timeout > 0 ? co : NULL);
+    status = Lua_resume(self->lua, co, n);
+    if (status != 0 && status != LUA_YIELD)
+    {
+        lua_xmove(co, L, 1);
+        Lua_seterror(self->lua, status, PyExc_RuntimeError, "lua error: ");
+    }
+    Lua_restorelimit(self->lua, &saved);
+    Lua_updatehook(self->lua, co);
+
+    if (status == 0)
+    {
+        n = lua_gettop(co);
+        lua_xmove(co, L, n);
+        self->result = Lua_topython_multiple(self->lua, n);
+        lua_pop(L, n);
+    }
+    Lua_unlock(self->lua);
+
+    if (status == LUA_YIELD)
+        Py_RETURN_FALSE;
+    self->done = 1;
+    if (status != 0 || self->result == NULL)
+        return NULL;
+    Py_RETURN_TRUE;
+}
+
+static PyMethodDef LuaTask_methods[] = {
+    {"step", (PyCFunction)LuaTask_step, METH_VARARGS | METH_KEYWORDS,
+        "Run the task for at most max_instructions VM instructions or"
+        " timeout seconds, or until it yields. Returns True once it has"
+        " finished, and raises RuntimeError once it has failed."},
+    {NULL}
+};
+
+static PyMemberDef LuaTask_members[] = {
+    {"done", T_INT, offsetof(LuaTask, done), READONLY,
+        "Whether the task has finished."},
+    {"result", T_OBJECT, offsetof(LuaTask, result), READONLY,
+        "What the task returned, once it has finished."},
+    {NULL}
+};
+
+static PyTypeObject LuaTaskType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "lua.LuaTask",              /*tp_name*/
+    sizeof(LuaTask),            /*tp_basicsize*/
+    0,                          /*tp_itemsize*/
+    (destructor)LuaTask_dealloc, /*tp_dealloc*/
+    0,                          /*tp_print*/
+    0,                          /*tp_getattr*/
+    0,                          /*tp_setattr*/
+    0,                          /*tp_compare*/
+    0,                          /*tp_repr*/
+    0,                          /*tp_as_number*/
+    0,                          /*tp_as_sequence*/
+    0,                          /*tp_as_mapping*/
+    0,                          /*tp_hash */
+    0,                          /*tp_call*/
+    0,                          /*tp_str*/
+    0,                          /*tp_getattro*/
+    0,                          /*tp_setattro*/
+    0,                          /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,         /*tp_flags*/
+    "Lua functions run a time slice at a time", /*tp_doc*/
+    0,                          /*tp_traverse*/
+    0,                          /*tp_clear*/
+    0,                          /*tp_richcompare*/
+    0,                          /*tp_weaklistoffset*/
+    0,                          /*tp_iter*/
+    0,                          /*tp_iternext*/
+    LuaTask_methods,            /*tp_methods*/
+    LuaTask_members,            /*tp_members*/
+};
+
+/* Channel type *************************************************************/
+
+static void LuaChannel_dealloc(LuaChannel *self)
+{
+    Py_ssize_t i;
+
+    if (self->slots)
+    {
+        for (i = 0; i < self->count; ++i)
+            free(self->slots[(self->head + i) % self->capacity]);
+        PyMem_Free(self->slots);
+    }
+    if (self->mutex)
+        PyThread_free_lock(self->mutex);
+    if (self->notempty)
+        PyThread_free_lock(self->notempty);
+    if (self->notfull)
+        PyThread_free_lock(self->notfull);
+    Py_TYPE(self)->tp_free(self);
+}
+
+static int LuaChannel_init(LuaChannel *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"capacity", NULL};
+    Py_ssize_t capacity = LUA_CHANNEL_CAPACITY;
+
+    if (self->slots)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Channel is already initialized");
+        return -1;
+    }
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|n", kwlist, &capacity))
+        return -1;
+    if (capacity < 1)
+    {
+        PyErr_SetString(PyExc_ValueError, "capacity must be positive");
+        return -1;
+    }
+
+    self->mutex = PyThread_allocate_lock();
+    self->notempty = PyThread_allocate_lock();
+    self->notfull = PyThread_allocate_lock();
+    if (!self->mutex || !self->notempty || !self->notfull)
+    {
+        PyErr_NoMemory();
+        return -1;
+    }
+    self->slots = PyMem_New(char *, capacity);
+    if (self->slots == NULL)
+    {
+        PyErr_NoMemory();
+        return -1;
+    }
+    self->capacity = capacity;
+    // a new channel is empty
+    PyThread_acquire_lock(self->notempty, WAIT_LOCK);
+    return 0;
+}
+
+static int LuaChannel_wait(PyThread_type_lock gate, int blocking, int gil)
+    // 0 if the gate is shut and blocking is false
+{
+    if (PyThread_acquire_lock(gate, NOWAIT_LOCK))
+        return 1;
+    if (!blocking)
+        return 0;
+    if (gil)
+    {
+        Py_BEGIN_ALLOW_THREADS
+        PyThread_acquire_lock(gate, WAIT_LOCK);
+        Py_END_ALLOW_THREADS
+    }
+    else
+    {
+        PyThread_acquire_lock(gate, WAIT_LOCK);
+    }
+    return 1;
+}
+
+static int LuaChannel_put(LuaChannel *self, char *msg, int blocking, int gil)
+    // LUA_CHANNEL_*; the channel takes msg only on LUA_CHANNEL_OK
+{
+    if (!LuaChannel_wait(self->notfull, blocking, gil))
+        return LUA_CHANNEL_WOULDBLOCK;
+    PyThread_acquire_lock(self->mutex, WAIT_LOCK);
+    if (self->closed)
+    {
+        PyThread_release_lock(self->notfull);
+        PyThread_release_lock(self->mutex);
+        return LUA_CHANNEL_CLOSED;
+    }
+    self->slots[(self->head + self->count) % self->capacity] = msg;
+    if (++self->count == 1)
+        PyThread_release_lock(self->notempty);
+    if (self->count < self->capacity)
+        PyThread_release_lock(self->notfull);
+    PyThread_release_lock(self->mutex);
+    return LUA_CHANNEL_OK;
+}
+
+static int LuaChannel_get(LuaChannel *self, char **msg, int blocking,
+        int gil)
+    // LUA_CHANNEL_*, with LUA_CHANNEL_CLOSED once a closed channel is empty
+{
+    if (!LuaChannel_wait(self->notempty, blocking, gil))
+        return LUA_CHANNEL_WOULDBLOCK;
+    PyThread_acquire_lock(self->mutex, WAIT_LOCK);
+    if (self->count == 0)
+    {
+        // closed; let the next waiting thread find out too
+        PyThread_release_lock(self->notempty);
+        PyThread_release_lock(self->mutex);
+        return LUA_CHANNEL_CLOSED;
+    }
+    *msg = self->slots[self->head];
+    self->head = (self->head + 1) % self->capacity;
+    if (self->count-- == self->capacity && !self->closed)
+        PyThread_release_lock(self->notfull);
+    if (self->count > 0 || self->closed)
+        PyThread_release_lock(self->notempty);
+    PyThread_release_lock(self->mutex);
+    return LUA_CHANNEL_OK;
+}
+
+static void LuaChannel_doclose(LuaChannel *self)
+{
+    PyThread_acquire_lock(self->mutex, WAIT_LOCK);
+    if (!self->closed)
+    {
+        // open both gates for good, waking every waiting thread
+        self->closed = 1;
+        if (self->count == 0)
+            PyThread_release_lock(self->notempty);
+        if (self->count == self->capacity)
+            PyThread_release_lock(self->notfull);
+    }
+    PyThread_release_lock(self->mutex);
+}
+
+static Py_ssize_t LuaChannel_length(LuaChannel *self)
+{
+    Py_ssize_t count;
+
+    PyThread_acquire_lock(self->mutex, WAIT_LOCK);
+    count = self->count;
+    PyThread_release_lock(self->mutex);
+    return count;
+}
+
+static PyObject *LuaChannel_push(LuaChannel *self, PyObject *args)
+{
+    PyObject *o;
+    int blocking = 1, status;
+    LuaPacker p = {NULL, 0, 0, LUA_TNONE, 0};
+
+    if (!PyArg_ParseTuple(args, "O|i", &o, &blocking))
+        return NULL;
+    if (o == Py_None)
+    {
+        PyErr_SetString(PyExc_ValueError, "cannot send None");
+        return NULL;
+    }
+    if (!Lua_packpython(&p, o, 0))
+    {
+        free(p.data);
+        return NULL;
+    }
+
+    status = LuaChannel_put(self, p.data, blocking, 1);
+    if (status != LUA_CHANNEL_OK)
+        free(p.data);
+    if (status == LUA_CHANNEL_CLOSED)
+    {
+        PyErr_SetString(PyExc_ValueError, "push to a closed channel");
+        return NULL;
+    }
+    return PyBool_FromLong(status == LUA_CHANNEL_OK);
+}
+
+static PyObject *LuaChannel_pop(LuaChannel *self, PyObject *args)
+{
+    int blocking = 1;
+    char *msg;
+    const char *p;
+    PyObject *result;
+
+    if (!PyArg_ParseTuple(args, "|i", &blocking))
+        return NULL;
+    if (LuaChannel_get(self, &msg, blocking, 1) != LUA_CHANNEL_OK)
+        Py_RETURN_NONE;
+    p = msg;
+    result = Lua_unpackpython(&p);
+    free(msg);
+    return result;
+}
+
+static PyObject *LuaChannel_close(LuaChannel *self)
+{
+    LuaChannel_doclose(self);
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef LuaChannel_methods[] = {
+    {"push", (PyCFunction)LuaChannel_push, METH_VARARGS,
+        "Send a value, waiting for room if blocking is true. Returns"
+        " whether it was sent."},
+    {"pop", (PyCFunction)LuaChannel_pop, METH_VARARGS,
+        "Receive a value, waiting for one if blocking is true. Returns None"
+        " if there is none, or once the channel is closed and empty."},
+    {"close", (PyCFunction)LuaChannel_close, METH_NOARGS,
+        "Stop accepting values; pending values can still be received."},
+    {NULL}
+};
+
+static PyMemberDef LuaChannel_members[] = {
+    {"capacity", T_PYSSIZET, offsetof(LuaChannel, capacity), READONLY,
+        "The most values the channel holds at once."},
+    {"closed", T_INT, offsetof(LuaChannel, closed), READONLY,
+        "Whether the channel has been closed."},
     {NULL}
 };
 
-static PyTypeObject LuaStateType = {
-    PyObject_HEAD_INIT(NULL)
-    0,                          /*ob_size*/
-    "lua.LuaState",             /*tp_name*/
-    sizeof(LuaState),           /*tp_basicsize*/
-    0,                          /*tp_itemsize*/
-    (destructor)LuaState_dealloc, /*tp_dealloc*/
-    0,                          /*tp_print*/
-    0,                          /*tp_getattr*/
-    0,                          /*tp_setattr*/
-    0,                          /*tp_compare*/
-    0,                          /*tp_repr*/
-    0,                          /*tp_as_number*/
-    0,                          /*tp_as_sequence*/
-    0,                          /*tp_as_mapping*/
-    0,                          /*tp_hash */
-    0,                          /*tp_call*/
-    0,                          /*tp_str*/
-    0,                          /*tp_getattro*/
-    0,                          /*tp_setattro*/
-    0,                          /*tp_as_buffer*/
-    Py_TPFLAGS_DEFAULT,         /*tp_flags*/
-    "Lua state objects",        /*tp_doc*/
-    0,                          /*tp_traverse*/
-    0,                          /*tp_clear*/
-    0,                          /*tp_richcompare*/
-    0,                          /*tp_weaklistoffset*/
-    0,                          /*tp_iter*/
-    0,                          /*tp_iternext*/
-    LuaState_methods,           /*tp_methods*/
-    LuaState_members,           /*tp_members*/
-    0,                          /*tp_getset*/
-    0,                          /*tp_base*/
-    0,                          /*tp_dict*/
-    0,                          /*tp_descr_get*/
-    0,                          /*tp_descr_set*/
-    0,                          /*tp_dictoffset*/
-    (initproc)LuaState_init,    /*tp_init*/
-    0,                          /*tp_alloc*/
-    PyType_GenericNew,          /*tp_new*/
-};
+static PySequenceMethods LuaChannel_sequence = {
+    (lenfunc)LuaChannel_length, /*sq_length*/
+};
+
+static PyTypeObject LuaChannelType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "lua.Channel",              /*tp_name*/
+    sizeof(LuaChannel),         /*tp_basicsize*/
+    0,                          /*tp_itemsize*/
+    (destructor)LuaChannel_dealloc, /*tp_dealloc*/
+    0,                          /*tp_print*/
+    0,                          /*tp_getattr*/
+    0,                          /*tp_setattr*/
+    0,                          /*tp_compare*/
+    0,                          /*tp_repr*/
+    0,                          /*tp_as_number*/
+    &LuaChannel_sequence,       /*tp_as_sequence*/
+    0,                          /*tp_as_mapping*/
+    0,                          /*tp_hash */
+    0,                          /*tp_call*/
+    0,                          /*tp_str*/
+    0,                          /*tp_getattro*/
+    0,                          /*tp_setattro*/
+    0,                          /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,         /*tp_flags*/
+    "Bounded queues of values shared by Lua states and threads", /*tp_doc*/
+    0,                          /*tp_traverse*/
+    0,                          /*tp_clear*/
+    0,                          /*tp_richcompare*/
+    0,                          /*tp_weaklistoffset*/
+    0,                          /*tp_iter*/
+    0,                          /*tp_iternext*/
+    LuaChannel_methods,         /*tp_methods*/
+    LuaChannel_members,         /*tp_members*/
+    0,                          /*tp_getset*/
+    0,                          /*tp_base*/
+    0,                          /*tp_dict*/
+    0,                          /*tp_descr_get*/
+    0,                          /*tp_descr_set*/
+    0,                          /*tp_dictoffset*/
+    (initproc)LuaChannel_init,  /*tp_init*/
+    0,                          /*tp_alloc*/
+    PyType_GenericNew,          /*tp_new*/
+};
+
+/* Utility functions ********************************************************/
+
+static void lua_pushluaobject(lua_State *L, LuaObject *f)
+    // lua stack [-0, +1]
+{
+    lua_rawgeti(L, LUA_REGISTRYINDEX, f->ref);
+}
+
+static PyObject **Lua_topyslot(LuaState *lua, int index)
+    // the PyObject userdata at index, which may be a dict or list proxy, or
+    // NULL if it is something else
+    // lua stack [-0, +0]
+{
+    int refs[3], i, found = 0;
+    void *u;
+    lua_State *L = lua->L;
+
+    u = lua_touserdata(L, index);
+    if (u == NULL || !lua_getmetatable(L, index))
+        return NULL;
+    refs[0] = lua->pymetatable;
+    refs[1] = lua->pydictmetatable;
+    refs[2] = lua->pylistmetatable;
+    for (i = 0; i < 3 && !found; ++i)
+    {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, refs[i]);
+        found = lua_rawequal(L, -1, -2);
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+    return found ? (PyObject **)u : NULL;
+}
+
+static PyObject *Lua_topyobject(LuaState *lua, int index)
+    // new reference, or NULL if the userdata does not hold a Python object
+    // lua stack [-0, +0]
+{
+    PyObject *result = NULL, **slot;
+    void *u;
+    lua_State *L = lua->L;
+
+    slot = Lua_topyslot(lua, index);
+    if (slot != NULL)
+    {
+        Py_XINCREF(*slot);
+        return *slot;
+    }
+    u = lua_touserdata(L, index);
+    if (u == NULL || !lua_getmetatable(L, index))
+        return NULL;
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, lua->pybuffermetatable);
+    if (lua_rawequal(L, -1, -2))
+        result = ((LuaPyBuffer *)u)->exported ? ((LuaPyBuffer *)u)->view.obj :
+            ((LuaPyBuffer *)u)->obj;
+    lua_pop(L, 1);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, lua->pyarraymetatable);
+    if (lua_rawequal(L, -1, -2))
+        result = ((LuaPyArray *)u)->exported ? ((LuaPyArray *)u)->view.obj :
+            ((LuaPyArray *)u)->obj;
+    lua_pop(L, 1);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, lua->pychannelmetatable);
+    if (lua_rawequal(L, -1, -2))
+        result = (PyObject *)((LuaChannelEnd *)u)->channel;
+    lua_pop(L, 2);
+
+    Py_XINCREF(result);
+    return result;
+}
+
+static PyObject *Lua_toluaobject(LuaState *lua, int index)
+    // new reference
+    // lua stack [-0, +0]
+{
+    LuaObject *f;
+    lua_State *L = lua->L;
+
+    if (index < 0)
+        index = lua_gettop(L) + 1 + index;
+
+    // the same Lua value always gets the same wrapper while it is alive
+    lua_rawgeti(L, LUA_REGISTRYINDEX, lua->wrappers);
+    lua_pushvalue(L, index);
+    lua_rawget(L, -2);
+    f = (LuaObject *)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    // a wrapper with no references is waiting in its dealloc for our lock
+    if (f != NULL && Py_REFCNT(f) > 0)
+    {
+        lua_pop(L, 1);
+        Py_INCREF(f);
+        return (PyObject *)f;
+    }
+
+    if (lua_type(L, index) == LUA_TTHREAD)
+        f = (LuaObject *)LuaCoroutineType.tp_alloc(&LuaCoroutineType, 0);
+    else
+        f = (LuaObject *)LuaObjectType.tp_alloc(&LuaObjectType, 0);
+    if (f == NULL)
+    {
+        lua_pop(L, 1);
+        return NULL;
+    }
+#ifdef LUA_FASTCALL
+    f->vectorcall = LuaObject_vectorcall;
+#endif
+    Py_INCREF(lua);
+    f->lua = lua;
+    STATS_INC(lua, wrapped);
+
+    // freed refs are recycled through the registry's free list
+    lua_pushvalue(L, index);
+    f->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    lua_pushvalue(L, index);
+    lua_pushlightuserdata(L, f);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+
+    return (PyObject *)f;
+}
+
+static int lua_obj_gc(lua_State *L)
+{
+    PyObject *o, **slot;
+    LuaState *lua;
+    PyThreadState *tstate;
+
+    lua = (LuaState *)lua_touserdata(L, lua_upvalueindex(1));
+    slot = Lua_topyslot(lua, 1);
+    if (slot == NULL)
+        return luaL_typerror(L, 1, PYOBJECT);
+    o = *slot;
+    *slot = NULL;
+    tstate = Lua_enterpython(lua);
+    Py_XDECREF(o);
+    Lua_leavepython(lua, tstate);
+
+    return 0;
+}
+
+static int lua_obj_call(lua_State *L)
+{
+    PyObject *o, *args, *ret;
+    LuaState *lua;
+    PyThreadState *tstate;
+    int nargs, r;
+    STATS_DECLARE(t)
+
+    lua = (LuaState *)lua_touserdata(L, lua_upvalueindex(1));
+    o = *(PyObject **)luaL_checkudata(L, 1, PYOBJECT);
+    tstate = Lua_enterpython(lua);
+    if (!PyCallable_Check(o))
+    {
+        Lua_leavepython(lua, tstate);
+        return luaL_error(L, "Python object is not callable");
+    }
+
+    STATS_START(t);
+    nargs = lua_gettop(L) - 1;
+    args = Lua_topython_tuple(lua, nargs);
+    ret = PyObject_CallObject(o, args);
+    Py_DECREF(args);
+    LogObj("returned", ret);
+    if (PyErr_Occurred())
+    {
+        PyErr_Print();
+        STATS_STOP(lua, callback, t);
+        Lua_leavepython(lua, tstate);
+        return luaL_error(L, "error in the function");
+    }
+    r = Lua_pushpyobject_tuple(lua, ret);
+    Py_DECREF(ret);
+    STATS_STOP(lua, callback, t);
+    Lua_leavepython(lua, tstate);
+    return r;
+}
+
+static int Lua_parsetype(PyObject *t, int allownone)
+    // LUA_ARG_* for a type given to register(), or -1 with an exception set
+{
+    if (t == NULL || t == (PyObject *)&PyBaseObject_Type)
+        return LUA_ARG_OBJECT;
+    if (t == (PyObject *)&PyInt_Type || t == (PyObject *)&PyLong_Type)
+        return LUA_ARG_INT;
+    if (t == (PyObject *)&PyFloat_Type)
+        return LUA_ARG_FLOAT;
+    if (t == (PyObject *)&PyString_Type)
+        return LUA_ARG_STR;
+    if (t == (PyObject *)&PyBool_Type)
+        return LUA_ARG_BOOL;
+    if (allownone && t == Py_None)
+        return LUA_ARG_NONE;
+    PyErr_SetString(PyExc_TypeError, allownone ?
+            "types must be int, long, float, str, bool, object or None" :
+            "types must be int, long, float, str, bool or object");
+    return -1;
+}
+
+static PyObject *Lua_toargtuple(LuaState *lua, LuaPyFunction *f, int nargs)
+    // new reference
+    // lua stack [-0, +0]; the arguments start at index 1 and have been
+    // checked by lua_func_call
+{
+    PyObject *args, *item;
+    size_t len;
+    const char *str;
+    int i;
+    lua_State *L = lua->L;
+
+    if (f->nargs < 0)
+        return Lua_topython_tuple(lua, nargs);
+
+    // a call in progress, or a callee that kept its arguments, holds
+    // another reference to the tuple
+    if (f->args != NULL && Py_REFCNT(f->args) == 1)
+    {
+        args = f->args;
+        Py_INCREF(args);
+    }
+    else
+    {
+        args = PyTuple_New(f->nargs);
+        if (args == NULL)
+            return NULL;
+        Py_XDECREF(f->args);
+        Py_INCREF(args);
+        f->args = args;
+    }
+
+    for (i = 0; i < f->nargs; ++i)
+    {
+        switch (f->argtypes[i])
+        {
+            case LUA_ARG_INT:
+                item = PyInt_FromLong((long)lua_tointeger(L, i + 1));
+                break;
+            case LUA_ARG_FLOAT:
+                item = PyFloat_FromDouble(lua_tonumber(L, i + 1));
+                break;
+            case LUA_ARG_STR:
+                str = lua_tolstring(L, i + 1, &len);
+                item = PyString_FromStringAndSize(str, len);
+                break;
+            case LUA_ARG_BOOL:
+                item = PyBool_FromLong(lua_toboolean(L, i + 1));
+                break;
+            default:
+                item = Lua_topython(lua, i + 1);
+                break;
+        }
+        if (item == NULL)
+        {
+            Py_DECREF(args);
+            return NULL;
+        }
+        Py_XDECREF(PyTuple_GET_ITEM(args, i));
+        PyTuple_SET_ITEM(args, i, item);
+    }
+    return args;
+}
+
+static int Lua_pushresult(LuaState *lua, LuaPyFunction *f, PyObject *ret)
+    // lua stack [-0, +n], or [-0, +0] with a Python exception set and -1
+    // returned
+{
+    char *str;
+    Py_ssize_t len;
+    long i;
+    double d;
+    lua_State *L = lua->L;
+
+    switch (f->restype)
+    {
+        case LUA_ARG_NONE:
+            return 0;
+        case LUA_ARG_INT:
+            i = PyInt_AsLong(ret);
+            if (i == -1 && PyErr_Occurred())
+                return -1;
+            lua_pushinteger(L, i);
+            return 1;
+        case LUA_ARG_FLOAT:
+            d = PyFloat_AsDouble(ret);
+            if (d == -1.0 && PyErr_Occurred())
+                return -1;
+            lua_pushnumber(L, d);
+            return 1;
+        case LUA_ARG_STR:
+            if (PyString_AsStringAndSize(ret, &str, &len) == -1)
+                return -1;
+            lua_pushlstring(L, str, len);
+            return 1;
+        case LUA_ARG_BOOL:
+            i = PyObject_IsTrue(ret);
+            if (i == -1)
+                return -1;
+            lua_pushboolean(L, i);
+            return 1;
+        default:
+            return Lua_pushpyobject_tuple(lua, ret);
+    }
+}
+
+static int lua_func_call(lua_State *L)
+{
+    LuaPyFunction *f;
+    PyObject *args, *ret;
+    LuaState *lua;
+    PyThreadState *tstate;
+    int nargs, i, r;
+    STATS_DECLARE(t)
+
+    lua = (LuaState *)lua_touserdata(L, lua_upvalueindex(1));
+    f = (LuaPyFunction *)lua_touserdata(L, lua_upvalueindex(2));
+    nargs = lua_gettop(L);
+
+    // check the arguments while Lua errors are still free to longjmp
+    for (i = 0; i < f->nargs; ++i)
+    {
+        switch (f->argtypes[i])
+        {
+            case LUA_ARG_INT:
+                luaL_checkinteger(L, i + 1);
+                break;
+            case LUA_ARG_FLOAT:
+                luaL_checknumber(L, i + 1);
+                break;
+            case LUA_ARG_STR:
+                luaL_checkstring(L, i + 1);
+                break;
+        }
+    }
+    if (f->nargs >= 0 && nargs < f->nargs)
+        lua_settop(L, f->nargs);
+
+    tstate = Lua_enterpython(lua);
+    STATS_START(t);
+    args = Lua_toargtuple(lua, f, nargs);
+    if (args != NULL)
+    {
+        ret = PyObject_Call(f->func, args, NULL);
+        if (args == f->args && Py_REFCNT(args) == 2)
+        {
+            // don't keep the arguments alive until the next call
+            for (i = 0; i < f->nargs; ++i)
+                Py_CLEAR(PyTuple_GET_ITEM(args, i));
+        }
+        Py_DECREF(args);
+    }
+    else
+    {
+        ret = NULL;
+    }
+    r = ret != NULL ? Lua_pushresult(lua, f, ret) : -1;
+    Py_XDECREF(ret);
+    STATS_STOP(lua, callback, t);
+    if (r == -1)
+    {
+        PyErr_Print();
+        Lua_leavepython(lua, tstate);
+        return luaL_error(L, "error in the function");
+    }
+    Lua_leavepython(lua, tstate);
+    return r;
+}
+
+static int lua_func_gc(lua_State *L)
+{
+    LuaPyFunction *f;
+    LuaState *lua;
+    PyThreadState *tstate;
+
+    lua = (LuaState *)lua_touserdata(L, lua_upvalueindex(1));
+    f = (LuaPyFunction *)luaL_checkudata(L, 1, PYFUNCTION);
+    tstate = Lua_enterpython(lua);
+    Py_CLEAR(f->func);
+    Py_CLEAR(f->args);
+    Lua_leavepython(lua, tstate);
+
+    return 0;
+}
+
+static int Lua_packgrow(LuaPacker *p, size_t n)
+    // make room for n more bytes; 0 when out of memory
+{
+    size_t size;
+    char *data;
+
+    if (p->len + n <= p->size)
+        return 1;
+    size = p->size ? p->size : 64;
+    while (size < p->len + n)
+        size *= 2;
+    data = realloc(p->data, size);
+    if (data == NULL)
+    {
+        p->badtype = LUA_TNONE;
+        return 0;
+    }
+    p->data = data;
+    p->size = size;
+    return 1;
+}
+
+static int Lua_packbytes(LuaPacker *p, const void *src, size_t n)
+{
+    if (!Lua_packgrow(p, n))
+        return 0;
+    memcpy(p->data + p->len, src, n);
+    p->len += n;
+    return 1;
+}
+
+static int Lua_packlua(LuaPacker *p, lua_State *L, int index, int depth)
+    // 0 with p->badtype set if the value cannot be sent
+    // lua stack [-0, +0]
+{
+    char tag;
+    lua_Number x;
+    const char *s;
+    size_t len, narr, nrec = 0, i, at;
+    int type = lua_type(L, index);
+
+    if (index < 0)
+        index = lua_gettop(L) + index + 1;
+    switch (type)
+    {
+        case LUA_TNIL:
+            tag = LUA_PACK_NIL;
+            return Lua_packbytes(p, &tag, 1);
+        case LUA_TBOOLEAN:
+            tag = lua_toboolean(L, index) ? LUA_PACK_TRUE : LUA_PACK_FALSE;
+            return Lua_packbytes(p, &tag, 1);
+        case LUA_TNUMBER:
+            tag = LUA_PACK_NUMBER;
+            x = lua_tonumber(L, index);
+            return Lua_packbytes(p, &tag, 1)
+                && Lua_packbytes(p, &x, sizeof(x));
+        case LUA_TSTRING:
+            tag = LUA_PACK_STRING;
+            s = lua_tolstring(L, index, &len);
+            return Lua_packbytes(p, &tag, 1)
+                && Lua_packbytes(p, &len, sizeof(len))
+                && Lua_packbytes(p, s, len);
+        case LUA_TTABLE:
+            break;
+        default:
+            p->badtype = type;
+            return 0;
+    }
+
+    if (depth >= LUA_PACK_MAXDEPTH || !lua_checkstack(L, 4))
+    {
+        p->badtype = LUA_TTABLE;
+        return 0;
+    }
+    tag = LUA_PACK_TABLE;
+    narr = lua_objlen(L, index);
+    if (!Lua_packbytes(p, &tag, 1) || !Lua_packbytes(p, &narr, sizeof(narr)))
+        return 0;
+    // nrec is filled in once the hash part has been walked
+    at = p->len;
+    if (!Lua_packbytes(p, &nrec, sizeof(nrec)))
+        return 0;
+
+    for (i = 1; i <= narr; ++i)
+    {
+        lua_rawgeti(L, index, i);
+        if (!Lua_packlua(p, L, -1, depth + 1))
+        {
+            lua_pop(L, 1);
+            return 0;
+        }
+        lua_pop(L, 1);
+    }
+    lua_pushnil(L);
+    while (lua_next(L, index))
+    {
+        if (lua_type(L, -2) == LUA_TNUMBER)
+        {
+            x = lua_tonumber(L, -2);
+            if (x >= 1 && x <= narr && x == (lua_Number)(size_t)x)
+            {
+                lua_pop(L, 1);
+                continue;
+            }
+        }
+        else if (lua_type(L, -2) == LUA_TTABLE)
+        {
+            lua_pop(L, 2);
+            p->badtype = LUA_TTABLE;
+            p->badkey = 1;
+            return 0;
+        }
+        if (!Lua_packlua(p, L, -2, depth + 1)
+                || !Lua_packlua(p, L, -1, depth + 1))
+        {
+            lua_pop(L, 2);
+            return 0;
+        }
+        lua_pop(L, 1);
+        nrec++;
+    }
+    memcpy(p->data + at, &nrec, sizeof(nrec));
+    return 1;
+}
+
+static int Lua_packkey(PyObject *key)
+    // whether key can be sent as a table key; if not, raise ValueError
+    // or TypeError: Lua has no nil or NaN keys, and a table that comes
+    // back as a list or dict could not be a key in Python
+{
+    if (key == Py_None
+            || (PyFloat_Check(key) && Py_IS_NAN(PyFloat_AS_DOUBLE(key))))
+    {
+        PyErr_SetString(PyExc_ValueError,
+                "None and NaN cannot be keys of a Lua table");
+        return 0;
+    }
+    if (PyDict_Check(key) || PyList_Check(key) || PyTuple_Check(key))
+    {
+        PyErr_Format(PyExc_TypeError, "cannot send a %.200s used as a key",
+                Py_TYPE(key)->tp_name);
+        return 0;
+    }
+    return 1;
+}
+
+static int Lua_packpython(LuaPacker *p, PyObject *o, int depth)
+    // 0 with a Python exception if the value cannot be sent
+{
+    char tag;
+    lua_Number x;
+    size_t len, narr = 0, nrec = 0;
+    Py_ssize_t i;
+    PyObject *items, *key, *s;
+    int ok;
+
+    if (depth >= LUA_PACK_MAXDEPTH)
+    {
+        PyErr_SetString(PyExc_ValueError,
+                "value is nested too deeply to send");
+        return 0;
+    }
+    if (o == Py_None || PyBool_Check(o))
+    {
+        tag = o == Py_None ? LUA_PACK_NIL
+            : o == Py_True ? LUA_PACK_TRUE : LUA_PACK_FALSE;
+        if (!Lua_packbytes(p, &tag, 1))
+            goto nomemory;
+        return 1;
+    }
+    if (PyInt_Check(o) || PyLong_Check(o) || PyFloat_Check(o))
+    {
+        tag = LUA_PACK_NUMBER;
+        x = PyFloat_AsDouble(o);
+        if (x == -1.0 && PyErr_Occurred())
+            return 0;
+        if (!Lua_packbytes(p, &tag, 1) || !Lua_packbytes(p, &x, sizeof(x)))
+            goto nomemory;
+        return 1;
+    }
+    if (PyBytes_Check(o) || PyUnicode_Check(o))
+    {
+        s = PyUnicode_Check(o) ? PyUnicode_AsUTF8String(o) : o;
+        if (s == NULL)
+            return 0;
+        tag = LUA_PACK_STRING;
+        len = PyBytes_GET_SIZE(s);
+        ok = Lua_packbytes(p, &tag, 1)
+            && Lua_packbytes(p, &len, sizeof(len))
+            && Lua_packbytes(p, PyBytes_AS_STRING(s), len);
+        if (s != o)
+            Py_DECREF(s);
+        if (!ok)
+            goto nomemory;
+        return 1;
+    }
+    // packing an item can run Python code that changes the container, so
+    // work from a snapshot whose size is the one written out
+    if (PyDict_Check(o))
+        items = PyDict_Items(o);
+    else if (PyList_Check(o) || PyTuple_Check(o))
+        items = PySequence_Tuple(o);
+    else
+    {
+        PyErr_Format(PyExc_TypeError, "cannot send %.200s through a channel",
+                Py_TYPE(o)->tp_name);
+        return 0;
+    }
+    if (items == NULL)
+        return 0;
+    if (PyDict_Check(o))
+        nrec = PyList_GET_SIZE(items);
+    else
+        narr = PyTuple_GET_SIZE(items);
+
+    tag = LUA_PACK_TABLE;
+    ok = Lua_packbytes(p, &tag, 1) && Lua_packbytes(p, &narr, sizeof(narr))
+        && Lua_packbytes(p, &nrec, sizeof(nrec));
+    if (!ok)
+        PyErr_NoMemory();
+    for (i = 0; ok && i < (Py_ssize_t)narr; ++i)
+        ok = Lua_packpython(p, PyTuple_GET_ITEM(items, i), depth + 1);
+    for (i = 0; ok && i < (Py_ssize_t)nrec; ++i)
+    {
+        key = PyTuple_GET_ITEM(PyList_GET_ITEM(items, i), 0);
+        ok = Lua_packkey(key)
+            && Lua_packpython(p, key, depth + 1)
+            && Lua_packpython(p, PyTuple_GET_ITEM(PyList_GET_ITEM(items, i),
+                        1), depth + 1);
+    }
+    Py_DECREF(items);
+    return ok;
+
+nomemory:
+    PyErr_NoMemory();
+    return 0;
+}
+
+static void Lua_unpacklua(lua_State *L, const char **p)
+    // lua stack [-0, +1]
+{
+    lua_Number x;
+    size_t len, narr, nrec, i;
+
+    switch (*(*p)++)
+    {
+        case LUA_PACK_NIL:
+            lua_pushnil(L);
+            break;
+        case LUA_PACK_FALSE:
+            lua_pushboolean(L, 0);
+            break;
+        case LUA_PACK_TRUE:
+            lua_pushboolean(L, 1);
+            break;
+        case LUA_PACK_NUMBER:
+            memcpy(&x, *p, sizeof(x));
+            *p += sizeof(x);
+            lua_pushnumber(L, x);
+            break;
+        case LUA_PACK_STRING:
+            memcpy(&len, *p, sizeof(len));
+            *p += sizeof(len);
+            lua_pushlstring(L, *p, len);
+            *p += len;
+            break;
+        case LUA_PACK_TABLE:
+            memcpy(&narr, *p, sizeof(narr));
+            *p += sizeof(narr);
+            memcpy(&nrec, *p, sizeof(nrec));
+            *p += sizeof(nrec);
+            lua_createtable(L, narr, nrec);
+            for (i = 1; i <= narr; ++i)
+            {
+                Lua_unpacklua(L, p);
+                lua_rawseti(L, -2, i);
+            }
+            for (i = 0; i < nrec; ++i)
+            {
+                Lua_unpacklua(L, p);
+                Lua_unpacklua(L, p);
+                lua_rawset(L, -3);
+            }
+            break;
+    }
+}
+
+static PyObject *Lua_unpackpython(const char **p)
+    // new reference
+{
+    lua_Number x;
+    size_t len, narr, nrec, i;
+    PyObject *result, *key, *value;
+
+    switch (*(*p)++)
+    {
+        case LUA_PACK_FALSE:
+            Py_RETURN_FALSE;
+        case LUA_PACK_TRUE:
+            Py_RETURN_TRUE;
+        case LUA_PACK_NUMBER:
+            memcpy(&x, *p, sizeof(x));
+            *p += sizeof(x);
+            return PyFloat_FromDouble(x);
+        case LUA_PACK_STRING:
+            memcpy(&len, *p, sizeof(len));
+            *p += sizeof(len);
+            result = PyBytes_FromStringAndSize(*p, len);
+            *p += len;
+            return result;
+        case LUA_PACK_TABLE:
+            break;
+        default:
+            Py_RETURN_NONE;
+    }
+
+    memcpy(&narr, *p, sizeof(narr));
+    *p += sizeof(narr);
+    memcpy(&nrec, *p, sizeof(nrec));
+    *p += sizeof(nrec);
+
+    // sequences come back as lists, everything else as dicts
+    if (narr > 0 && nrec == 0)
+    {
+        result = PyList_New(narr);
+        for (i = 0; result != NULL && i < narr; ++i)
+        {
+            value = Lua_unpackpython(p);
+            if (value == NULL)
+                Py_CLEAR(result);
+            else
+                PyList_SET_ITEM(result, i, value);
+        }
+        return result;
+    }
+    result = PyDict_New();
+    for (i = 0; result != NULL && i < narr + nrec; ++i)
+    {
+        key = i < narr ? PyFloat_FromDouble(i + 1) : Lua_unpackpython(p);
+        value = key != NULL ? Lua_unpackpython(p) : NULL;
+        if (value == NULL || PyDict_SetItem(result, key, value) < 0)
+            Py_CLEAR(result);
+        Py_XDECREF(key);
+        Py_XDECREF(value);
+    }
+    return result;
+}
+
+static int Lua_pushchannel(LuaState *lua, PyObject *o)
+    // lua stack [-0, +1]
+{
+    LuaChannelEnd *e;
+    lua_State *L = lua->L;
+
+    e = (LuaChannelEnd *)lua_newuserdata(L, sizeof(LuaChannelEnd));
+    Py_INCREF(o);
+    e->channel = (LuaChannel *)o;
+    e->pending = NULL;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, lua->pychannelmetatable);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+static int Lua_chanpush(lua_State *L, int blocking)
+{
+    LuaChannelEnd *e;
+    LuaState *lua;
+    LuaPacker p = {NULL, 0, 0, LUA_TNONE, 0};
+    int status;
+
+    lua = (LuaState *)lua_touserdata(L, lua_upvalueindex(1));
+    e = (LuaChannelEnd *)luaL_checkudata(L, 1, PYCHANNEL);
+    luaL_checkany(L, 2);
+    // nil is what pop() returns once the channel is closed
+    if (lua_isnil(L, 2))
+        return luaL_argerror(L, 2, "cannot send nil");
+    if (!Lua_packlua(&p, L, 2, 0))
+    {
+        free(p.data);
+        if (p.badtype == LUA_TNONE)
+            return luaL_error(L, "not enough memory");
+        if (p.badkey)
+            return luaL_error(L, "cannot send a table used as a key");
+        if (p.badtype == LUA_TTABLE)
+            return luaL_error(L, "table is nested too deeply to send");
+        return luaL_error(L, "cannot send a %s through a channel",
+                lua_typename(L, p.badtype));
+    }
+
+    // the GIL is only held here if Lua was entered from a callback
+    status = LuaChannel_put(e->channel, p.data, blocking, lua->tstate == NULL);
+    if (status != LUA_CHANNEL_OK)
+        free(p.data);
+    if (status == LUA_CHANNEL_CLOSED)
+        return luaL_error(L, "push to a closed channel");
+    lua_pushboolean(L, status == LUA_CHANNEL_OK);
+    return 1;
+}
+
+static int Lua_chanpop(lua_State *L, int blocking)
+{
+    LuaChannelEnd *e;
+    LuaState *lua;
+    const char *p;
+
+    lua = (LuaState *)lua_touserdata(L, lua_upvalueindex(1));
+    e = (LuaChannelEnd *)luaL_checkudata(L, 1, PYCHANNEL);
+    free(e->pending);
+    e->pending = NULL;
+    if (LuaChannel_get(e->channel, &e->pending, blocking,
+                lua->tstate == NULL) != LUA_CHANNEL_OK)
+        return 0;
+
+    luaL_checkstack(L, 3 * LUA_PACK_MAXDEPTH + 3, "message too deep");
+    p = e->pending;
+    Lua_unpacklua(L, &p);
+    free(e->pending);
+    e->pending = NULL;
+    return 1;
+}
+
+static int lua_chan_push(lua_State *L)
+{
+    return Lua_chanpush(L, 1);
+}
+
+static int lua_chan_trypush(lua_State *L)
+{
+    return Lua_chanpush(L, 0);
+}
+
+static int lua_chan_pop(lua_State *L)
+{
+    return Lua_chanpop(L, 1);
+}
+
+static int lua_chan_trypop(lua_State *L)
+{
+    return Lua_chanpop(L, 0);
+}
+
+static int lua_chan_close(lua_State *L)
+{
+    LuaChannelEnd *e = (LuaChannelEnd *)luaL_checkudata(L, 1, PYCHANNEL);
+
+    LuaChannel_doclose(e->channel);
+    return 0;
+}
+
+static int lua_chan_closed(lua_State *L)
+{
+    LuaChannelEnd *e = (LuaChannelEnd *)luaL_checkudata(L, 1, PYCHANNEL);
+
+    lua_pushboolean(L, e->channel->closed);
+    return 1;
+}
+
+static int lua_chan_len(lua_State *L)
+{
+    LuaChannelEnd *e = (LuaChannelEnd *)luaL_checkudata(L, 1, PYCHANNEL);
+
+    lua_pushinteger(L, LuaChannel_length(e->channel));
+    return 1;
+}
+
+static int lua_chan_tostring(lua_State *L)
+{
+    LuaChannelEnd *e = (LuaChannelEnd *)luaL_checkudata(L, 1, PYCHANNEL);
+
+    lua_pushfstring(L, "Channel: %p", e->channel);
+    return 1;
+}
+
+static int lua_chan_gc(lua_State *L)
+{
+    LuaChannelEnd *e;
+    LuaState *lua;
+    PyThreadState *tstate;
+
+    lua = (LuaState *)lua_touserdata(L, lua_upvalueindex(1));
+    e = (LuaChannelEnd *)luaL_checkudata(L, 1, PYCHANNEL);
+    free(e->pending);
+    e->pending = NULL;
+    tstate = Lua_enterpython(lua);
+    Py_CLEAR(e->channel);
+    Lua_leavepython(lua, tstate);
+
+    return 0;
+}
+
+static int lua_obj_index(lua_State *L)
+{
+    PyObject *o, *key;
+    LuaState *lua;
+    PyThreadState *tstate;
+    int ok;
+
+    lua = (LuaState *)lua_touserdata(L, lua_upvalueindex(1));
+    o = *(PyObject **)luaL_checkudata(L, 1, PYOBJECT);
+    tstate = Lua_enterpython(lua);
+    key = Lua_tokeystring(lua, 2);
+    if (key == NULL)
+    {
+        Lua_leavepython(lua, tstate);
+        return luaL_error(L, "attribute name isn't a string");
+    }
+    ok = Lua_pushattr(lua, o, key);
+    Py_DECREF(key);
+    if (!ok)
+    {
+        PyErr_Print();
+        Lua_leavepython(lua, tstate);
+        return luaL_error(L, "error getting attribute");
+    }
+    Lua_leavepython(lua, tstate);
+    return 1;
+}
+
+static int lua_obj_newindex(lua_State *L)
+{
+    PyObject *o, *key, *val;
+    LuaState *lua;
+    PyThreadState *tstate;
+    int ret;
+
+    lua = (LuaState *)lua_touserdata(L, lua_upvalueindex(1));
+    o = *(PyObject **)luaL_checkudata(L, 1, PYOBJECT);
+    tstate = Lua_enterpython(lua);
+    key = Lua_tokeystring(lua, 2);
+    if (key == NULL)
+    {
+        Lua_leavepython(lua, tstate);
+        return luaL_error(L, "attribute name isn't a string");
+    }
+    val = Lua_topython(lua, 3);
+    ret = PyObject_SetAttr(o, key, val);
+    Py_DECREF(key);
+    Py_DECREF(val);
+    if (ret == -1)
+    {
+        PyErr_Clear();
+        Lua_leavepython(lua, tstate);
+        return luaL_error(L, "failed to set attribute");
+    }
+    Lua_leavepython(lua, tstate);
+    return 0;
+}
+
+static int Lua_pushattr(LuaState *lua, PyObject *o, PyObject *key)
+    // lua stack [-0, +1], or [-0, +0] with a Python exception set
+    // the object is at index 1 and the name at index 2
+{
+    PyObject *val;
+    int cacheable;
+
+    // methods found on the type are bound once per object and reused
+    cacheable = Lua_ismethodcacheable(o, key);
+    if (cacheable && Lua_getcachedmethod(lua, o))
+        return 1;
+
+    val = PyObject_GetAttr(o, key);
+    if (val == NULL)
+    {
+        if (!PyErr_ExceptionMatches(PyExc_AttributeError))
+            return 0;
+        PyErr_Clear();
+        lua_pushnil(lua->L);
+        return 1;
+    }
+    Lua_pushpyobject(lua, val);
+    Py_DECREF(val);
+    if (cacheable)
+        Lua_cachemethod(lua, o);
+    return 1;
+}
+
+static PyObject *Lua_tokeystring(LuaState *lua, int index)
+    // new reference, or NULL if the value is not a string
+    // lua stack [-0, +0]
+{
+    PyObject *key;
+    const char *s;
+    size_t len;
+    lua_State *L = lua->L;
+
+    if (lua_type(L, index) != LUA_TSTRING)
+        return NULL;
+    if (index < 0)
+        index = lua_gettop(L) + 1 + index;
+
+    // Lua strings are interned, so this lookup is by address
+    lua_rawgeti(L, LUA_REGISTRYINDEX, lua->keycache);
+    lua_pushvalue(L, index);
+    lua_rawget(L, -2);
+    key = (PyObject *)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    if (key != NULL)
+    {
+        lua_pop(L, 1);
+        Py_INCREF(key);
+        return key;
+    }
+
+    s = lua_tolstring(L, index, &len);
+    key = PyString_FromStringAndSize(s, len);
+    if (key == NULL)
+    {
+        lua_pop(L, 1);
+        PyErr_Clear();
+        return NULL;
+    }
+    PyString_InternInPlace(&key);
+
+    if (PyList_GET_SIZE(lua->keynames) >= LUA_KEYCACHE_SIZE)
+    {
+        // start over rather than track which names are still in use
+        lua_pop(L, 1);
+        luaL_unref(L, LUA_REGISTRYINDEX, lua->keycache);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua->keycache = luaL_ref(L, LUA_REGISTRYINDEX);
+        PyList_SetSlice(lua->keynames, 0, LUA_KEYCACHE_SIZE, NULL);
+    }
+    if (PyList_Append(lua->keynames, key) == 0)
+    {
+        lua_pushvalue(L, index);
+        lua_pushlightuserdata(L, key);
+        lua_rawset(L, -3);
+    }
+    else
+    {
+        PyErr_Clear();
+    }
+    lua_pop(L, 1);
+    return key;
+}
+
+static int Lua_ismethodcacheable(PyObject *o, PyObject *key)
+{
+    PyTypeObject *type = Py_TYPE(o);
+    PyObject *descr, **dictptr;
+
+    // only plain methods of types using the default lookup, and only while
+    // the instance does not shadow them
+    if (type->tp_getattro != PyObject_GenericGetAttr)
+        return 0;
+    descr = _PyType_Lookup(type, key);
+    if (descr == NULL || !(PyFunction_Check(descr)
+                || Py_TYPE(descr) == methoddescr_type))
+        return 0;
+    if (!PyType_HasFeature(type, Py_TPFLAGS_VALID_VERSION_TAG))
+        return 0;
+    dictptr = _PyObject_GetDictPtr(o);
+    if (dictptr != NULL && *dictptr != NULL
+            && PyDict_GetItem(*dictptr, key) != NULL)
+        return 0;
+    return 1;
+}
+
+static int Lua_getcachedmethod(LuaState *lua, PyObject *o)
+    // lua stack [-0, +1] on a hit, [-0, +0] otherwise
+    // the object is at index 1 and the name at index 2
+{
+    lua_State *L = lua->L;
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, lua->methodcache);
+    lua_pushvalue(L, 1);
+    lua_rawget(L, -2);
+    if (lua_istable(L, -1))
+    {
+        lua_rawgeti(L, -1, 1);
+        if (lua_tonumber(L, -1) == (lua_Number)Py_TYPE(o)->tp_version_tag)
+        {
+            lua_pushvalue(L, 2);
+            lua_rawget(L, -3);
+            if (!lua_isnil(L, -1))
+            {
+                lua_replace(L, -4);
+                lua_pop(L, 2);
+                return 1;
+            }
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 2);
+    return 0;
+}
+
+static void Lua_cachemethod(LuaState *lua, PyObject *o)
+    // lua stack [-0, +0]
+    // caches the method on top for the object at index 1 under the name at
+    // index 2
+{
+    lua_Number version = (lua_Number)Py_TYPE(o)->tp_version_tag;
+    lua_State *L = lua->L;
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, lua->methodcache);
+    lua_pushvalue(L, 1);
+    lua_rawget(L, -2);
+    if (lua_istable(L, -1))
+    {
+        lua_rawgeti(L, -1, 1);
+        if (lua_tonumber(L, -1) != version)
+        {
+            // the type has changed since; forget what was cached
+            lua_pop(L, 2);
+            lua_pushnil(L);
+        }
+        else
+        {
+            lua_pop(L, 1);
+        }
+    }
+    if (!lua_istable(L, -1))
+    {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushnumber(L, version);
+        lua_rawseti(L, -2, 1);
+        lua_pushvalue(L, 1);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, -4);
+    }
+    lua_pushvalue(L, 2);
+    lua_pushvalue(L, -4);
+    lua_rawset(L, -3);
+    lua_pop(L, 2);
+}
+
+static LuaPyBuffer *lua_tobuffer(lua_State *L, int index)
+{
+    return (LuaPyBuffer *)luaL_checkudata(L, index, PYBUFFER);
+}
+
+static ptrdiff_t lua_buf_posrelat(ptrdiff_t pos, size_t len)
+{
+    // negative positions count from the end, as in string.sub
+    if (pos < 0)
+        pos += (ptrdiff_t)len + 1;
+    return pos >= 0 ? pos : 0;
+}
+
+static PyThreadState *lua_buf_enter(lua_State *L, LuaState *lua,
+        LuaPyBuffer *b)
+    // refresh b->data and b->len; an object read through the old buffer
+    // interface can be resized or closed at any time, so it is read again
+    // with the GIL taken, which is then held until lua_buf_leave
+{
+#ifdef PY3
+    return NULL;
+#else
+    PyThreadState *tstate;
+    const void *data;
+    Py_ssize_t len;
+
+    if (b->obj == NULL)
+        return NULL;
+    tstate = Lua_enterpython(lua);
+    if (PyObject_AsReadBuffer(b->obj, &data, &len) < 0)
+    {
+        PyErr_Clear();
+        Lua_leavepython(lua, tstate);
+        luaL_error(L, "buffer is no longer readable");
+    }
+    b->data = data;
+    b->len = len;
+    return tstate;
+#endif
+}
+
+static void lua_buf_leave(LuaState *lua, LuaPyBuffer *b,
+        PyThreadState *tstate)
+{
+    if (b->obj != NULL)
+        Lua_leavepython(lua, tstate);
+}
+
+static int lua_buf_gc(lua_State *L)
+{
+    LuaPyBuffer *b;
+    LuaState *lua;
+    PyThreadState *tstate;
+
+    lua = (LuaState *)lua_touserdata(L, lua_upvalueindex(1));
+    b = lua_tobuffer(L, 1);
+    tstate = Lua_enterpython(lua);
+    if (b->exported)
+        PyBuffer_Release(&b->view);
+    else
+        Py_XDECREF(b->obj);
+    b->exported = 0;
+    b->obj = NULL;
+    // __gc can be called again by hand, and the methods after it
+    b->data = "";
+    b->len = 0;
+    Lua_leavepython(lua, tstate);
+
+    return 0;
+}
+
+static int lua_buf_len(lua_State *L)
+{
+    LuaState *lua = (LuaState *)lua_touserdata(L, lua_upvalueindex(1));
+    LuaPyBuffer *b = lua_tobuffer(L, 1);
+    PyThreadState *tstate;
+
+    tstate = lua_buf_enter(L, lua, b);
+    lua_pushinteger(L, b->len);
+    lua_buf_leave(lua, b, tstate);
+    return 1;
+}
+
+static int lua_buf_tostring(lua_State *L)
+{
+    LuaState *lua = (LuaState *)lua_touserdata(L, lua_upvalueindex(1));
+    LuaPyBuffer *b = lua_tobuffer(L, 1);
+    PyThreadState *tstate;
+
+    tstate = lua_buf_enter(L, lua, b);
+    lua_pushlstring(L, b->data, b->len);
+    lua_buf_leave(lua, b, tstate);
+    return 1;
+}
+
+static int lua_buf_index(lua_State *L)
+{
+    LuaState *lua = (LuaState *)lua_touserdata(L, lua_upvalueindex(1));
+    LuaPyBuffer *b = lua_tobuffer(L, 1);
+    PyThreadState *tstate;
+    ptrdiff_t i;
+
+    if (lua_type(L, 2) == LUA_TNUMBER)
+    {
+        i = lua_tointeger(L, 2);
+        tstate = lua_buf_enter(L, lua, b);
+        if (i >= 1 && i <= b->len)
+            lua_pushinteger(L, (unsigned char)b->data[i - 1]);
+        else
+            lua_pushnil(L);
+        lua_buf_leave(lua, b, tstate);
+        return 1;
+    }
+
+    // everything else is looked up among the methods in the metatable
+    lua_getmetatable(L, 1);
+    lua_pushvalue(L, 2);
+    lua_rawget(L, -2);
+    return 1;
+}
+
+static int lua_buf_sub(lua_State *L)
+{
+    LuaState *lua = (LuaState *)lua_touserdata(L, lua_upvalueindex(1));
+    LuaPyBuffer *b = lua_tobuffer(L, 1);
+    PyThreadState *tstate;
+    ptrdiff_t start, end;
+
+    start = luaL_checkinteger(L, 2);
+    end = luaL_optinteger(L, 3, -1);
+    tstate = lua_buf_enter(L, lua, b);
+    start = lua_buf_posrelat(start, b->len);
+    end = lua_buf_posrelat(end, b->len);
+    if (start < 1)
+        start = 1;
+    if (end > b->len)
+        end = b->len;
+    if (start <= end)
+        lua_pushlstring(L, b->data + start - 1, end - start + 1);
+    else
+        lua_pushliteral(L, "");
+    lua_buf_leave(lua, b, tstate);
+    return 1;
+}
+
+static int lua_buf_byte(lua_State *L)
+{
+    LuaState *lua = (LuaState *)lua_touserdata(L, lua_upvalueindex(1));
+    LuaPyBuffer *b = lua_tobuffer(L, 1);
+    PyThreadState *tstate;
+    ptrdiff_t start, end, i;
+
+    start = luaL_optinteger(L, 2, 1);
+    end = luaL_optinteger(L, 3, start);
+    tstate = lua_buf_enter(L, lua, b);
+    start = lua_buf_posrelat(start, b->len);
+    end = lua_buf_posrelat(end, b->len);
+    if (start < 1)
+        start = 1;
+    if (end > b->len)
+        end = b->len;
+    if (start > end)
+    {
+        lua_buf_leave(lua, b, tstate);
+        return 0;
+    }
+    if (!lua_checkstack(L, end - start + 1))
+    {
+        lua_buf_leave(lua, b, tstate);
+        return luaL_error(L, "buffer slice too long");
+    }
+    for (i = start; i <= end; ++i)
+        lua_pushinteger(L, (unsigned char)b->data[i - 1]);
+    lua_buf_leave(lua, b, tstate);
+    return end - start + 1;
+}
+
+static int lua_buf_find(lua_State *L)
+    // plain substring search only; there are no patterns
+{
+    LuaState *lua = (LuaState *)lua_touserdata(L, lua_upvalueindex(1));
+    LuaPyBuffer *b = lua_tobuffer(L, 1);
+    PyThreadState *tstate;
+    size_t len;
+    const char *s = luaL_checklstring(L, 2, &len);
+    ptrdiff_t init = luaL_optinteger(L, 3, 1);
+    const char *p, *end;
+    int n = 1;
+
+    tstate = lua_buf_enter(L, lua, b);
+    init = lua_buf_posrelat(init, b->len);
+    if (init < 1)
+        init = 1;
+    if (len == 0 && init <= b->len + 1)
+    {
+        lua_pushinteger(L, init);
+        lua_pushinteger(L, init - 1);
+        n = 2;
+    }
+    else if (init > b->len || len > (size_t)b->len)
+    {
+        lua_pushnil(L);
+    }
+    else
+    {
+        p = b->data + init - 1;
+        end = b->data + b->len - len;
+        while (p <= end && (p = memchr(p, s[0], end - p + 1)) != NULL)
+        {
+            if (memcmp(p, s, len) == 0)
+                break;
+            p++;
+        }
+        if (p != NULL && p <= end)
+        {
+            lua_pushinteger(L, p - b->data + 1);
+            lua_pushinteger(L, p - b->data + len);
+            n = 2;
+        }
+        else
+        {
+            lua_pushnil(L);
+        }
+    }
+    lua_buf_leave(lua, b, tstate);
+    return n;
+}
+
+static Py_ssize_t lua_arr_itemsize(char format)
+    // 0 for formats LuaArray does not support
+{
+    switch (format)
+    {
+        case 'b': return sizeof(signed char);
+        case 'B': return sizeof(unsigned char);
+        case 'h': return sizeof(short);
+        case 'H': return sizeof(unsigned short);
+        case 'i': return sizeof(int);
+        case 'I': return sizeof(unsigned int);
+        case 'l': return sizeof(long);
+        case 'L': return sizeof(unsigned long);
+        case 'q': return sizeof(long long);
+        case 'Q': return sizeof(unsigned long long);
+        case 'f': return sizeof(float);
+        case 'd': return sizeof(double);
+    }
+    return 0;
+}
+
+static lua_Number lua_arr_get(char format, const char *p)
+{
+    switch (format)
+    {
+        case 'b': return *(signed char *)p;
+        case 'B': return *(unsigned char *)p;
+        case 'h': return *(short *)p;
+        case 'H': return *(unsigned short *)p;
+        case 'i': return *(int *)p;
+        case 'I': return *(unsigned int *)p;
+        case 'l': return *(long *)p;
+        case 'L': return *(unsigned long *)p;
+        case 'q': return *(long long *)p;
+        case 'Q': return *(unsigned long long *)p;
+        case 'f': return *(float *)p;
+        case 'd': return *(double *)p;
+    }
+    return 0;
+}
+
+static int lua_arr_fits(char format, lua_Number n)
+    // whether n converts to the element type without overflow; NaN fails
+    // every comparison, so it only fits floating-point elements
+{
+    switch (format)
+    {
+        case 'b': return LUA_ARR_FITS(n, SCHAR_MIN, SCHAR_MAX);
+        case 'B': return LUA_ARR_FITS(n, 0, UCHAR_MAX);
+        case 'h': return LUA_ARR_FITS(n, SHRT_MIN, SHRT_MAX);
+        case 'H': return LUA_ARR_FITS(n, 0, USHRT_MAX);
+        case 'i': return LUA_ARR_FITS(n, INT_MIN, INT_MAX);
+        case 'I': return LUA_ARR_FITS(n, 0, UINT_MAX);
+        // the limits of 64-bit types are powers of two, which doubles hold
+        case 'l': return n >= (lua_Number)LONG_MIN
+                  && n < -(lua_Number)LONG_MIN;
+        case 'L': return n > -1 && n < 2 * ((lua_Number)(ULONG_MAX / 2) + 1);
+        case 'q': return n >= (lua_Number)LLONG_MIN
+                  && n < -(lua_Number)LLONG_MIN;
+        case 'Q': return n > -1
+                  && n < 2 * ((lua_Number)(ULLONG_MAX / 2) + 1);
+        case 'f': return n != n || (n >= -FLT_MAX && n <= FLT_MAX)
+                  || n == Py_HUGE_VAL || n == -Py_HUGE_VAL;
+    }
+    return 1;
+}
+
+static void lua_arr_set(char format, char *p, lua_Number n)
+    // n must fit, as checked by lua_arr_fits
+{
+    switch (format)
+    {
+        case 'b': *(signed char *)p = (signed char)n; break;
+        case 'B': *(unsigned char *)p = (unsigned char)n; break;
+        case 'h': *(short *)p = (short)n; break;
+        case 'H': *(unsigned short *)p = (unsigned short)n; break;
+        case 'i': *(int *)p = (int)n; break;
+        case 'I': *(unsigned int *)p = (unsigned int)n; break;
+        case 'l': *(long *)p = (long)n; break;
+        case 'L': *(unsigned long *)p = (unsigned long)n; break;
+        case 'q': *(long long *)p = (long long)n; break;
+        case 'Q': *(unsigned long long *)p = (unsigned long long)n; break;
+        case 'f': *(float *)p = (float)n; break;
+        case 'd': *(double *)p = (double)n; break;
+    }
+}
+
+static LuaPyArray *lua_toarray(lua_State *L, int index)
+{
+    return (LuaPyArray *)luaL_checkudata(L, index, PYARRAY);
+}
+
+static PyThreadState *lua_arr_enter(lua_State *L, LuaState *lua,
+        LuaPyArray *a)
+    // refresh a->data and a->len; an array held through the old buffer
+    // interface can be resized at any time, so it is read again with the
+    // GIL taken, which is then held until lua_arr_leave
+{
+#ifdef PY3
+    return NULL;
+#else
+    PyThreadState *tstate;
+    void *data;
+    Py_ssize_t len;
+
+    if (a->obj == NULL)
+        return NULL;
+    tstate = Lua_enterpython(lua);
+    if (PyObject_AsWriteBuffer(a->obj, &data, &len) < 0)
+    {
+        PyErr_Clear();
+        Lua_leavepython(lua, tstate);
+        luaL_error(L, "array is no longer writable");
+    }
+    a->data = data;
+    a->len = len / a->itemsize;
+    return tstate;
+#endif
+}
+
+static void lua_arr_leave(LuaState *lua, LuaPyArray *a,
+        PyThreadState *tstate)
+{
+    if (a->obj != NULL)
+        Lua_leavepython(lua, tstate);
+}
+
+static int lua_arr_gc(lua_State *L)
+{
+    LuaPyArray *a;
+    LuaState *lua;
+    PyThreadState *tstate;
+
+    lua = (LuaState *)lua_touserdata(L, lua_upvalueindex(1));
+    a = lua_toarray(L, 1);
+    tstate = Lua_enterpython(lua);
+    if (a->exported)
+        PyBuffer_Release(&a->view);
+    else
+        Py_XDECREF(a->obj);
+    a->exported = 0;
+    a->obj = NULL;
+    a->data = NULL;
+    a->len = 0;
+    Lua_leavepython(lua, tstate);
+
+    return 0;
+}
+
+static int lua_arr_len(lua_State *L)
+{
+    LuaState *lua = (LuaState *)lua_touserdata(L, lua_upvalueindex(1));
+    LuaPyArray *a = lua_toarray(L, 1);
+    PyThreadState *tstate;
+
+    tstate = lua_arr_enter(L, lua, a);
+    lua_pushinteger(L, a->len);
+    lua_arr_leave(lua, a, tstate);
+    return 1;
+}
+
+static int lua_arr_index(lua_State *L)
+{
+    LuaState *lua = (LuaState *)lua_touserdata(L, lua_upvalueindex(1));
+    LuaPyArray *a = lua_toarray(L, 1);
+    PyThreadState *tstate;
+    ptrdiff_t i;
+
+    if (lua_type(L, 2) == LUA_TNUMBER)
+    {
+        i = lua_tointeger(L, 2);
+        tstate = lua_arr_enter(L, lua, a);
+        if (i >= 1 && i <= a->len)
+            lua_pushnumber(L, lua_arr_get(a->format,
+                        a->data + (i - 1) * a->itemsize));
+        else
+            lua_pushnil(L);
+        lua_arr_leave(lua, a, tstate);
+        return 1;
+    }
+
+    lua_getmetatable(L, 1);
+    lua_pushvalue(L, 2);
+    lua_rawget(L, -2);
+    return 1;
+}
+
+static int lua_arr_newindex(lua_State *L)
+{
+    LuaState *lua = (LuaState *)lua_touserdata(L, lua_upvalueindex(1));
+    LuaPyArray *a = lua_toarray(L, 1);
+    PyThreadState *tstate;
+    ptrdiff_t i;
+    lua_Number n;
+
+    i = luaL_checkinteger(L, 2);
+    n = luaL_checknumber(L, 3);
+    if (a->readonly)
+        return luaL_error(L, "array is read-only");
+    if (!lua_arr_fits(a->format, n))
+        return luaL_error(L, "number out of range for array of '%c'",
+                a->format);
+    tstate = lua_arr_enter(L, lua, a);
+    if (i < 1 || i > a->len)
+    {
+        lua_arr_leave(lua, a, tstate);
+        return luaL_error(L, "array index %d out of range", (int)i);
+    }
+    lua_arr_set(a->format, a->data + (i - 1) * a->itemsize, n);
+    lua_arr_leave(lua, a, tstate);
+    return 0;
+}
+
+static int lua_dict_index(lua_State *L)
+{
+    PyObject *o, *key, *val;
+    LuaState *lua;
+    PyThreadState *tstate;
+
+    lua = (LuaState *)lua_touserdata(L, lua_upvalueindex(1));
+    o = *(PyObject **)luaL_checkudata(L, 1, PYDICT);
+    tstate = Lua_enterpython(lua);
+    key = Lua_tokeystring(lua, 2);
+    if (key == NULL)
+        key = Lua_topython(lua, 2);
+    if (PyDict_CheckExact(o))
+    {
+        val = PyDict_GetItem(o, key);
+        Py_XINCREF(val);
+    }
+    else if ((val = PyObject_GetItem(o, key)) == NULL
+            && PyErr_ExceptionMatches(PyExc_KeyError))
+    {
+        PyErr_Clear();
+    }
+    Py_DECREF(key);
+    if (PyErr_Occurred())
+    {
+        PyErr_Print();
+        Lua_leavepython(lua, tstate);
+        return luaL_error(L, "error getting item");
+    }
+    if (val != NULL)
+        Lua_pushpyobject(lua, val);
+    else
+        lua_pushnil(L);
+    Py_XDECREF(val);
+    Lua_leavepython(lua, tstate);
+    return 1;
+}
+
+static int lua_dict_newindex(lua_State *L)
+{
+    PyObject *o, *key, *val;
+    LuaState *lua;
+    PyThreadState *tstate;
+    int ret;
+
+    lua = (LuaState *)lua_touserdata(L, lua_upvalueindex(1));
+    o = *(PyObject **)luaL_checkudata(L, 1, PYDICT);
+    tstate = Lua_enterpython(lua);
+    key = Lua_tokeystring(lua, 2);
+    if (key == NULL)
+        key = Lua_topython(lua, 2);
+    if (lua_isnil(L, 3))
+    {
+        // as with tables, assigning nil removes the key
+        ret = PyObject_DelItem(o, key);
+        if (ret == -1 && PyErr_ExceptionMatches(PyExc_KeyError))
+        {
+            PyErr_Clear();
+            ret = 0;
+        }
+    }
+    else
+    {
+        val = Lua_topython(lua, 3);
+        ret = PyObject_SetItem(o, key, val);
+        Py_DECREF(val);
+    }
+    Py_DECREF(key);
+    if (ret == -1)
+    {
+        PyErr_Clear();
+        Lua_leavepython(lua, tstate);
+        return luaL_error(L, "failed to set item");
+    }
+    Lua_leavepython(lua, tstate);
+    return 0;
+}
+
+static int lua_dict_len(lua_State *L)
+{
+    PyObject *o;
+    LuaState *lua;
+    PyThreadState *tstate;
+    Py_ssize_t n;
+
+    lua = (LuaState *)lua_touserdata(L, lua_upvalueindex(1));
+    o = *(PyObject **)luaL_checkudata(L, 1, PYDICT);
+    tstate = Lua_enterpython(lua);
+    n = PyDict_Size(o);
+    Lua_leavepython(lua, tstate);
+    lua_pushinteger(L, n);
+    return 1;
+}
+
+static int lua_dict_pairs(lua_State *L)
+{
+    PyObject *o;
+    LuaState *lua;
+    PyThreadState *tstate;
+    Py_ssize_t n;
+
+    lua = (LuaState *)lua_touserdata(L, lua_upvalueindex(1));
+    o = *(PyObject **)luaL_checkudata(L, 1, PYDICT);
+    tstate = Lua_enterpython(lua);
+    n = PyDict_Size(o);
+    Lua_leavepython(lua, tstate);
+
+    // PyDict_Next resumes from a slot position rather than from a key, so
+    // the position lives in the iterator's upvalues, along with what is
+    // needed to notice the slots moving
+    lua_pushlightuserdata(L, lua);
+    lua_pushinteger(L, 0);
+    lua_pushinteger(L, n);
+    lua_pushlightuserdata(L, Lua_dictstorage(o));
+    lua_pushcclosure(L, lua_dict_next, 4);
+    lua_pushvalue(L, 1);
+    lua_pushnil(L);
+    return 3;
+}
+
+static int lua_dict_next(lua_State *L)
+{
+    PyObject *o, *key, *val;
+    LuaState *lua;
+    PyThreadState *tstate;
+    Py_ssize_t pos, n;
+    int found;
+
+    lua = (LuaState *)lua_touserdata(L, lua_upvalueindex(1));
+    o = *(PyObject **)luaL_checkudata(L, 1, PYDICT);
+    pos = lua_tointeger(L, lua_upvalueindex(2));
+    tstate = Lua_enterpython(lua);
+    // removing keys never moves the others, but adding them may, even when
+    // as many were removed: a resize swaps the storage for a new one
+    n = PyDict_Size(o);
+    if (n > lua_tointeger(L, lua_upvalueindex(3))
+            || Lua_dictstorage(o) != lua_touserdata(L, lua_upvalueindex(4)))
+    {
+        Lua_leavepython(lua, tstate);
+        return luaL_error(L, "dictionary changed during iteration");
+    }
+    found = PyDict_Next(o, &pos, &key, &val);
+    if (found)
+    {
+        Lua_pushpyobject(lua, key);
+        Lua_pushpyobject(lua, val);
+    }
+    Lua_leavepython(lua, tstate);
+    lua_pushinteger(L, pos);
+    lua_replace(L, lua_upvalueindex(2));
+    lua_pushinteger(L, n);
+    lua_replace(L, lua_upvalueindex(3));
+    return found ? 2 : 0;
+}
+
+static int lua_dict_ipairs(lua_State *L)
+{
+    luaL_checkudata(L, 1, PYDICT);
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_pushcclosure(L, lua_dict_inext, 1);
+    lua_pushvalue(L, 1);
+    lua_pushinteger(L, 0);
+    return 3;
+}
+
+static int lua_dict_inext(lua_State *L)
+{
+    PyObject *o, *key, *val;
+    LuaState *lua;
+    PyThreadState *tstate;
+    lua_Integer i;
+
+    lua = (LuaState *)lua_touserdata(L, lua_upvalueindex(1));
+    o = *(PyObject **)luaL_checkudata(L, 1, PYDICT);
+    i = luaL_checkinteger(L, 2) + 1;
+    tstate = Lua_enterpython(lua);
+    key = PyInt_FromSsize_t(i);
+    val = key != NULL ? PyDict_GetItem(o, key) : NULL;
+    Py_XDECREF(key);
+    PyErr_Clear();
+    if (val == NULL || val == Py_None)
+    {
+        Lua_leavepython(lua, tstate);
+        return 0;
+    }
+    lua_pushinteger(L, i);
+    Lua_pushpyobject(lua, val);
+    Lua_leavepython(lua, tstate);
+    return 2;
+}
+
+static int Lua_pushlistitem(LuaState *lua, PyObject *o, lua_Integer i)
+    // lua stack [-0, +1], or [-0, +0] when out of range, or [-0, +0] with
+    // a Python exception set and -1 returned
+{
+    PyObject *val;
+
+    if (PyList_CheckExact(o))
+    {
+        if (i < 1 || i > PyList_GET_SIZE(o))
+            return 0;
+        Lua_pushpyobject(lua, PyList_GET_ITEM(o, i - 1));
+        return 1;
+    }
+    if (PyTuple_CheckExact(o))
+    {
+        if (i < 1 || i > PyTuple_GET_SIZE(o))
+            return 0;
+        Lua_pushpyobject(lua, PyTuple_GET_ITEM(o, i - 1));
+        return 1;
+    }
+    if (i < 1)
+        return 0;
+    val = PySequence_GetItem(o, i - 1);
+    if (val == NULL)
+    {
+        if (!PyErr_ExceptionMatches(PyExc_IndexError))
+            return -1;
+        PyErr_Clear();
+        return 0;
+    }
+    Lua_pushpyobject(lua, val);
+    Py_DECREF(val);
+    return 1;
+}
+
+static int lua_list_index(lua_State *L)
+{
+    PyObject *o, *key;
+    LuaState *lua;
+    PyThreadState *tstate;
+    lua_Integer i;
+    int ret;
+
+    lua = (LuaState *)lua_touserdata(L, lua_upvalueindex(1));
+    o = *(PyObject **)luaL_checkudata(L, 1, PYLIST);
+    tstate = Lua_enterpython(lua);
+    switch (lua_type(L, 2))
+    {
+        case LUA_TNUMBER:
+            i = lua_tointeger(L, 2);
+            if ((lua_Number)i != lua_tonumber(L, 2))
+                ret = 0;
+            else
+                ret = Lua_pushlistitem(lua, o, i);
+            break;
+        case LUA_TSTRING:
+            // everything else about the list, such as xs:append(x)
+            key = Lua_tokeystring(lua, 2);
+            ret = key != NULL ? Lua_pushattr(lua, o, key) : 0;
+            Py_XDECREF(key);
+            if (ret == 0)
+                ret = -1;
+            break;
+        default:
+            ret = 0;
+            break;
+    }
+    if (ret == -1)
+    {
+        PyErr_Print();
+        Lua_leavepython(lua, tstate);
+        return luaL_error(L, "error getting item");
+    }
+    Lua_leavepython(lua, tstate);
+    if (ret == 0)
+        lua_pushnil(L);
+    return 1;
+}
+
+static int lua_list_newindex(lua_State *L)
+{
+    PyObject *o, *val;
+    LuaState *lua;
+    PyThreadState *tstate;
+    lua_Integer i;
+    Py_ssize_t n;
+    int ret;
+
+    lua = (LuaState *)lua_touserdata(L, lua_upvalueindex(1));
+    o = *(PyObject **)luaL_checkudata(L, 1, PYLIST);
+    i = luaL_checkinteger(L, 2);
+    tstate = Lua_enterpython(lua);
+    n = PySequence_Size(o);
+    if (n < 0 || !PyList_Check(o))
+    {
+        PyErr_Clear();
+        Lua_leavepython(lua, tstate);
+        return luaL_error(L, "sequence is read-only");
+    }
+    if (i < 1 || i > n + 1)
+    {
+        Lua_leavepython(lua, tstate);
+        return luaL_error(L, "list index %d out of range", (int)i);
+    }
+
+    // t[#t + 1] = v appends and t[#t] = nil pops, as with Lua sequences;
+    // nil anywhere else is stored as None
+    if (lua_isnil(L, 3) && i >= n)
+    {
+        ret = i == n ? PySequence_DelItem(o, i - 1) : 0;
+    }
+    else
+    {
+        val = Lua_topython(lua, 3);
+        if (i == n + 1)
+            ret = PyList_Append(o, val);
+        else
+            ret = PySequence_SetItem(o, i - 1, val);
+        Py_DECREF(val);
+    }
+    if (ret == -1)
+    {
+        PyErr_Clear();
+        Lua_leavepython(lua, tstate);
+        return luaL_error(L, "failed to set item");
+    }
+    Lua_leavepython(lua, tstate);
+    return 0;
+}
+
+static int lua_list_len(lua_State *L)
+{
+    PyObject *o;
+    LuaState *lua;
+    PyThreadState *tstate;
+    Py_ssize_t n;
+
+    lua = (LuaState *)lua_touserdata(L, lua_upvalueindex(1));
+    o = *(PyObject **)luaL_checkudata(L, 1, PYLIST);
+    tstate = Lua_enterpython(lua);
+    n = PySequence_Size(o);
+    if (n < 0)
+    {
+        PyErr_Print();
+        Lua_leavepython(lua, tstate);
+        return luaL_error(L, "error getting length");
+    }
+    Lua_leavepython(lua, tstate);
+    lua_pushinteger(L, n);
+    return 1;
+}
+
+static int lua_list_ipairs(lua_State *L)
+{
+    luaL_checkudata(L, 1, PYLIST);
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_pushcclosure(L, lua_list_inext, 1);
+    lua_pushvalue(L, 1);
+    lua_pushinteger(L, 0);
+    return 3;
+}
+
+static int lua_list_inext(lua_State *L)
+{
+    PyObject *o;
+    LuaState *lua;
+    PyThreadState *tstate;
+    lua_Integer i;
+    int ret;
+
+    lua = (LuaState *)lua_touserdata(L, lua_upvalueindex(1));
+    o = *(PyObject **)luaL_checkudata(L, 1, PYLIST);
+    i = luaL_checkinteger(L, 2) + 1;
+    lua_pushinteger(L, i);
+    tstate = Lua_enterpython(lua);
+    ret = Lua_pushlistitem(lua, o, i);
+    if (ret == -1)
+    {
+        PyErr_Print();
+        Lua_leavepython(lua, tstate);
+        return luaL_error(L, "error getting item");
+    }
+    Lua_leavepython(lua, tstate);
+    return ret ? 2 : 0;
+}
+
+static int lua_pairs(lua_State *L)
+{
+    // upvalue 1 is the library function, upvalue 2 the metamethod name
+    if (luaL_getmetafield(L, 1, lua_tostring(L, lua_upvalueindex(2))))
+    {
+        lua_pushvalue(L, 1);
+        lua_call(L, 1, 3);
+        return 3;
+    }
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_insert(L, 1);
+    lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+    return lua_gettop(L);
+}
+
+static void Lua_installpairs(LuaState *lua)
+    // lua stack [-0, +0]
+{
+    static const char *names[] = {"pairs", "__pairs", "ipairs", "__ipairs"};
+    int i;
+    lua_State *L = lua->L;
+
+    // Lua 5.1 ignores __pairs and __ipairs; teach the base library
+    for (i = 0; i < 4; i += 2)
+    {
+        lua_getglobal(L, names[i]);
+        if (!lua_isfunction(L, -1) || lua_tocfunction(L, -1) == lua_pairs)
+        {
+            lua_pop(L, 1);
+            continue;
+        }
+        lua_pushstring(L, names[i + 1]);
+        lua_pushcclosure(L, lua_pairs, 2);
+        lua_setglobal(L, names[i]);
+    }
+}
+
+static int lua_co_resume(lua_State *L)
+{
+    // upvalue 1 is the library function; functions from coroutine.wrap
+    // have their coroutine as upvalue 2, resume takes it as argument 1
+    lua_State *co = lua_tothread(L, lua_upvalueindex(2));
+    LuaState *lua = lua_getstate(L);
+
+    if (co == NULL)
+        co = lua_tothread(L, 1);
+    // a coroutine made before the current limits were set has no hook
+    if (co != NULL)
+        Lua_updatehook(lua, co);
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_insert(L, 1);
+    lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+    // resume() catches a limit hit in the coroutine; stop the caller too
+    if (lua->expired)
+        Lua_updatehook(lua, L);
+    return lua_gettop(L);
+}
+
+static int lua_co_wrap(lua_State *L)
+{
+    // upvalue 1 is the library function, whose result keeps the coroutine
+    // as its first upvalue
+    lua_settop(L, 1);
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_insert(L, 1);
+    lua_call(L, 1, 1);
+    if (lua_getupvalue(L, 1, 1) == NULL)
+        return 1;
+    lua_pushcclosure(L, lua_co_resume, 2);
+    return 1;
+}
+
+static void Lua_installresume(LuaState *lua)
+    // lua stack [-0, +0]
+{
+    static const char *names[] = {"resume", "wrap"};
+    static const lua_CFunction funcs[] = {lua_co_resume, lua_co_wrap};
+    int i;
+    lua_State *L = lua->L;
+
+    // limits hook each coroutine as it is resumed, since lua_sethook only
+    // reaches coroutines created after it
+    lua_getglobal(L, "coroutine");
+    if (!lua_istable(L, -1))
+    {
+        lua_pop(L, 1);
+        return;
+    }
+    for (i = 0; i < 2; ++i)
+    {
+        lua_getfield(L, -1, names[i]);
+        if (!lua_isfunction(L, -1) || lua_tocfunction(L, -1) == funcs[i])
+        {
+            lua_pop(L, 1);
+            continue;
+        }
+        lua_pushcclosure(L, funcs[i], 1);
+        lua_setfield(L, -2, names[i]);
+    }
+    lua_pop(L, 1);
+}
+
+void Lua_settable_cfunction(LuaState *lua, int index, const char *name,
+        lua_CFunction fn)
+    // lua stack [-0, +0]
+{
+    lua_pushstring(lua->L, name);
+    lua_pushlightuserdata(lua->L, lua);
+    lua_pushcclosure(lua->L, fn, 1);
+    if (index < 0)
+        index -= 2;
+    lua_rawset(lua->L, index);
+}
+
+static void Lua_newpymetatable(LuaState *lua)
+    // lua stack [-0, +0]
+{
+    lua_State *L = lua->L;
+
+    luaL_newmetatable(L, PYOBJECT);
+    Lua_settable_cfunction(lua, -1, "__gc", lua_obj_gc);
+    Lua_settable_cfunction(lua, -1, "__call", lua_obj_call);
+    Lua_settable_cfunction(lua, -1, "__index", lua_obj_index);
+    Lua_settable_cfunction(lua, -1, "__newindex", lua_obj_newindex);
+    lua->pymetatable = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    luaL_newmetatable(L, PYBUFFER);
+    Lua_settable_cfunction(lua, -1, "__gc", lua_buf_gc);
+    Lua_settable_cfunction(lua, -1, "__len", lua_buf_len);
+    Lua_settable_cfunction(lua, -1, "__tostring", lua_buf_tostring);
+    Lua_settable_cfunction(lua, -1, "__index", lua_buf_index);
+    Lua_settable_cfunction(lua, -1, "len", lua_buf_len);
+    Lua_settable_cfunction(lua, -1, "sub", lua_buf_sub);
+    Lua_settable_cfunction(lua, -1, "byte", lua_buf_byte);
+    Lua_settable_cfunction(lua, -1, "find", lua_buf_find);
+    lua->pybuffermetatable = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    luaL_newmetatable(L, PYARRAY);
+    Lua_settable_cfunction(lua, -1, "__gc", lua_arr_gc);
+    Lua_settable_cfunction(lua, -1, "__len", lua_arr_len);
+    Lua_settable_cfunction(lua, -1, "__index", lua_arr_index);
+    Lua_settable_cfunction(lua, -1, "__newindex", lua_arr_newindex);
+    Lua_settable_cfunction(lua, -1, "len", lua_arr_len);
+    lua->pyarraymetatable = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    luaL_newmetatable(L, PYDICT);
+    Lua_settable_cfunction(lua, -1, "__gc", lua_obj_gc);
+    Lua_settable_cfunction(lua, -1, "__len", lua_dict_len);
+    Lua_settable_cfunction(lua, -1, "__index", lua_dict_index);
+    Lua_settable_cfunction(lua, -1, "__newindex", lua_dict_newindex);
+    Lua_settable_cfunction(lua, -1, "__pairs", lua_dict_pairs);
+    Lua_settable_cfunction(lua, -1, "__ipairs", lua_dict_ipairs);
+    lua->pydictmetatable = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    luaL_newmetatable(L, PYLIST);
+    Lua_settable_cfunction(lua, -1, "__gc", lua_obj_gc);
+    Lua_settable_cfunction(lua, -1, "__len", lua_list_len);
+    Lua_settable_cfunction(lua, -1, "__index", lua_list_index);
+    Lua_settable_cfunction(lua, -1, "__newindex", lua_list_newindex);
+    Lua_settable_cfunction(lua, -1, "__pairs", lua_list_ipairs);
+    Lua_settable_cfunction(lua, -1, "__ipairs", lua_list_ipairs);
+    lua->pylistmetatable = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    luaL_newmetatable(L, PYFUNCTION);
+    Lua_settable_cfunction(lua, -1, "__gc", lua_func_gc);
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, PYCHANNEL);
+    Lua_settable_cfunction(lua, -1, "__gc", lua_chan_gc);
+    Lua_settable_cfunction(lua, -1, "__len", lua_chan_len);
+    Lua_settable_cfunction(lua, -1, "__tostring", lua_chan_tostring);
+    lua_newtable(L);
+    Lua_settable_cfunction(lua, -1, "push", lua_chan_push);
+    Lua_settable_cfunction(lua, -1, "try_push", lua_chan_trypush);
+    Lua_settable_cfunction(lua, -1, "pop", lua_chan_pop);
+    Lua_settable_cfunction(lua, -1, "try_pop", lua_chan_trypop);
+    Lua_settable_cfunction(lua, -1, "close", lua_chan_close);
+    Lua_settable_cfunction(lua, -1, "closed", lua_chan_closed);
+    lua_setfield(L, -2, "__index");
+    lua->pychannelmetatable = luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+static int Lua_isbuffertype(PyTypeObject *type)
+{
+    return PyType_IsSubtype(type, &PyByteArray_Type)
+        || type == &PyMemoryView_Type
+#ifndef PY3
+        || type == &PyBuffer_Type
+#endif
+        || (mmap_type && PyType_IsSubtype(type, (PyTypeObject *)mmap_type));
+}
+
+static int Lua_isbufferobject(PyObject *o)
+{
+    return Lua_isbuffertype(Py_TYPE(o));
+}
+
+static int Lua_pushbuffer(LuaState *lua, PyObject *o)
+    // lua stack [-0, +1], or [-0, +0] if o has no usable buffer
+{
+    LuaPyBuffer *b;
+#ifndef PY3
+    const void *data;
+    Py_ssize_t len;
+#endif
+    lua_State *L = lua->L;
+
+    b = (LuaPyBuffer *)lua_newuserdata(L, sizeof(LuaPyBuffer));
+    b->obj = NULL;
+    b->exported = 0;
+    // Python 2's buffer objects export a view without pinning what they
+    // wrap, so they are treated like the old buffers that they are
+    if (PyObject_CheckBuffer(o)
+#ifndef PY3
+            && !PyBuffer_Check(o)
+#endif
+            && PyObject_GetBuffer(o, &b->view, PyBUF_SIMPLE) == 0)
+    {
+        // exporting the buffer also stops it from being resized
+        b->exported = 1;
+        b->data = b->view.buf;
+        b->len = b->view.len;
+    }
+#ifndef PY3
+    // old buffers can be resized or closed under us, so lua_buf_enter
+    // fetches them again on every access
+    else if (PyErr_Clear(), PyObject_AsReadBuffer(o, &data, &len) == 0)
+    {
+        Py_INCREF(o);
+        b->obj = o;
+        b->data = data;
+        b->len = len;
+    }
+#endif
+    else
+    {
+        PyErr_Clear();
+        lua_pop(L, 1);
+        return 0;
+    }
+    lua_rawgeti(L, LUA_REGISTRYINDEX, lua->pybuffermetatable);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+static PyObject *Lua_tobuffer(LuaState *lua, int index)
+    // new reference
+    // lua stack [-0, +0]
+{
+    LuaBuffer *b;
+    size_t len;
+
+    b = (LuaBuffer *)LuaBufferType.tp_alloc(&LuaBufferType, 0);
+    if (b == NULL)
+        return NULL;
+    Py_INCREF(lua);
+    b->lua = lua;
+    // Lua strings never move, so the data stays valid while it is ref'd
+    b->data = lua_tolstring(lua->L, index, &len);
+    b->len = len;
+    lua_pushvalue(lua->L, index);
+    b->ref = luaL_ref(lua->L, LUA_REGISTRYINDEX);
+    return (PyObject *)b;
+}
+
+static int Lua_pusharray(LuaState *lua, PyObject *o)
+    // lua stack [-0, +1], or [-0, +0] if o is not a typed numeric buffer
+{
+    LuaPyArray *a;
+    const char *format;
+#ifndef PY3
+    PyObject *typecode;
+    void *data;
+    Py_ssize_t len;
+#endif
+    lua_State *L = lua->L;
+
+    if (!(array_type && PyObject_TypeCheck(o, (PyTypeObject *)array_type))
+            && !PyObject_CheckBuffer(o))
+        return 0;
+
+    a = (LuaPyArray *)lua_newuserdata(L, sizeof(LuaPyArray));
+    a->obj = NULL;
+    a->exported = 0;
+    a->readonly = 0;
+
+    if (PyObject_CheckBuffer(o))
+    {
+        if (PyObject_GetBuffer(o, &a->view,
+                    PyBUF_FORMAT | PyBUF_ND | PyBUF_WRITABLE) < 0)
+        {
+            PyErr_Clear();
+            a->readonly = 1;
+            if (PyObject_GetBuffer(o, &a->view, PyBUF_FORMAT | PyBUF_ND) < 0)
+                goto fail;
+        }
+        a->exported = 1;
+        format = a->view.format ? a->view.format : "B";
+        if (*format == '@')
+            format++;
+        if (a->view.ndim != 1 || format[0] == '\0' || format[1] != '\0'
+                || lua_arr_itemsize(format[0]) != a->view.itemsize)
+            goto fail;
+        a->format = format[0];
+        a->data = a->view.buf;
+        a->itemsize = a->view.itemsize;
+        a->len = a->view.shape[0];
+    }
+    else
+    {
+#ifdef PY3
+        goto fail;
+#else
+        // array.array only has the old buffer interface in Python 2, which
+        // does not stop it being resized; lua_arr_enter reads it again on
+        // every access
+        typecode = PyObject_GetAttrString(o, "typecode");
+        if (typecode == NULL || !PyString_Check(typecode)
+                || PyString_GET_SIZE(typecode) != 1)
+        {
+            Py_XDECREF(typecode);
+            goto fail;
+        }
+        a->format = PyString_AS_STRING(typecode)[0];
+        Py_DECREF(typecode);
+        a->itemsize = lua_arr_itemsize(a->format);
+        if (a->itemsize == 0 || PyObject_AsWriteBuffer(o, &data, &len) < 0)
+            goto fail;
+        Py_INCREF(o);
+        a->obj = o;
+        a->data = data;
+        a->len = len / a->itemsize;
+#endif
+    }
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, lua->pyarraymetatable);
+    lua_setmetatable(L, -2);
+    return 1;
+
+fail:
+    PyErr_Clear();
+    if (a->exported)
+        PyBuffer_Release(&a->view);
+    lua_pop(L, 1);
+    return 0;
+}
+
+static PyObject *Lua_toarray(LuaState *lua, int index, char format)
+    // new reference
+    // lua stack [-0, +0]
+{
+    PyObject *packed, *result;
+    Py_ssize_t itemsize, i, n;
+    char *p;
+    lua_State *L = lua->L;
+
+    itemsize = lua_arr_itemsize(format);
+    if (itemsize == 0)
+    {
+        PyErr_Format(PyExc_ValueError, "unsupported typecode '%c'", format);
+        return NULL;
+    }
+    if (index < 0)
+        index = lua_gettop(L) + 1 + index;
+
+    n = lua_objlen(L, index);
+    packed = PyBytes_FromStringAndSize(NULL, n * itemsize);
+    if (packed == NULL)
+        return NULL;
+    p = PyBytes_AS_STRING(packed);
+    for (i = 1; i <= n; ++i, p += itemsize)
+    {
+        lua_rawgeti(L, index, i);
+        if (lua_type(L, -1) != LUA_TNUMBER)
+        {
+            lua_pop(L, 1);
+            Py_DECREF(packed);
+            PyErr_Format(PyExc_TypeError, "element %d is not a number",
+                    (int)i);
+            return NULL;
+        }
+        if (!lua_arr_fits(format, lua_tonumber(L, -1)))
+        {
+            lua_pop(L, 1);
+            Py_DECREF(packed);
+            PyErr_Format(PyExc_OverflowError,
+                    "element %d out of range for array of '%c'", (int)i,
+                    format);
+            return NULL;
+        }
+        lua_arr_set(format, p, lua_tonumber(L, -1));
+        lua_pop(L, 1);
+    }
+
+#ifdef PY3
+    result = PyObject_CallFunction(array_type, "CO", format, packed);
+#else
+    result = PyObject_CallFunction(array_type, "cO", format, packed);
+#endif
+    Py_DECREF(packed);
+    return result;
+}
+
+static int Lua_pushpyobject_tuple(LuaState *lua, PyObject *o)
+    // lua stack [-0, +n]
+{
+    if (PyTuple_Check(o))
+    {
+        int size = PyTuple_Size(o), i, n = 0;
+        for (i = 0; i < size; ++i)
+            n += Lua_pushpyobject(lua, PyTuple_GetItem(o, i));
+        return n;
+    }
+    return Lua_pushpyobject(lua, o);
+}
+
+static int Lua_pushpyobject(LuaState *lua, PyObject *o)
+    // lua stack [-0, +1]
+{
+    int n;
+    STATS_DECLARE(t)
+
+    STATS_START(t);
+    n = Lua_dopushpyobject(lua, o);
+    STATS_STOP(lua, push[Lua_pytypestat(o)], t);
+    return n;
+}
+
+static int Lua_dopushpyobject(LuaState *lua, PyObject *o)
+    // lua stack [-0, +1]
+{
+    LuaConverter *c;
+#ifdef PY3
+    const char *str;
+    Py_ssize_t len;
+#endif
+    lua_State *L = lua->L;
+
+    if (o == NULL)
+    {
+        Log("attempted to push null object\n");
+        return 0;
+    }
+
+    c = Lua_getconverter(lua, Py_TYPE(o));
+    switch (c->kind)
+    {
+        case LUA_CONV_NONE:
+            lua_pushnil(L);
+            return 1;
+        case LUA_CONV_BOOL:
+            lua_pushboolean(L, o == Py_True);
+            return 1;
+        case LUA_CONV_INT:
+            lua_pushinteger(L, PyInt_AS_LONG(o));
+            return 1;
+        case LUA_CONV_LONG:
+            lua_pushnumber(L, PyLong_AsDouble(o));
+            if (PyErr_Occurred())
+            {
+                // too large even for a double
+                PyErr_Clear();
+                lua_pop(L, 1);
+                lua_pushnumber(L, _PyLong_Sign(o) * Py_HUGE_VAL);
+            }
+            return 1;
+        case LUA_CONV_FLOAT:
+            lua_pushnumber(L, PyFloat_AS_DOUBLE(o));
+            return 1;
+        case LUA_CONV_STRING:
+            lua_pushlstring(L, PyBytes_AS_STRING(o), PyBytes_GET_SIZE(o));
+            return 1;
+#ifdef PY3
+        case LUA_CONV_UNICODE:
+            str = PyUnicode_AsUTF8AndSize(o, &len);
+            if (str == NULL)
+            {
+                PyErr_Clear();
+                return Lua_pushuserdata(lua, o, lua->pymetatable);
+            }
+            lua_pushlstring(L, str, len);
+            return 1;
+#endif
+        case LUA_CONV_LUAOBJECT:
+            lua_pushluaobject(L, (LuaObject *)o);
+            return 1;
+        case LUA_CONV_LUABUFFER:
+            if (((LuaBuffer *)o)->lua == lua)
+                lua_rawgeti(L, LUA_REGISTRYINDEX, ((LuaBuffer *)o)->ref);
+            else
+                lua_pushlstring(L, ((LuaBuffer *)o)->data,
+                        ((LuaBuffer *)o)->len);
+            return 1;
+        case LUA_CONV_BUFFER:
+            if (Lua_pushbuffer(lua, o) || Lua_pusharray(lua, o))
+                return 1;
+            return Lua_pushuserdata(lua, o, lua->pymetatable);
+        case LUA_CONV_ARRAY:
+            if (Lua_pusharray(lua, o))
+                return 1;
+            return Lua_pushuserdata(lua, o, lua->pymetatable);
+        case LUA_CONV_DICT:
+            return Lua_pushuserdata(lua, o, lua->pydictmetatable);
+        case LUA_CONV_LIST:
+            return Lua_pushuserdata(lua, o, lua->pylistmetatable);
+        case LUA_CONV_CHANNEL:
+            return Lua_pushchannel(lua, o);
+        case LUA_CONV_CUSTOM:
+            return Lua_pushconverted(lua, o, c->func);
+        default:
+            return Lua_pushuserdata(lua, o, lua->pymetatable);
+    }
+}
+
+static int Lua_pushuserdata(LuaState *lua, PyObject *o, int metatable)
+    // lua stack [-0, +1]
+{
+    PyObject **userdata;
+    lua_State *L = lua->L;
+
+    userdata = lua_newuserdata(L, sizeof(PyObject *));
+    Py_INCREF(o);
+    *userdata = o;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, metatable);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+static int Lua_pushconverted(LuaState *lua, PyObject *o, PyObject *func)
+    // lua stack [-0, +1]
+{
+    PyObject *result;
+    int n;
+
+    if (Py_EnterRecursiveCall(" while converting to a Lua value"))
+    {
+        PyErr_WriteUnraisable(func);
+        return Lua_pushuserdata(lua, o, lua->pymetatable);
+    }
+    result = PyObject_CallFunctionObjArgs(func, o, NULL);
+    if (result == NULL)
+    {
+        // there is no caller to raise to; report it and pass o as it is
+        PyErr_WriteUnraisable(func);
+        n = Lua_pushuserdata(lua, o, lua->pymetatable);
+    }
+    else if (Py_TYPE(result) == Py_TYPE(o))
+    {
+        n = Lua_pushuserdata(lua, result, lua->pymetatable);
+    }
+    else
+    {
+        n = Lua_dopushpyobject(lua, result);
+    }
+    Py_XDECREF(result);
+    Py_LeaveRecursiveCall();
+    return n;
+}
+
+static int Lua_convkind(LuaState *lua, PyTypeObject *type, PyObject **func)
+    // how to push values of the given type, in the order the checks used
+    // to run for every value
+{
+    PyObject *mro;
+    Py_ssize_t i, n;
+
+    if (type == Py_TYPE(Py_None))
+        return LUA_CONV_NONE;
+
+    if (lua->converters != NULL)
+    {
+        // the most derived registered type wins
+        mro = type->tp_mro;
+        n = mro != NULL ? PyTuple_GET_SIZE(mro) : 0;
+        *func = PyDict_GetItem(lua->converters, (PyObject *)type);
+        for (i = 0; *func == NULL && i < n; ++i)
+            *func = PyDict_GetItem(lua->converters,
+                    PyTuple_GET_ITEM(mro, i));
+        if (*func != NULL)
+            return LUA_CONV_CUSTOM;
+    }
+
+    if (type == &PyBool_Type)
+        return LUA_CONV_BOOL;
+#ifndef PY3
+    if (PyType_FastSubclass(type, Py_TPFLAGS_INT_SUBCLASS))
+        return LUA_CONV_INT;
+#endif
+    if (PyType_FastSubclass(type, Py_TPFLAGS_LONG_SUBCLASS))
+        return LUA_CONV_LONG;
+    if (PyType_IsSubtype(type, &PyFloat_Type))
+        return LUA_CONV_FLOAT;
+    if (PyType_FastSubclass(type, Py_TPFLAGS_STRING_SUBCLASS))
+        return LUA_CONV_STRING;
+#ifdef PY3
+    if (PyType_FastSubclass(type, Py_TPFLAGS_UNICODE_SUBCLASS))
+        return LUA_CONV_UNICODE;
+#endif
+    if (PyType_IsSubtype(type, &LuaObjectType))
+        return LUA_CONV_LUAOBJECT;
+    if (PyType_IsSubtype(type, &LuaBufferType))
+        return LUA_CONV_LUABUFFER;
+    if (Lua_isbuffertype(type))
+        return LUA_CONV_BUFFER;
+    if ((array_type && PyType_IsSubtype(type, (PyTypeObject *)array_type))
+            || Lua_hasnewbuffer(type))
+        return LUA_CONV_ARRAY;
+    if (PyType_FastSubclass(type, Py_TPFLAGS_DICT_SUBCLASS))
+        return LUA_CONV_DICT;
+    if (PyType_FastSubclass(type, Py_TPFLAGS_LIST_SUBCLASS
+                | Py_TPFLAGS_TUPLE_SUBCLASS))
+        return LUA_CONV_LIST;
+    if (PyType_IsSubtype(type, &LuaChannelType))
+        return LUA_CONV_CHANNEL;
+    return LUA_CONV_OBJECT;
+}
+
+static LuaConverter *Lua_getconverter(LuaState *lua, PyTypeObject *type)
+{
+    LuaConverter *c;
+    PyTypeObject *old;
+    PyObject *func = NULL;
+
+    c = &lua->convcache[((Py_uintptr_t)type >> 4) % LUA_CONVCACHE_SIZE];
+    if (c->type == type)
+        return c;
+
+    // the cache holds on to its types so their addresses are not reused
+    old = c->type;
+    Py_INCREF(type);
+    c->type = type;
+    c->kind = Lua_convkind(lua, type, &func);
+    c->func = func;
+    Py_XDECREF(old);
+    return c;
+}
+
+static void Lua_clearconverters(LuaState *lua)
+{
+    PyTypeObject *type;
+    int i;
+
+    for (i = 0; i < LUA_CONVCACHE_SIZE; ++i)
+    {
+        type = lua->convcache[i].type;
+        lua->convcache[i].type = NULL;
+        lua->convcache[i].func = NULL;
+        Py_XDECREF(type);
+    }
+}
+
+static PyObject *Lua_topython(LuaState *lua, int index)
+    // new reference
+    // lua stack [-0, +0]
+{
+    PyObject *result;
+    STATS_DECLARE(t)
+
+    STATS_START(t);
+    result = Lua_dotopython(lua, index);
+    STATS_STOP(lua, topython[lua_type(lua->L, index) + 1], t);
+    return result;
+}
+
+static PyObject *Lua_dotopython(LuaState *lua, int index)
+    // new reference
+    // lua stack [-0, +0]
+{
+    size_t len;
+    const char *str;
+    lua_Number n;
+    lua_State *L = lua->L;
+    PyObject *result;
+
+    switch (lua_type(L, index))
+    {
+        case LUA_TNONE:
+            return NULL;
+        case LUA_TNIL:
+            Py_RETURN_NONE;
+        case LUA_TNUMBER:
+            n = lua_tonumber(L, index);
+            if (lua->integers && n >= (lua_Number)LONG_MIN
+                    && n < -(lua_Number)LONG_MIN && (lua_Number)(long)n == n)
+                return PyInt_FromLong((long)n);
+            return PyFloat_FromDouble(n);
+        case LUA_TBOOLEAN:
+            if (lua_toboolean(L, index))
+                Py_RETURN_TRUE;
+            else
+                Py_RETURN_FALSE;
+        case LUA_TSTRING:
+            str = lua_tolstring(L, index, &len);
+            if (lua->bufferthreshold >= 0
+                    && (Py_ssize_t)len >= lua->bufferthreshold)
+                return Lua_tobuffer(lua, index);
+            return PyBytes_FromStringAndSize(str, len);
+        case LUA_TUSERDATA:
+            result = Lua_topyobject(lua, index);
+            if (result != NULL)
+                return result;
+        case LUA_TTHREAD:
+        case LUA_TLIGHTUSERDATA:
+        case LUA_TFUNCTION:
+        case LUA_TTABLE:
+            return Lua_toluaobject(lua, index);
+    }
+    return NULL;
+}
+
+static int Lua_pushtable(LuaState *lua, PyObject *o, int depth, int memo)
+    // lua stack [-0, +1], or [-0, +0] with a Python exception on failure
+{
+    PyObject *items, *key, *val;
+    Py_ssize_t i, n;
+    lua_State *L = lua->L;
+
+    if (depth == 0 || !(PyDict_Check(o) || PyList_Check(o)
+                || PyTuple_Check(o)))
+        return Lua_pushpyobject(lua, o);
+
+    // containers seen before are shared, which also takes care of cycles
+    lua_pushlightuserdata(L, o);
+    lua_rawget(L, memo);
+    if (!lua_isnil(L, -1))
+        return 1;
+    lua_pop(L, 1);
+
+    if (!lua_checkstack(L, 4))
+    {
+        PyErr_SetString(PyExc_MemoryError, "Lua stack overflow");
+        return 0;
+    }
+    if (Py_EnterRecursiveCall(" while converting to a Lua table"))
+        return 0;
+
+    // converters may run arbitrary Python code, so work from a snapshot
+    // that keeps every item alive however o changes meanwhile
+    items = PyDict_Check(o) ? PyDict_Items(o) : PySequence_Tuple(o);
+    if (items == NULL)
+    {
+        Py_LeaveRecursiveCall();
+        return 0;
+    }
+
+    if (PyDict_Check(o))
+    {
+        n = PyList_GET_SIZE(items);
+        lua_createtable(L, 0, n);
+        lua_pushlightuserdata(L, o);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, memo);
+
+        for (i = 0; i < n; ++i)
+        {
+            key = PyTuple_GET_ITEM(PyList_GET_ITEM(items, i), 0);
+            val = PyTuple_GET_ITEM(PyList_GET_ITEM(items, i), 1);
+            Lua_pushpyobject(lua, key);
+            // lua_rawset would raise an unprotected error on these
+            if (lua_isnil(L, -1) || (lua_type(L, -1) == LUA_TNUMBER
+                        && lua_tonumber(L, -1) != lua_tonumber(L, -1)))
+            {
+                lua_pop(L, 2);
+                PyErr_SetString(PyExc_ValueError,
+                        "None and NaN cannot be keys of a Lua table");
+                goto fail;
+            }
+            if (!Lua_pushtable(lua, val, depth - 1, memo))
+            {
+                lua_pop(L, 2);
+                goto fail;
+            }
+            lua_rawset(L, -3);
+        }
+    }
+    else
+    {
+        n = PyTuple_GET_SIZE(items);
+        lua_createtable(L, n, 0);
+        lua_pushlightuserdata(L, o);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, memo);
+
+        for (i = 0; i < n; ++i)
+        {
+            if (!Lua_pushtable(lua, PyTuple_GET_ITEM(items, i), depth - 1,
+                        memo))
+            {
+                lua_pop(L, 1);
+                goto fail;
+            }
+            lua_rawseti(L, -2, i + 1);
+        }
+    }
+
+    Py_DECREF(items);
+    Py_LeaveRecursiveCall();
+    return 1;
+
+fail:
+    Py_DECREF(items);
+    Py_LeaveRecursiveCall();
+    return 0;
+}
+
+static PyObject *Lua_tonested(LuaState *lua, int index, int depth, PyObject
+        *memo)
+    // new reference
+    // lua stack [-0, +0]
+{
+    PyObject *key, *result;
+    lua_State *L = lua->L;
+
+    if (depth == 0 || !lua_istable(L, index))
+        return Lua_topython(lua, index);
+
+    key = PyLong_FromVoidPtr((void *)lua_topointer(L, index));
+    if (key == NULL)
+        return NULL;
+    result = PyDict_GetItem(memo, key);
+    Py_DECREF(key);
+    if (result != NULL)
+    {
+        Py_INCREF(result);
+        return result;
+    }
+
+    if (lua_issequence(L, index))
+        return Lua_tolist(lua, index, depth, memo);
+    return Lua_todict(lua, index, depth, memo);
+}
+
+static PyObject *Lua_todict(LuaState *lua, int index, int depth, PyObject
+        *memo)
+    // new reference
+    // lua stack [-0, +0]
+{
+    PyObject *result, *key, *val, *ptr;
+    lua_State *L = lua->L;
+
+    if (index < 0)
+        index = lua_gettop(L) + 1 + index;
+    if (!lua_checkstack(L, 3))
+    {
+        PyErr_SetString(PyExc_MemoryError, "Lua stack overflow");
+        return NULL;
+    }
+    if (Py_EnterRecursiveCall(" while converting a Lua table"))
+        return NULL;
+
+    result = PyDict_New();
+    ptr = PyLong_FromVoidPtr((void *)lua_topointer(L, index));
+    if (result == NULL || ptr == NULL || PyDict_SetItem(memo, ptr, result))
+        goto fail;
+
+    lua_pushnil(L);
+    while (lua_next(L, index))
+    {
+        key = Lua_topython(lua, -2);
+        val = Lua_tonested(lua, -1, depth - 1, memo);
+        if (key == NULL || val == NULL || PyDict_SetItem(result, key, val))
+        {
+            Py_XDECREF(key);
+            Py_XDECREF(val);
+            lua_pop(L, 2);
+            goto fail;
+        }
+        Py_DECREF(key);
+        Py_DECREF(val);
+        lua_pop(L, 1);
+    }
+
+    Py_DECREF(ptr);
+    Py_LeaveRecursiveCall();
+    return result;
+
+fail:
+    Py_XDECREF(result);
+    Py_XDECREF(ptr);
+    Py_LeaveRecursiveCall();
+    return NULL;
+}
+
+static PyObject *Lua_tolist(LuaState *lua, int index, int depth, PyObject
+        *memo)
+    // new reference
+    // lua stack [-0, +0]
+{
+    PyObject *result, *val, *ptr;
+    size_t i, n;
+    lua_State *L = lua->L;
+
+    if (index < 0)
+        index = lua_gettop(L) + 1 + index;
+    if (!lua_checkstack(L, 2))
+    {
+        PyErr_SetString(PyExc_MemoryError, "Lua stack overflow");
+        return NULL;
+    }
+    if (Py_EnterRecursiveCall(" while converting a Lua table"))
+        return NULL;
+
+    n = lua_objlen(L, index);
+    result = PyList_New(n);
+    ptr = PyLong_FromVoidPtr((void *)lua_topointer(L, index));
+    if (result == NULL || ptr == NULL || PyDict_SetItem(memo, ptr, result))
+        goto fail;
+
+    for (i = 0; i < n; ++i)
+    {
+        lua_rawgeti(L, index, i + 1);
+        val = Lua_tonested(lua, -1, depth - 1, memo);
+        lua_pop(L, 1);
+        if (val == NULL)
+            goto fail;
+        PyList_SET_ITEM(result, i, val);
+    }
+
+    Py_DECREF(ptr);
+    Py_LeaveRecursiveCall();
+    return result;
+
+fail:
+    Py_XDECREF(result);
+    Py_XDECREF(ptr);
+    Py_LeaveRecursiveCall();
+    return NULL;
+}
+
+static PyObject *Lua_topython_tuple(LuaState *lua, int n)
+    // new reference
+    // lua stack [-0, +0]
+{
+    PyObject *result;
+    int i;
+
+    result = PyTuple_New(n);
+    for (i = 0; i < n; ++i)
+        PyTuple_SET_ITEM(result, i, Lua_topython(lua, i - n));
+    return result;
+}
+
+static PyObject *Lua_topython_multiple(LuaState *lua, int n)
+    // new reference
+    // lua stack [-0, +0]
+{
+    if (n == 0)
+        Py_RETURN_NONE;
+    else if (n == 1)
+        return Lua_topython(lua, -1);
+    else
+        return Lua_topython_tuple(lua, n);
+}
+
+static PyObject *Lua_callfunction(LuaState *lua, PyObject *args)
+    // new reference
+    // lua stack [-1, +0]
+{
+    return Lua_callvector(lua, &PyTuple_GET_ITEM(args, 0),
+            PyTuple_GET_SIZE(args));
+}
+
+static PyObject *Lua_callvector(LuaState *lua, PyObject *const *argv,
+        Py_ssize_t n)
+    // new reference
+    // lua stack [-1, +0]
+{
+    int oldtop, status, pushed = 0;
+    Py_ssize_t i;
+    PyObject *result;
+    lua_State *L = lua->L;
+
+    oldtop = lua_gettop(L) - 1;
+    if (n > INT_MAX - LUA_MINSTACK
+            || !lua_checkstack(L, (int)n + LUA_MINSTACK))
+    {
+        lua_settop(L, oldtop);
+        PyErr_SetString(PyExc_OverflowError, "too many arguments for Lua");
+        return NULL;
+    }
+    for (i = 0; i < n; ++i)
+        pushed += Lua_pushpyobject(lua, argv[i]);
+    if ((status = Lua_pcall(lua, pushed, LUA_MULTRET)))
+    {
+        Lua_seterror(lua, status, PyExc_RuntimeError, "lua error: ");
+        lua_settop(L, oldtop);
+        return NULL;
+    }
+    result = Lua_topython_multiple(lua, lua_gettop(L) - oldtop);
+    lua_settop(L, oldtop);
+    return result;
+}
+
+static PyObject *Lua_callitem(LuaObject *fn, PyObject *item, int spread)
+    // new reference
+    // takes the state lock only for the call itself, so that whatever
+    // Python code produced item is free to use the state too
+{
+    int n, base, status;
+    Py_ssize_t size = 1;
+    PyObject *result;
+    LuaState *lua = fn->lua;
+    lua_State *L = lua->L;
+
+    if (spread && !PyTuple_Check(item))
+    {
+        if ((item = PySequence_Tuple(item)) == NULL)
+            return NULL;
+    }
+    else
+    {
+        Py_INCREF(item);
+    }
+    if (spread)
+        size = PyTuple_GET_SIZE(item);
+
+    Lua_lock(lua);
+    if (size > INT_MAX - LUA_MINSTACK
+            || !lua_checkstack(L, (int)size + LUA_MINSTACK))
+    {
+        Lua_unlock(lua);
+        Py_DECREF(item);
+        PyErr_SetString(PyExc_OverflowError, "too many arguments for Lua");
+        return NULL;
+    }
+    base = lua_gettop(L);
+    lua_pushluaobject(L, fn);
+    if (spread)
+        n = Lua_pushpyobject_tuple(lua, item);
+    else
+        n = Lua_pushpyobject(lua, item);
+    Py_DECREF(item);
 
-/* Utility functions ********************************************************/
+    if ((status = Lua_pcall(lua, n, LUA_MULTRET)))
+    {
+        Lua_seterror(lua, status, PyExc_RuntimeError, "lua error: ");
+        lua_settop(L, base);
+        Lua_unlock(lua);
+        return NULL;
+    }
+    result = Lua_topython_multiple(lua, lua_gettop(L) - base);
+    lua_settop(L, base);
+    Lua_unlock(lua);
+    return result;
+}
 
-static void lua_pushluaobject(lua_State *L, LuaObject *f)
+static int Lua_loadchunk(LuaState *lua, const char *code, size_t len)
     // lua stack [-0, +1]
 {
-    lua_pushlightuserdata(L, f);
-    lua_rawget(L, LUA_REGISTRYINDEX);
-}
+    int status, slot, i;
+    lua_State *L = lua->L;
+    STATS_DECLARE(t)
 
-static PyObject *lua_topyobject(lua_State *L, int index)
-    // new reference
-    // lua stack [-0, +0]
-{
-    PyObject *result;
+    if (lua->chunkcachesize == 0)
+    {
+        STATS_START(t);
+        status = Lua_loadsource(lua, code, len);
+        STATS_STOP(lua, compile, t);
+        return status;
+    }
 
-    result = *(PyObject **)luaL_checkudata(L, index, PYOBJECT);
-    Py_XINCREF(result);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, lua->chunkcache);
+    lua_pushlstring(L, code, len);
+    lua_pushvalue(L, -1);
+    lua_rawget(L, -3);
+    if (lua_isnumber(L, -1))
+    {
+        // cache hit: [cache, code, slot]
+        slot = lua_tointeger(L, -1);
+        lua->chunkused[slot] = ++lua->chunktick;
+        lua_rawgeti(L, -3, 2 * slot);
+        lua_replace(L, -4);
+        lua_pop(L, 2);
+        STATS_INC(lua, cachehits);
+        return 0;
+    }
+    lua_pop(L, 1);
 
-    return result;
+    STATS_START(t);
+    status = Lua_loadsource(lua, code, len);
+    STATS_STOP(lua, compile, t);
+    if (status)
+    {
+        // [cache, code, message]
+        lua_replace(L, -3);
+        lua_pop(L, 1);
+        return status;
+    }
+
+    if (lua->chunkcount < lua->chunkcachesize)
+    {
+        slot = ++lua->chunkcount;
+    }
+    else
+    {
+        // evict the least recently used chunk
+        slot = 1;
+        for (i = 2; i <= lua->chunkcount; ++i)
+            if (lua->chunkused[i] < lua->chunkused[slot])
+                slot = i;
+        lua_rawgeti(L, -3, 2 * slot - 1);
+        lua_pushnil(L);
+        lua_rawset(L, -5);
+    }
+    lua->chunkused[slot] = ++lua->chunktick;
+
+    // [cache, code, function]
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, -4, 2 * slot);
+    lua_pushvalue(L, -2);
+    lua_rawseti(L, -4, 2 * slot - 1);
+    lua_pushvalue(L, -2);
+    lua_pushinteger(L, slot);
+    lua_rawset(L, -5);
+    lua_replace(L, -3);
+    lua_pop(L, 1);
+    return 0;
 }
 
-static PyObject *Lua_toluaobject(LuaState *lua, int index)
-    // new reference
-    // lua stack [-0, +0]
+static int Lua_loadbuffer(LuaState *lua, const char *code, size_t len,
+        const char *name)
+    // lua stack [-0, +1]
 {
-    LuaObject *f;
-    lua_State *L = lua->L;
+    int status;
 
-    if (index < 0)
-        index = lua_gettop(L) + 1 + index;
+    lua->alloc.guarded++;
+    status = luaL_loadbuffer(lua->L, code, len, name);
+    lua->alloc.guarded--;
+    return status;
+}
 
-    Py_INCREF(lua);
-    f = (LuaObject *)LuaObjectType.tp_alloc(&LuaObjectType, 0);
-    f->lua = lua;
+static int Lua_loadsource(LuaState *lua, const char *code, size_t len)
+    // lua stack [-0, +1]
+{
+    char path[FILENAME_MAX];
+    unsigned PY_LONG_LONG hash = 14695981039346656037ULL;
+    size_t i;
+    int n, status;
 
-    lua_pushlightuserdata(L, f);
-    lua_pushvalue(L, index);
-    lua_rawset(L, LUA_REGISTRYINDEX);
+    if (lua->bytecodedir == NULL)
+        return Lua_loadbuffer(lua, code, len, code);
 
-    return (PyObject *)f;
+    // compiled chunks are filed under an FNV-1a hash and the length of
+    // their source, and each file starts with the source itself, which
+    // must match before the bytecode is trusted
+    for (i = 0; i < len; ++i)
+    {
+        hash ^= (unsigned char)code[i];
+        hash *= 1099511628211ULL;
+    }
+    n = PyOS_snprintf(path, sizeof(path), "%s/%08lx%08lx-%lx.luac",
+            lua->bytecodedir, (unsigned long)(hash >> 32),
+            (unsigned long)(hash & 0xffffffffUL), (unsigned long)len);
+    if (n < 0 || n >= (int)sizeof(path))
+        return Lua_loadbuffer(lua, code, len, code);
+
+    if (Lua_loadbytecodefile(lua, path, code, len) == 0)
+        return 0;
+    status = Lua_loadbuffer(lua, code, len, code);
+    if (status == 0)
+        Lua_dumpfile(lua, path, code, len);
+    return status;
 }
 
-static int lua_obj_gc(lua_State *L)
+static int Lua_loadreader(LuaState *lua, LuaReader *r, const char *name)
+    // lua stack [-0, +1]
 {
-    PyObject *o;
+    int status;
 
-    o = *(PyObject **)luaL_checkudata(L, 1, PYOBJECT);
-    Py_XDECREF(o);
+    r->guarded = &lua->alloc.guarded;
+    lua->alloc.guarded++;
+    status = lua_load(lua->L, lua_streamreader, r, name);
+    lua->alloc.guarded--;
+    return status;
+}
 
-    return 0;
+static const char *lua_streamreader(lua_State *L, void *ud, size_t *sz)
+{
+    LuaReader *r = (LuaReader *)ud;
+    const char *p;
+    int guarded;
+
+    if (r->failed)
+        return NULL;
+    if (r->file != NULL)
+    {
+        Py_BEGIN_ALLOW_THREADS
+        *sz = fread(r->buf, 1, sizeof(r->buf), r->file);
+        Py_END_ALLOW_THREADS
+        if (*sz == 0 && ferror(r->file))
+        {
+            PyErr_SetFromErrno(PyExc_IOError);
+            r->failed = 1;
+        }
+        return *sz ? r->buf : NULL;
+    }
+    if (r->read != NULL)
+    {
+        // the previous block may be let go once lua_load asks for more
+        Py_CLEAR(r->block);
+        guarded = *r->guarded;
+        *r->guarded = 0;
+        r->block = PyObject_CallFunction(r->read, "n",
+                (Py_ssize_t)LUA_LOAD_BLOCKSIZE);
+        *r->guarded = guarded;
+        if (r->block != NULL && !PyBytes_Check(r->block))
+        {
+            PyErr_SetString(PyExc_TypeError, "load() needs read() to return"
+                    " strings");
+            Py_CLEAR(r->block);
+        }
+        if (r->block == NULL)
+        {
+            r->failed = 1;
+            return NULL;
+        }
+        *sz = PyBytes_GET_SIZE(r->block);
+        return *sz ? PyBytes_AS_STRING(r->block) : NULL;
+    }
+    p = r->data;
+    *sz = r->len;
+    r->len = 0;
+    return *sz ? p : NULL;
 }
 
-static int lua_obj_call(lua_State *L)
+static int Lua_addmodule(LuaState *lua, PyObject *name, PyObject *code,
+        int frompath)
+    // lua stack [-0, +0]
 {
-    PyObject *o, *args, *ret;
-    LuaState *lua;
-    int nargs, r;
+    char *s;
+    Py_ssize_t len, i;
+    luaL_Buffer buf;
+    lua_State *L = lua->L;
 
-    lua = (LuaState *)lua_touserdata(L, lua_upvalueindex(1));
-    o = *(PyObject **)luaL_checkudata(L, 1, PYOBJECT);
-    if (!PyCallable_Check(o))
+    if (!PyString_Check(name))
     {
-        luaL_error(L, "Python object is not callable");
+        PyErr_SetString(PyExc_TypeError, "module names must be strings");
         return 0;
     }
+    if (PyString_AsStringAndSize(name, &s, &len) < 0)
+        return 0;
 
-    nargs = lua_gettop(L) - 1;
-    args = Lua_topython_tuple(lua, nargs);
-    ret = PyObject_CallObject(o, args);
-    Py_DECREF(args);
-    LogObj("returned", ret);
-    if (PyErr_Occurred())
+    lua_rawgeti(L, LUA_REGISTRYINDEX, lua->bundle);
+    if (frompath)
     {
-        PyErr_Print();
-        return luaL_error(L, "error in the function");
+        // a/b.lua and a/b/init.lua both provide module a.b
+        len -= len > 5 && strcmp(s + len - 5, ".luac") == 0 ? 5 : 4;
+        if (len > 5 && strncmp(s + len - 5, "/init", 5) == 0)
+            len -= 5;
+        luaL_buffinit(L, &buf);
+        for (i = 0; i < len; ++i)
+            luaL_addchar(&buf, s[i] == '/' ? '.' : s[i]);
+        luaL_pushresult(&buf);
     }
-    r = Lua_pushpyobject_tuple(lua, ret);
-    Py_DECREF(ret);
-    return r;
+    else
+    {
+        lua_pushlstring(L, s, len);
+    }
+
+    if (PyBytes_Check(code))
+    {
+        lua_pushlstring(L, PyBytes_AS_STRING(code), PyBytes_GET_SIZE(code));
+    }
+#ifdef PY3
+    else if (PyUnicode_Check(code))
+    {
+        if (PyString_AsStringAndSize(code, &s, &len) < 0)
+        {
+            lua_pop(L, 2);
+            return 0;
+        }
+        lua_pushlstring(L, s, len);
+    }
+#endif
+    else if (!Lua_isbufferobject(code) || !Lua_pushbuffer(lua, code))
+    {
+        lua_pop(L, 2);
+        PyErr_SetString(PyExc_TypeError,
+                "module code must be a string or a buffer");
+        return 0;
+    }
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+    return 1;
 }
 
-static int lua_obj_index(lua_State *L)
+static int Lua_addzipbundle(LuaState *lua, PyObject *o)
 {
-    PyObject *o, *key, *val;
-    LuaState *lua;
+    PyObject *zipfile, *zf, *names, *name, *code;
+    Py_ssize_t i, n, len;
+    char *s;
+    int ok;
 
-    lua = (LuaState *)lua_touserdata(L, lua_upvalueindex(1));
-    o = *(PyObject **)luaL_checkudata(L, 1, PYOBJECT);
-    if (PyDict_Check(o))
+    if (PyObject_HasAttrString(o, "namelist"))
     {
-        return luaL_error(L, "todo: implement dict __index");
+        Py_INCREF(o);
+        zf = o;
     }
     else
     {
-        key = Lua_topython(lua, 2);
-        if (!PyString_Check(key))
-        {
-            Py_DECREF(key);
-            return luaL_error(L, "attribute name isn't a string");
-        }
-        if (PyObject_HasAttr(o, key))
+        if ((zipfile = PyImport_ImportModule("zipfile")) == NULL)
+            return 0;
+        zf = PyObject_CallMethod(zipfile, "ZipFile", "O", o);
+        Py_DECREF(zipfile);
+        if (zf == NULL)
+            return 0;
+    }
+
+    names = PyObject_CallMethod(zf, "namelist", NULL);
+    ok = names != NULL && PyList_Check(names);
+    n = ok ? PyList_GET_SIZE(names) : 0;
+    for (i = 0; ok && i < n; ++i)
+    {
+        name = PyList_GET_ITEM(names, i);
+        if (!PyString_Check(name))
+            continue;
+        if (PyString_AsStringAndSize(name, &s, &len) < 0)
         {
-            val = PyObject_GetAttr(o, key);
-            Lua_pushpyobject(lua, val);
-            Py_DECREF(val);
+            ok = 0;
+            break;
         }
-        else
+        if (!(len > 4 && strcmp(s + len - 4, ".lua") == 0)
+                && !(len > 5 && strcmp(s + len - 5, ".luac") == 0))
+            continue;
+        code = PyObject_CallMethod(zf, "read", "O", name);
+        ok = code != NULL && Lua_addmodule(lua, name, code, 1);
+        Py_XDECREF(code);
+    }
+    if (names != NULL && !PyList_Check(names))
+        PyErr_SetString(PyExc_TypeError, "namelist() must return a list");
+
+    Py_XDECREF(names);
+    if (zf != o)
+    {
+        code = PyObject_CallMethod(zf, "close", NULL);
+        Py_XDECREF(code);
+    }
+    Py_DECREF(zf);
+    return ok && !PyErr_Occurred();
+}
+
+static void Lua_installsearcher(LuaState *lua)
+    // lua stack [-0, +0]
+{
+    int i, n;
+    lua_State *L = lua->L;
+
+    if (lua->bundlesearcher == LUA_NOREF)
+        return;
+    lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED");
+    if (!lua_istable(L, -1))
+    {
+        lua_pop(L, 1);
+        return;
+    }
+    lua_getfield(L, -1, LUA_LOADLIBNAME);
+    if (!lua_istable(L, -1))
+    {
+        lua_pop(L, 2);
+        return;
+    }
+    lua_getfield(L, -1, "loaders");
+    if (!lua_istable(L, -1))
+    {
+        lua_pop(L, 3);
+        return;
+    }
+
+    // go second, right after package.preload
+    lua_rawgeti(L, LUA_REGISTRYINDEX, lua->bundlesearcher);
+    n = lua_objlen(L, -2);
+    for (i = 1; i <= n; ++i)
+    {
+        lua_rawgeti(L, -2, i);
+        if (lua_rawequal(L, -1, -2))
         {
-            lua_pushnil(L);
+            lua_pop(L, 5);
+            return;
         }
-        Py_DECREF(key);
+        lua_pop(L, 1);
+    }
+    for (i = n; i >= 2; --i)
+    {
+        lua_rawgeti(L, -2, i);
+        lua_rawseti(L, -3, i + 1);
+    }
+    lua_rawseti(L, -2, n >= 1 ? 2 : 1);
+    lua_pop(L, 3);
+}
+
+static int lua_bundle_searcher(lua_State *L)
+{
+    const char *name = luaL_checkstring(L, 1);
+    const char *code;
+    size_t len;
+    LuaPyBuffer *b = NULL;
+    LuaState *lua = lua_getstate(L);
+    PyThreadState *tstate = NULL;
+    int status;
+
+    lua_getfield(L, lua_upvalueindex(1), name);
+    if (lua_isnil(L, -1))
+    {
+        lua_pushfstring(L, "\n\tno module '%s' in bundle", name);
         return 1;
     }
+    if (lua_type(L, -1) == LUA_TSTRING)
+    {
+        code = lua_tolstring(L, -1, &len);
+    }
+    else
+    {
+        b = lua_tobuffer(L, -1);
+        tstate = lua_buf_enter(L, lua, b);
+        code = b->data;
+        len = b->len;
+    }
+
+    lua_pushfstring(L, "@%s", name);
+    status = luaL_loadbuffer(L, code, len, lua_tostring(L, -1));
+    if (b != NULL)
+        lua_buf_leave(lua, b, tstate);
+    if (status != 0)
+        return luaL_error(L, "error loading module '%s' from bundle:\n\t%s",
+                name, lua_tostring(L, -1));
+    return 1;
+}
+
+static int Lua_loadbytecodefile(LuaState *lua, const char *path,
+        const char *code, size_t len)
+    // lua stack [-0, +1] on success, [-0, +0] otherwise
+{
+    FILE *f;
+    char *data;
+    long size;
+    int ok;
+
+    if ((f = fopen(path, "rb")) == NULL)
+        return -1;
+    if (fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < 0
+            || fseek(f, 0, SEEK_SET) != 0
+            || (data = PyMem_Malloc(size + 1)) == NULL)
+    {
+        fclose(f);
+        return -1;
+    }
+    ok = fread(data, 1, size, f) == (size_t)size
+        && (size_t)size >= len + sizeof(LUA_SIGNATURE) - 1
+        && memcmp(data, code, len) == 0
+        && memcmp(data + len, LUA_SIGNATURE, sizeof(LUA_SIGNATURE) - 1) == 0;
+    fclose(f);
+
+    // a stale, damaged or colliding file is simply compiled over
+    if (ok && Lua_loadbuffer(lua, data + len, size - len, "=bytecode") != 0)
+    {
+        lua_pop(lua->L, 1);
+        ok = 0;
+    }
+    PyMem_Free(data);
+    return ok ? 0 : -1;
+}
+
+static void Lua_dumpfile(LuaState *lua, const char *path, const char *code,
+        size_t len)
+    // lua stack [-0, +0], dumps the function on top after its source
+{
+    char tmp[FILENAME_MAX];
+    FILE *f;
+    int n, status;
+
+    // write to a private name first so other processes sharing the
+    // directory never see a partial file
+    n = PyOS_snprintf(tmp, sizeof(tmp), "%s.%lx.%lx.tmp", path,
+            (unsigned long)getpid(),
+            (unsigned long)PyThread_get_thread_ident());
+    if (n < 0 || n >= (int)sizeof(tmp) || (f = fopen(tmp, "wb")) == NULL)
+        return;
+    status = fwrite(code, 1, len, f) != len
+        || lua_dump(lua->L, lua_filewriter, f);
+    if (fclose(f) != 0 || status != 0 || rename(tmp, path) != 0)
+        remove(tmp);
+}
+
+static int lua_dumpwriter(lua_State *L, const void *p, size_t sz, void *ud)
+{
+    LuaDump *d = (LuaDump *)ud;
+    size_t size;
+    char *data;
+
+    if (d->len + sz > d->size)
+    {
+        size = d->size ? d->size : 256;
+        while (size < d->len + sz)
+            size *= 2;
+        if ((data = PyMem_Realloc(d->data, size)) == NULL)
+            return 1;
+        d->data = data;
+        d->size = size;
+    }
+    memcpy(d->data + d->len, p, sz);
+    d->len += sz;
+    return 0;
+}
+
+static int lua_filewriter(lua_State *L, const void *p, size_t sz, void *ud)
+{
+    return fwrite(p, 1, sz, (FILE *)ud) != sz;
+}
+
+static void Lua_seterror(LuaState *lua, int status, PyObject *exc,
+        const char *prefix)
+    // lua stack [-1, +0]
+{
+    if (status == LUA_ERRMEM)
+        exc = PyExc_MemoryError;
+    else if (lua->expired && lua->limit.slice == NULL)
+        exc = LuaLimitError;
+    lua_pushstring(lua->L, prefix);
+    lua_insert(lua->L, -2);
+    lua_concat(lua->L, 2);
+    PyErr_SetString(exc, lua_tostring(lua->L, -1));
+    lua_pop(lua->L, 1);
+}
+
+static void Lua_lock(LuaState *lua)
+{
+    long me = PyThread_get_thread_ident();
+
+    if (lua->lockowner == me)
+    {
+        lua->lockdepth++;
+        return;
+    }
+    if (!PyThread_acquire_lock(lua->lock, NOWAIT_LOCK))
+    {
+        Py_BEGIN_ALLOW_THREADS
+        PyThread_acquire_lock(lua->lock, WAIT_LOCK);
+        Py_END_ALLOW_THREADS
+    }
+    lua->lockowner = me;
+    lua->lockdepth = 1;
+}
+
+static void Lua_unlock(LuaState *lua)
+{
+    if (--lua->lockdepth == 0)
+    {
+        lua->lockowner = 0;
+        PyThread_release_lock(lua->lock);
+    }
+}
+
+static int Lua_pcall(LuaState *lua, int nargs, int nresults)
+    // lua stack [-(nargs+1), +(nresults|1)]
+{
+    int status, guarded = lua->alloc.guarded;
+    int suspended = lua->alloc.suspended;
+
+    lua->alloc.guarded++;
+    lua->tstate = PyEval_SaveThread();
+    status = lua_pcall(lua->L, nargs, nresults, 0);
+    // an error raised from a callback unwinds with the GIL still held
+    if (lua->tstate != NULL)
+    {
+        PyEval_RestoreThread(lua->tstate);
+        lua->tstate = NULL;
+    }
+    // set back rather than decremented, and for callbacks further out
+    lua->alloc.guarded = guarded;
+    lua->alloc.suspended = suspended;
+    return status;
+}
+
+static PyThreadState *Lua_enterpython(LuaState *lua)
+{
+    PyThreadState *tstate = lua->tstate;
+
+    if (tstate != NULL)
+    {
+        lua->tstate = NULL;
+        PyEval_RestoreThread(tstate);
+        // Lua API calls made from Python are not protected, so they must
+        // not see the memory limit
+        lua->alloc.suspended = lua->alloc.guarded;
+        lua->alloc.guarded = 0;
+    }
+    if (lua->profiling && lua->pydepth++ == 0)
+    {
+        lua->pycalls++;
+        lua->pystart = Lua_clock();
+    }
+    return tstate;
+}
+
+static void Lua_leavepython(LuaState *lua, PyThreadState *tstate)
+{
+    if (lua->pydepth > 0 && --lua->pydepth == 0)
+        lua->pytime += Lua_clock() - lua->pystart;
+    if (tstate != NULL)
+    {
+        lua->alloc.guarded = lua->alloc.suspended;
+        lua->tstate = PyEval_SaveThread();
+    }
+}
+
+static unsigned PY_LONG_LONG Lua_nanotime(void)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#else
+    return (unsigned PY_LONG_LONG)clock() * (1000000000ULL / CLOCKS_PER_SEC);
+#endif
+}
+
+static int Lua_pytypestat(PyObject *o)
+{
+    if (o == NULL)
+        return LUA_STAT_OTHER;
+    if (o == Py_None)
+        return LUA_STAT_NONE;
+    if (PyBool_Check(o))
+        return LUA_STAT_BOOL;
+    if (PyInt_Check(o) || PyLong_Check(o))
+        return LUA_STAT_INT;
+    if (PyFloat_Check(o))
+        return LUA_STAT_FLOAT;
+    if (PyString_Check(o))
+        return LUA_STAT_STR;
+    if (PyUnicode_Check(o))
+        return LUA_STAT_UNICODE;
+    if (PyObject_TypeCheck(o, &LuaObjectType))
+        return LUA_STAT_LUAOBJECT;
+    if (Lua_isbufferobject(o))
+        return LUA_STAT_BUFFER;
+    return LUA_STAT_OTHER;
+}
+
+static PyObject *Lua_counter(LuaCounter *c)
+    // new reference
+{
+    return Py_BuildValue("(kK)", c->count, c->ns);
+}
+
+static double Lua_clock(void)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
 }
 
-static int lua_obj_newindex(lua_State *L)
+static void lua_profile_sample(lua_State *L, int lines)
+    // lua stack [-0, +0]
 {
-    PyObject *o, *key, *val;
-    LuaState *lua;
-    int ret;
+    lua_Debug ar;
+    luaL_Buffer b;
+    const char *name;
+    int depth, level;
 
-    lua = (LuaState *)lua_touserdata(L, lua_upvalueindex(1));
-    o = *(PyObject **)luaL_checkudata(L, 1, PYOBJECT);
-    if (PyDict_Check(o))
+    lua_pushlightuserdata(L, &lua_profilekey);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    if (!lua_istable(L, -1))
     {
-        return luaL_error(L, "todo: implement dict __index");
+        // a coroutine still hooked after profile_stop()
+        lua_pop(L, 1);
+        return;
     }
-    else
+
+    for (depth = 0; lua_getstack(L, depth, &ar); ++depth)
+        ;
+    luaL_buffinit(L, &b);
+    for (level = depth - 1; level >= 0; --level)
     {
-        key = Lua_topython(lua, 2);
-        if (!PyString_Check(key))
-        {
-            Py_DECREF(key);
-            return luaL_error(L, "attribute name isn't a string");
-        }
-        val = Lua_topython(lua, 3);
-        ret = PyObject_SetAttr(o, key, val);
-        Py_DECREF(key);
-        Py_DECREF(val);
-        if (ret == -1)
-            return luaL_error(L, "failed to set attribute");
-        return 0;
+        lua_getstack(L, level, &ar);
+        lua_getinfo(L, "Snl", &ar);
+        name = ar.name ? ar.name : *ar.what == 'm' ? "main" : "?";
+        if (*ar.what == 'C')
+            lua_pushfstring(L, "%s@[C]", name);
+        else
+            lua_pushfstring(L, "%s@%s:%d", name, ar.short_src,
+                    lines && level == 0 ? ar.currentline : ar.linedefined);
+        luaL_addvalue(&b);
+        if (level > 0)
+            luaL_addchar(&b, ';');
     }
+    luaL_pushresult(&b);
+
+    lua_pushvalue(L, -1);
+    lua_rawget(L, -3);
+    lua_pushinteger(L, lua_tointeger(L, -1) + 1);
+    lua_replace(L, -2);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
 }
 
-void Lua_settable_cfunction(LuaState *lua, int index, const char *name,
-        lua_CFunction fn)
-    // lua stack [-0, +0]
+static int Lua_parselimit(PyObject *kwds, long *budget, double *timeout)
 {
-    lua_pushstring(lua->L, name);
-    lua_pushlightuserdata(lua->L, lua);
-    lua_pushcclosure(lua->L, fn, 1);
-    if (index < 0)
-        index -= 2;
-    lua_rawset(lua->L, index);
+    PyObject *key, *value;
+    Py_ssize_t pos = 0;
+
+    *budget = 0;
+    *timeout = 0;
+    while (kwds != NULL && PyDict_Next(kwds, &pos, &key, &value))
+    {
+        if (!Lua_parselimitarg(key, value, budget, timeout))
+            return 0;
+    }
+    return 1;
 }
 
-static int Lua_pushpyobject_tuple(LuaState *lua, PyObject *o)
-    // lua stack [-0, +n]
+static int Lua_parselimitkw(PyObject *const *values, PyObject *kwnames,
+        long *budget, double *timeout)
 {
-    if (PyTuple_Check(o))
+    Py_ssize_t i, n = kwnames != NULL ? PyTuple_GET_SIZE(kwnames) : 0;
+
+    *budget = 0;
+    *timeout = 0;
+    for (i = 0; i < n; ++i)
     {
-        int size = PyTuple_Size(o), i, n = 0;
-        for (i = 0; i < size; ++i)
-            n += Lua_pushpyobject(lua, PyTuple_GetItem(o, i));
-        return n;
+        if (!Lua_parselimitarg(PyTuple_GET_ITEM(kwnames, i), values[i],
+                    budget, timeout))
+            return 0;
     }
-    return Lua_pushpyobject(lua, o);
+    return 1;
 }
 
-static int Lua_pushpyobject(LuaState *lua, PyObject *o)
-    // lua stack [-0, +1]
+static int Lua_parselimitarg(PyObject *key, PyObject *value, long *budget,
+        double *timeout)
 {
-    PyObject **userdata;
-    lua_State *L = lua->L;
+    const char *name;
+    PyObject *repr;
 
-    if (o == NULL)
+    name = PyString_Check(key) ? PyString_AS_STRING(key) : "";
+    if (strcmp(name, "max_instructions") == 0)
+        *budget = PyInt_AsLong(value);
+    else if (strcmp(name, "timeout") == 0)
+        *timeout = PyFloat_AsDouble(value);
+    else
     {
-        Log("attempted to push null object\n");
+        if ((repr = PyObject_Repr(key)) != NULL)
+        {
+            PyErr_Format(PyExc_TypeError, "unexpected keyword argument %s",
+                    PyString_AsString(repr));
+            Py_DECREF(repr);
+        }
         return 0;
     }
-    if (o == Py_None)
+    if (PyErr_Occurred())
+        return 0;
+    if (*budget < 0 || *timeout < 0)
     {
-        lua_pushnil(L);
-        return 1;
+        PyErr_SetString(PyExc_ValueError,
+                "max_instructions and timeout must not be negative");
+        return 0;
     }
-    if (PyBool_Check(o))
+    return 1;
+}
+
+#ifdef LUA_FASTCALL
+static int Lua_fastcode(const char *func, PyObject *const *args,
+        Py_ssize_t nargs, const char **code, Py_ssize_t *len)
+{
+    if (nargs != 1)
     {
-        lua_pushboolean(L, o == Py_True);
-        return 1;
+        PyErr_Format(PyExc_TypeError, "%s() takes exactly 1 argument (%zd"
+                " given)", func, nargs);
+        return 0;
     }
-    if (PyInt_Check(o))
+    if (PyBytes_Check(args[0]))
     {
-        lua_pushinteger(L, PyInt_AsLong(o));
+        *code = PyBytes_AS_STRING(args[0]);
+        *len = PyBytes_GET_SIZE(args[0]);
         return 1;
     }
-    if (PyLong_Check(o))
+    if (PyUnicode_Check(args[0]))
     {
-        lua_pushinteger(L, PyLong_AsLong(o));
-        return 1;
+        *code = PyUnicode_AsUTF8AndSize(args[0], len);
+        return *code != NULL;
     }
-    if (PyFloat_Check(o))
+    PyErr_Format(PyExc_TypeError, "%s() argument must be str or bytes, not"
+            " %.200s", func, Py_TYPE(args[0])->tp_name);
+    return 0;
+}
+#endif
+
+static void Lua_setlimit(LuaState *lua, LuaLimit *saved, long budget,
+        double timeout, lua_State *slice)
+{
+    *saved = lua->limit;
+    lua->limit.budget = budget > 0 ? budget : -1;
+    lua->limit.deadline = timeout > 0 ? Lua_clock() + timeout : 0;
+    lua->limit.slice = slice;
+    lua->expired = LUA_LIMIT_NONE;
+    Lua_updatehook(lua, lua->L);
+}
+
+static void Lua_restorelimit(LuaState *lua, LuaLimit *saved)
+{
+    lua->limit = *saved;
+    lua->expired = LUA_LIMIT_NONE;
+    Lua_updatehook(lua, lua->L);
+}
+
+static void Lua_updatehook(LuaState *lua, lua_State *L)
+{
+    long period = 0, step;
+
+    if (lua->profiling)
+        period = lua->profileinterval;
+    if (lua->limit.budget >= 0 || lua->limit.deadline > 0)
     {
-        lua_pushnumber(L, PyFloat_AsDouble(o));
-        return 1;
+        step = LUA_LIMIT_STEP;
+        if (lua->limit.budget > 0 && lua->limit.budget < step)
+            step = lua->limit.budget;
+        if (period == 0 || step < period)
+            period = step;
     }
-    if (PyString_Check(o))
+    // once out of time, stop at the next instruction, even after a pcall
+    // in the script caught the first error
+    if (lua->expired && lua->limit.slice == NULL)
+        period = 1;
+
+    lua->hookperiod = period;
+    if (period)
+        lua_sethook(L, lua_hook, LUA_MASKCOUNT, period);
+    else
+        lua_sethook(L, NULL, 0, 0);
+}
+
+static LuaState *lua_getstate(lua_State *L)
+    // the LuaState owning L
+    // lua stack [-0, +0]
+{
+    LuaState *lua;
+
+    lua_pushlightuserdata(L, &lua_statekey);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua = (LuaState *)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    return lua;
+}
+
+static void lua_hook(lua_State *L, lua_Debug *ar)
+{
+    LuaState *lua = lua_getstate(L);
+    int period;
+
+    period = lua->hookperiod;
+
+    if (lua->profiling && (lua->profileleft -= period) <= 0)
     {
-        char *buf;
-        ssize_t len;
-        PyString_AsStringAndSize(o, &buf, &len);
-        lua_pushlstring(L, buf, len);
-        return 1;
+        lua->profileleft += lua->profileinterval;
+        lua_profile_sample(L, lua->profilelines);
     }
-    if (PyType_IsSubtype(o->ob_type, &LuaObjectType))
+
+    if (!lua->expired)
     {
-        lua_pushluaobject(L, (LuaObject *)o);
-        return 1;
+        if (lua->limit.budget > 0 && (lua->limit.budget -= period) <= 0)
+            lua->expired = LUA_LIMIT_INSTRUCTIONS;
+        else if (lua->limit.deadline > 0
+                && Lua_clock() >= lua->limit.deadline)
+            lua->expired = LUA_LIMIT_TIMEOUT;
+        else
+        {
+            if (lua->limit.budget > 0 && lua->limit.budget < period)
+                Lua_updatehook(lua, L);
+            return;
+        }
     }
 
-    userdata = lua_newuserdata(L, sizeof(PyObject *));
-    Py_INCREF(o);
-    *userdata = o;
-    luaL_newmetatable(L, PYOBJECT);
-    Lua_settable_cfunction(lua, -1, "__gc", lua_obj_gc);
-    Lua_settable_cfunction(lua, -1, "__call", lua_obj_call);
-    Lua_settable_cfunction(lua, -1, "__index", lua_obj_index);
-    Lua_settable_cfunction(lua, -1, "__newindex", lua_obj_newindex);
-    lua_setmetatable(L, -2);
-    return 1;
+    if (lua->limit.slice != NULL)
+    {
+        // end the time slice as soon as the task's coroutine can yield
+        if (L == lua->limit.slice && lua_canyield(L))
+            lua_yield(L, 0);
+        return;
+    }
+    if (lua->hookperiod != 1)
+        Lua_updatehook(lua, L);
+    luaL_error(L, lua->expired == LUA_LIMIT_TIMEOUT ? "timeout exceeded"
+            : "instruction limit exceeded");
 }
 
-static PyObject *Lua_topython(LuaState *lua, int index)
-    // new reference
-    // lua stack [-0, +0]
+static int lua_canyield(lua_State *L)
 {
-    size_t len;
-    const char *str;
-    lua_State *L = lua->L;
-    PyObject *result;
+    lua_Debug ar;
+    int level;
 
-    switch (lua_type(L, index))
+    // a hook may only yield while no C function is on the stack
+    for (level = 0; lua_getstack(L, level, &ar); ++level)
     {
-        case LUA_TNONE:
-            return NULL;
-        case LUA_TNIL:
-            Py_RETURN_NONE;
-        case LUA_TNUMBER:
-            return Py_BuildValue("d", lua_tonumber(L, index));
-        case LUA_TBOOLEAN:
-            if (lua_toboolean(L, index))
-                Py_RETURN_TRUE;
-            else
-                Py_RETURN_FALSE;
-        case LUA_TSTRING:
-            str = lua_tolstring(L, index, &len);
-            return Py_BuildValue("s#", str, len);
-        case LUA_TTHREAD:
-            return Py_BuildValue("s", "lua thread");
-        case LUA_TUSERDATA:
-            result = lua_topyobject(L, index);
-            if (result != NULL)
-                return result;
-        case LUA_TLIGHTUSERDATA:
-        case LUA_TFUNCTION:
-        case LUA_TTABLE:
-            return Lua_toluaobject(lua, index);
+        lua_getinfo(L, "S", &ar);
+        if (*ar.what == 'C')
+            return 0;
     }
-    return NULL;
+    return 1;
 }
 
-static PyObject *Lua_topython_tuple(LuaState *lua, int n)
-    // new reference
-    // lua stack [-0, +0]
+static int Lua_resume(LuaState *lua, lua_State *co, int nargs)
 {
-    PyObject *result;
-    int i;
+    int status, guarded = lua->alloc.guarded;
+    int suspended = lua->alloc.suspended;
 
-    result = PyTuple_New(n);
-    for (i = 0; i < n; ++i)
-        PyTuple_SET_ITEM(result, i, Lua_topython(lua, i - n));
-    return result;
+    Lua_updatehook(lua, co);
+    lua->alloc.guarded++;
+    lua->tstate = PyEval_SaveThread();
+    status = lua_resume(co, nargs);
+    if (lua->tstate != NULL)
+    {
+        PyEval_RestoreThread(lua->tstate);
+        lua->tstate = NULL;
+    }
+    lua->alloc.guarded = guarded;
+    lua->alloc.suspended = suspended;
+    return status;
 }
 
-static PyObject *Lua_topython_multiple(LuaState *lua, int n)
-    // new reference
+static PyObject *Lua_resumecoroutine(LuaObject *self, PyObject *args)
+    // new reference, or NULL with StopIteration once the coroutine is done
     // lua stack [-0, +0]
 {
-    if (n == 0)
-        Py_RETURN_NONE;
-    else if (n == 1)
-        return Lua_topython(lua, -1);
+    LuaState *lua = self->lua;
+    lua_State *co, *L = lua->L;
+    lua_Debug ar;
+    int base, n = 0, status;
+    Py_ssize_t size = 0;
+    PyObject *result = NULL, *stop;
+
+    Lua_lock(lua);
+    base = lua_gettop(L);
+    lua_pushluaobject(L, self);
+    co = lua_tothread(L, -1);
+
+    status = lua_status(co);
+    if ((status != 0 && status != LUA_YIELD) || (status == 0
+                && !lua_getstack(co, 0, &ar) && lua_gettop(co) == 0))
+    {
+        lua_settop(L, base);
+        Lua_unlock(lua);
+        PyErr_SetNone(PyExc_StopIteration);
+        return NULL;
+    }
+
+    if (args != NULL)
+        size = PyTuple_GET_SIZE(args);
+    if (size > INT_MAX - LUA_MINSTACK
+            || !lua_checkstack(L, (int)size + LUA_MINSTACK)
+            || !lua_checkstack(co, (int)size + LUA_MINSTACK))
+    {
+        lua_settop(L, base);
+        Lua_unlock(lua);
+        PyErr_SetString(PyExc_OverflowError, "too many arguments for Lua");
+        return NULL;
+    }
+    if (args != NULL)
+        n = Lua_pushpyobject_tuple(lua, args);
+    lua_xmove(L, co, n);
+    status = Lua_resume(lua, co, n);
+    if ((status == 0 || status == LUA_YIELD)
+            && !lua_checkstack(L, lua_gettop(co) + LUA_MINSTACK))
+    {
+        // the values are dropped, as a resume that fails in Lua drops them
+        lua_settop(co, 0);
+        lua_settop(L, base);
+        Lua_unlock(lua);
+        PyErr_SetString(PyExc_OverflowError,
+                "too many results from the coroutine");
+        return NULL;
+    }
+    if (status == 0 || status == LUA_YIELD)
+    {
+        n = lua_gettop(co);
+        lua_xmove(co, L, n);
+        result = Lua_topython_multiple(lua, n);
+    }
     else
-        return Lua_topython_tuple(lua, n);
+    {
+        lua_xmove(co, L, 1);
+        Lua_seterror(lua, status, PyExc_RuntimeError, "lua error: ");
+    }
+    lua_settop(L, base);
+    Lua_unlock(lua);
+
+    // like a generator, a finished coroutine raises StopIteration carrying
+    // its return value
+    if (status == 0 && result != NULL)
+    {
+        stop = PyTuple_Pack(1, result);
+        Py_DECREF(result);
+        result = NULL;
+        if (stop != NULL)
+        {
+            PyErr_SetObject(PyExc_StopIteration, stop);
+            Py_DECREF(stop);
+        }
+    }
+    return result;
 }
 
 static int lua_iscallable(lua_State *L, int index)
@@ -690,6 +6916,56 @@ static int lua_iscallable(lua_State *L, int index)
     return ret;
 }
 
+static int lua_issequence(lua_State *L, int index)
+    // lua stack [-0, +0]
+{
+    size_t n, count = 0;
+    lua_Number k;
+
+    if (index < 0)
+        index = lua_gettop(L) + 1 + index;
+    n = lua_objlen(L, index);
+    if (n == 0)
+        return 0;
+
+    // a sequence has exactly the keys 1..n
+    lua_pushnil(L);
+    while (lua_next(L, index))
+    {
+        lua_pop(L, 1);
+        if (lua_type(L, -1) != LUA_TNUMBER)
+        {
+            lua_pop(L, 1);
+            return 0;
+        }
+        k = lua_tonumber(L, -1);
+        if (k != (size_t)k || k < 1 || k > n)
+        {
+            lua_pop(L, 1);
+            return 0;
+        }
+        count++;
+    }
+    return count == n;
+}
+
+static int lua_nextbatch(lua_State *L)
+    // (table, key, n) -> up to n key/value pairs following key
+{
+    int n, i;
+
+    n = lua_tointeger(L, 3);
+    lua_settop(L, 2);
+    luaL_checkstack(L, 2 * n + 1, "too many table entries");
+    for (i = 0; i < n; ++i)
+    {
+        lua_pushvalue(L, -2 + (i == 0));
+        if (!lua_next(L, 1))
+            break;
+    }
+    return lua_gettop(L) - 2;
+}
+
 static int lua_isindexable(lua_State *L, int index)
     // lua stack [-0, +0]
 {
@@ -710,23 +6986,108 @@ static PyMethodDef lua_methods[] = {
     {NULL}
 };
 
+#ifdef PY3
+static struct PyModuleDef lua_module = {
+    PyModuleDef_HEAD_INIT,
+    "lua",                      /*m_name*/
+    "Lua bindings.",            /*m_doc*/
+    -1,                         /*m_size*/
+    lua_methods,                /*m_methods*/
+};
+#endif
+
 #ifndef PyMODINIT_FUNC
 #define PyMODINIT_FUNC void
 #endif
 
-PyMODINIT_FUNC initlua()
+static PyObject *Lua_initmodule(void)
+    // new reference
 {
     PyObject *m;
 
+#if PY_VERSION_HEX < 0x03070000
+    PyEval_InitThreads();
+#endif
+#ifdef LUA_FASTCALL
+    LuaObjectType.tp_vectorcall_offset = offsetof(LuaObject, vectorcall);
+    LuaObjectType.tp_flags |= Py_TPFLAGS_HAVE_VECTORCALL;
+#endif
+
     if (PyType_Ready(&LuaStateType) < 0)
-        return;
+        return NULL;
     if (PyType_Ready(&LuaObjectType) < 0)
-        return;
+        return NULL;
+    if (PyType_Ready(&LuaStatePoolType) < 0)
+        return NULL;
+    if (PyType_Ready(&LuaBufferType) < 0)
+        return NULL;
+    if (PyType_Ready(&LuaChannelType) < 0)
+        return NULL;
+    if (PyType_Ready(&LuaIterType) < 0)
+        return NULL;
+    if (PyType_Ready(&LuaCallIterType) < 0)
+        return NULL;
+    if (PyType_Ready(&LuaTaskType) < 0)
+        return NULL;
+    if (PyType_Ready(&LuaCoroutineType) < 0)
+        return NULL;
+#ifdef PY3
+    if (PyType_Ready(&LuaAwaitType) < 0)
+        return NULL;
+#endif
 
+    m = PyImport_ImportModule("mmap");
+    if (m != NULL)
+    {
+        mmap_type = PyObject_GetAttrString(m, "mmap");
+        Py_DECREF(m);
+    }
+    m = PyImport_ImportModule("array");
+    if (m != NULL)
+    {
+        array_type = PyObject_GetAttrString(m, "array");
+        Py_DECREF(m);
+    }
+    PyErr_Clear();
+    methoddescr_type = Py_TYPE(PyDict_GetItemString(PyString_Type.tp_dict,
+                "join"));
+
+#ifdef PY3
+    m = PyModule_Create(&lua_module);
+#else
     m = Py_InitModule3("lua", lua_methods, "Lua bindings.");
+#endif
+    if (m == NULL)
+        return NULL;
 
     Py_INCREF(&LuaStateType);
     Py_INCREF(&LuaObjectType);
+    Py_INCREF(&LuaStatePoolType);
+    Py_INCREF(&LuaBufferType);
+    Py_INCREF(&LuaCoroutineType);
+    Py_INCREF(&LuaChannelType);
     PyModule_AddObject(m, "LuaState", (PyObject *)&LuaStateType);
     PyModule_AddObject(m, "LuaObject", (PyObject *)&LuaObjectType);
+    PyModule_AddObject(m, "LuaStatePool", (PyObject *)&LuaStatePoolType);
+    PyModule_AddObject(m, "LuaBuffer", (PyObject *)&LuaBufferType);
+    PyModule_AddObject(m, "LuaCoroutine", (PyObject *)&LuaCoroutineType);
+    PyModule_AddObject(m, "Channel", (PyObject *)&LuaChannelType);
+
+    LuaLimitError = PyErr_NewException("lua.LuaLimitError",
+            PyExc_RuntimeError, NULL);
+    Py_XINCREF(LuaLimitError);
+    PyModule_AddObject(m, "LuaLimitError", LuaLimitError);
+    return m;
+}
+
+#ifdef PY3
+PyMODINIT_FUNC PyInit_lua(void)
+{
+    return Lua_initmodule();
 }
+#else
+PyMODINIT_FUNC initlua(void)
+{
+    Lua_initmodule();
+}
+#endif
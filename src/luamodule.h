@@ -1,9 +1,78 @@
 #ifndef _LUAMODULE_H
 #define _LUAMODULE_H
 
+#define PY_SSIZE_T_CLEAN
 #include <Python.h>
+#include <pythread.h>
 #include <lua.h>
 
+/* Python 3 *****************************************************************/
+
+/* The module is written against the Python 2 API.  Under Python 3, names,
+ * keys and messages map onto str, while Lua string values are bytes and go
+ * through PyBytes_* directly, which Python 2 also provides. */
+#if PY_MAJOR_VERSION >= 3
+#define PY3
+
+#define PyInt_Type PyLong_Type
+#define PyInt_Check PyLong_Check
+#define PyInt_FromLong PyLong_FromLong
+#define PyInt_FromSsize_t PyLong_FromSsize_t
+/* like Python 2's PyInt_AsLong, truncate floats instead of refusing them */
+#define PyInt_AsLong(o) (PyFloat_Check(o) ? (long)PyFloat_AS_DOUBLE(o) \
+        : PyLong_AsLong(o))
+#define PyInt_AS_LONG PyLong_AsLong
+
+#define PyString_Type PyUnicode_Type
+#define PyString_Check PyUnicode_Check
+#define PyString_FromString PyUnicode_FromString
+#define PyString_FromStringAndSize PyUnicode_FromStringAndSize
+#define PyString_FromFormat PyUnicode_FromFormat
+#define PyString_AsString PyUnicode_AsUTF8
+#define PyString_AS_STRING PyUnicode_AsUTF8
+#define PyString_AsStringAndSize(o, s, len) \
+    ((*(s) = (char *)PyUnicode_AsUTF8AndSize((o), (len))) == NULL ? -1 : 0)
+#define PyString_InternInPlace PyUnicode_InternInPlace
+#define PyString_ConcatAndDel PyUnicode_AppendAndDel
+
+#define Py_TPFLAGS_STRING_SUBCLASS Py_TPFLAGS_BYTES_SUBCLASS
+#define Py_TPFLAGS_HAVE_NEWBUFFER 0
+#define Lua_hasnewbuffer(type) ((type)->tp_as_buffer != NULL \
+        && (type)->tp_as_buffer->bf_getbuffer != NULL)
+/* the storage behind a dict, which is replaced whenever it is resized */
+#define Lua_dictstorage(o) ((void *)((PyDictObject *)(o))->ma_keys)
+
+/* Calls from Python take their arguments straight off the caller's stack:
+ * LuaObject implements vectorcall and the busiest methods use fastcall. */
+#if PY_VERSION_HEX >= 0x03080000
+#define LUA_FASTCALL
+#ifndef Py_TPFLAGS_HAVE_VECTORCALL
+#define Py_TPFLAGS_HAVE_VECTORCALL _Py_TPFLAGS_HAVE_VECTORCALL
+#endif
+#endif
+#else
+#define Lua_hasnewbuffer(type) \
+    (PyType_HasFeature((type), Py_TPFLAGS_HAVE_NEWBUFFER) \
+        && (type)->tp_as_buffer != NULL \
+        && (type)->tp_as_buffer->bf_getbuffer != NULL)
+#define Lua_dictstorage(o) ((void *)((PyDictObject *)(o))->ma_table)
+#endif
+
+/* Methods declared with these take either a vector of arguments or a tuple,
+ * depending on whether fastcall is available. */
+#ifdef LUA_FASTCALL
+#define LUA_METH_FASTCALL METH_FASTCALL
+#define LUA_METH_FASTCALL_KW (METH_FASTCALL | METH_KEYWORDS)
+#define LUA_FASTARGS PyObject *const *args, Py_ssize_t nargs
+#define LUA_FASTARGS_KW PyObject *const *args, Py_ssize_t nargs, \
+    PyObject *kwnames
+#else
+#define LUA_METH_FASTCALL METH_VARARGS
+#define LUA_METH_FASTCALL_KW (METH_VARARGS | METH_KEYWORDS)
+#define LUA_FASTARGS PyObject *args
+#define LUA_FASTARGS_KW PyObject *args, PyObject *kwds
+#endif
+
 /* Debug functions **********************************************************/
 
 void Log(const char *format, ...);
@@ -12,42 +81,607 @@ void LogLuaTop(const char *str, lua_State *L);
 
 /* Type structs *************************************************************/
 
+/* Objects of up to LUA_POOL_MAXSIZE bytes are carved out of blocks shared
+ * by all size classes and recycled through per-class free lists.  Blocks go
+ * back to the system only when the state is closed. */
+#define LUA_POOL_GRAIN 8
+#define LUA_POOL_MAXSIZE 256
+#define LUA_POOL_CLASSES (LUA_POOL_MAXSIZE / LUA_POOL_GRAIN)
+#define LUA_POOL_BLOCKSIZE 16384
+
+typedef union LuaPoolBlock
+{
+    union LuaPoolBlock *next;
+    double align;
+} LuaPoolBlock;
+
+typedef struct
+{
+    int pooled;                 /* use the size-class pools */
+    size_t limit;               /* maximum live bytes, or 0 */
+    int guarded;                /* > 0 while running protected Lua code */
+    int suspended;              /* guarded as it was when Lua last called
+                                   into Python, which runs unguarded */
+    size_t live, peak;
+    unsigned long allocs, frees;
+
+    void *freelist[LUA_POOL_CLASSES];
+    LuaPoolBlock *blocks;
+    char *bump, *bumpend;
+} LuaAlloc;
+
+#define LUA_CHUNKCACHE_SIZE 64
+
+/* Attribute names looked up from Lua are converted once and kept, up to
+ * LUA_KEYCACHE_SIZE of them. */
+#define LUA_KEYCACHE_SIZE 1024
+
+/* Python values are pushed into Lua by a converter chosen once per type and
+ * kept in a small direct-mapped cache of LUA_CONVCACHE_SIZE entries. */
+#define LUA_CONVCACHE_SIZE 64
+
+enum
+{
+    LUA_CONV_NONE,
+    LUA_CONV_BOOL,
+    LUA_CONV_INT,
+    LUA_CONV_LONG,
+    LUA_CONV_FLOAT,
+    LUA_CONV_STRING,
+    LUA_CONV_UNICODE,           /* str on Python 3, pushed as UTF-8 */
+    LUA_CONV_LUAOBJECT,
+    LUA_CONV_LUABUFFER,
+    LUA_CONV_BUFFER,            /* read in place if possible */
+    LUA_CONV_ARRAY,             /* typed array if possible */
+    LUA_CONV_DICT,
+    LUA_CONV_LIST,
+    LUA_CONV_CHANNEL,
+    LUA_CONV_OBJECT,
+    LUA_CONV_CUSTOM             /* a function added with add_converter() */
+};
+
+typedef struct
+{
+    PyTypeObject *type;         /* owned reference, or NULL if unused */
+    int kind;                   /* LUA_CONV_* */
+    PyObject *func;             /* for LUA_CONV_CUSTOM, borrowed from
+                                   LuaState.converters */
+} LuaConverter;
+
+/* Running code under a limit checks it every LUA_LIMIT_STEP VM
+ * instructions from a count hook. */
+#define LUA_LIMIT_STEP 1000
+
+enum { LUA_LIMIT_NONE, LUA_LIMIT_INSTRUCTIONS, LUA_LIMIT_TIMEOUT };
+
+typedef struct
+{
+    long budget;                /* instructions left, or -1 for no limit */
+    double deadline;            /* Lua_clock() time, or 0 for no limit */
+    lua_State *slice;           /* coroutine to yield at the limit instead
+                                   of failing, or NULL */
+} LuaLimit;
+
+/* Counters of traffic through the binding, read with LuaState.stats().
+ * They cost a clock read per conversion, so they are only compiled in
+ * with STATS defined, e.g. by "setup.py build_ext -D STATS". */
+//#define STATS
+
+enum
+{
+    LUA_STAT_NONE, LUA_STAT_BOOL, LUA_STAT_INT, LUA_STAT_FLOAT, LUA_STAT_STR,
+    LUA_STAT_UNICODE, LUA_STAT_LUAOBJECT, LUA_STAT_BUFFER, LUA_STAT_OTHER,
+    LUA_STAT_PYTYPES
+};
+
+#define LUA_STAT_LUATYPES 10    /* LUA_TNONE to LUA_TTHREAD */
+
+typedef struct
+{
+    unsigned long count;
+    unsigned PY_LONG_LONG ns;
+} LuaCounter;
+
+typedef struct
+{
+    LuaCounter push[LUA_STAT_PYTYPES];      /* Lua_pushpyobject */
+    LuaCounter topython[LUA_STAT_LUATYPES]; /* Lua_topython */
+    LuaCounter call;            /* LuaObject_call */
+    LuaCounter callback;        /* lua_obj_call */
+    LuaCounter compile;         /* chunks compiled for eval() */
+    unsigned long cachehits;    /* chunks eval() found compiled */
+    unsigned long wrapped;      /* LuaObjects created */
+    unsigned long unwrapped;    /* LuaObjects freed */
+} LuaStats;
+
+#ifdef STATS
+#define STATS_DECLARE(t) unsigned PY_LONG_LONG t;
+#define STATS_START(t) ((t) = Lua_nanotime())
+#define STATS_STOP(lua, counter, t) \
+    ((lua)->stats.counter.count++, \
+     (lua)->stats.counter.ns += Lua_nanotime() - (t))
+#define STATS_INC(lua, field) ((lua)->stats.field++)
+#else
+#define STATS_DECLARE(t)
+#define STATS_START(t) ((void)0)
+#define STATS_STOP(lua, counter, t) ((void)0)
+#define STATS_INC(lua, field) ((void)0)
+#endif
+
 typedef struct
 {
     PyObject_HEAD
     lua_State *L;
+    LuaAlloc alloc;
+
+    /* Lua runs without the GIL; the state lock keeps other threads out of
+     * L meanwhile.  It is recursive so Python callbacks may re-enter. */
+    PyThread_type_lock lock;
+    long lockowner;             /* thread ident of the holder, or 0 */
+    int lockdepth;
+    PyThreadState *tstate;      /* saved thread state while the GIL is
+                                   released, NULL while it is held */
+
+    int pymetatable;            /* registry ref to the PyObject metatable */
+    int pybuffermetatable;      /* registry ref to the PyBuffer metatable */
+    int pyarraymetatable;       /* registry ref to the PyArray metatable */
+    int pydictmetatable;        /* registry ref to the PyDict metatable */
+    int pylistmetatable;        /* registry ref to the PyList metatable,
+                                   used for lists and tuples */
+    int pychannelmetatable;     /* registry ref to the PyChannel metatable */
+    int wrappers;               /* registry ref to a table mapping Lua
+                                   values to their live LuaObjects */
+    int keycache;               /* registry ref to a table mapping Lua
+                                   strings to interned Python strings */
+    PyObject *keynames;         /* list keeping those strings alive */
+    int methodcache;            /* registry ref to a weak-keyed table
+                                   mapping Python object userdata to
+                                   {[1] = type version, name = method} */
+    Py_ssize_t bufferthreshold; /* return Lua strings this long as
+                                   LuaBuffers, or -1 to always copy */
+    int integers;               /* return integral Lua numbers as int */
+    PyObject *converters;       /* dict mapping types to functions added
+                                   with add_converter(), or NULL */
+    LuaConverter convcache[LUA_CONVCACHE_SIZE];
+
+    /* Compiled chunk cache: a table mapping source text to a slot number,
+     * with slot i holding the source at [2i-1] and the function at [2i]. */
+    int chunkcache;             /* registry ref to the cache table */
+    int chunkcachesize;         /* maximum number of cached chunks */
+    int chunkcount;             /* number of slots in use */
+    unsigned long chunktick;    /* LRU clock */
+    unsigned long *chunkused;   /* last use of each slot */
+
+    char *bytecodedir;          /* directory of compiled chunks kept
+                                   across states, or NULL */
+
+    /* Modules added with add_bundle(), served to require() by a searcher
+     * in package.loaders without touching the filesystem. */
+    int bundle;                 /* registry ref to a table mapping module
+                                   names to their code, or LUA_NOREF */
+    int bundlesearcher;         /* registry ref to the searcher */
+
+    /* The profiler and execution limits share one count hook, run every
+     * hookperiod instructions. */
+    int hookperiod;
+    LuaLimit limit;             /* limit on the code running now */
+    int expired;                /* LUA_LIMIT_* that stopped it */
+
+    /* Profiler state; the samples themselves live in a registry table
+     * filled by the count hook. */
+    int profiling;              /* profile_start() is in effect */
+    int profileinterval;        /* instructions between samples */
+    int profilelines;           /* sample the current line too */
+    long profileleft;           /* instructions until the next sample */
+    int pydepth;                /* nesting of Python callbacks */
+    unsigned long pycalls;      /* Python callbacks made while profiling */
+    double pytime, pystart;     /* seconds spent in them */
+
+#ifdef STATS
+    LuaStats stats;
+#endif
 } LuaState;
 
+/* LuaState.load() feeds lua_load from a LuaReader, one block at a time,
+ * so a chunk never has to be held in memory as a whole. */
+#define LUA_LOAD_BLOCKSIZE 16384
+
+typedef struct
+{
+    FILE *file;                 /* read blocks from a C file, or */
+    PyObject *read;             /* call read(size) or recv(size), or */
+    const char *data;           /* hand out a whole buffer in place */
+    size_t len;
+    PyObject *block;            /* last block returned by read */
+    int *guarded;               /* the allocator's, lowered while read
+                                   runs */
+    int failed;                 /* reading raised a Python exception */
+    char buf[LUA_LOAD_BLOCKSIZE];
+} LuaReader;
+
+/* Output of lua_dump, collected by lua_dumpwriter. */
+typedef struct
+{
+    char *data;
+    size_t len, size;
+} LuaDump;
+
 typedef struct
 {
     PyObject_HEAD
     LuaState *lua;
+    int ref;                    /* luaL_ref into the registry */
+#ifdef LUA_FASTCALL
+    vectorcallfunc vectorcall;  /* LuaObject_vectorcall */
+#endif
 } LuaObject;
 
+typedef struct
+{
+    PyObject_HEAD
+    PyObject *states;           /* list of every state in the pool */
+    PyObject *idle;             /* list of states not handed out */
+    PyObject *lent;             /* list of states handed out by acquire() */
+    PyThread_type_lock gate;    /* held while idle is empty */
+} LuaStatePool;
+
+/* Lua allocator ************************************************************/
+
+static void *LuaAlloc_alloc(void *ud, void *ptr, size_t osize, size_t nsize);
+static void *LuaAlloc_get(LuaAlloc *a, size_t size);
+static void LuaAlloc_put(LuaAlloc *a, void *p, size_t size);
+static void LuaAlloc_close(LuaAlloc *a);
+static int lua_panic(lua_State *L);
+
+/* Iterators over Lua tables fetch LUA_ITER_BATCH entries per lua_next
+ * round trip. */
+#define LUA_ITER_BATCH 64
+
+enum { LUA_ITER_KEYS, LUA_ITER_VALUES, LUA_ITER_ITEMS };
+
+typedef struct
+{
+    PyObject_HEAD
+    LuaObject *obj;
+    int mode;                   /* LUA_ITER_KEYS, _VALUES or _ITEMS */
+    int key;                    /* registry ref to the last key fetched */
+    int done;                   /* lua_next has reached the end */
+    PyObject *batch;            /* prefetched results */
+    Py_ssize_t pos;             /* next result to hand out from batch */
+} LuaIter;
+
+/* Streams the results of LuaObject.map() and call_many(). */
+typedef struct
+{
+    PyObject_HEAD
+    LuaObject *fn;
+    PyObject *args;             /* iterator over the arguments */
+    int spread;                 /* each item is a tuple of arguments */
+} LuaCallIter;
+
+/* A function running in its own coroutine, advanced a time slice at a
+ * time by LuaTask.step(). */
+typedef struct
+{
+    PyObject_HEAD
+    LuaState *lua;
+    int ref;                    /* registry ref to the coroutine */
+    int nargs;                  /* arguments waiting for the first step */
+    int done;
+    PyObject *result;           /* return values once done */
+} LuaTask;
+
+#ifdef PY3
+/* What LuaCoroutine.__await__ returns: resumes the coroutine each time the
+ * event loop sends to it, and waits on whatever awaitable Lua yields. */
+typedef struct
+{
+    PyObject_HEAD
+    LuaObject *co;
+    PyObject *pending;          /* future the coroutine is waiting on */
+} LuaAwait;
+#endif
+
+/* A read-only view of a Lua string, kept alive through a registry ref. */
+typedef struct
+{
+    PyObject_HEAD
+    LuaState *lua;
+    int ref;
+    const char *data;
+    Py_ssize_t len;
+} LuaBuffer;
+
+/* The userdata through which Lua reads a Python buffer in place. */
+typedef struct
+{
+    PyObject *obj;              /* owned if the buffer is not exported */
+    Py_buffer view;
+    int exported;               /* view came from PyObject_GetBuffer */
+    const char *data;
+    Py_ssize_t len;
+} LuaPyBuffer;
+
+/* The userdata through which Lua indexes a typed numeric Python buffer,
+ * such as an array.array, in place. */
+typedef struct
+{
+    PyObject *obj;              /* owned if the buffer is not exported */
+    Py_buffer view;
+    int exported;               /* view came from PyObject_GetBuffer */
+    char *data;
+    Py_ssize_t len;             /* number of items */
+    Py_ssize_t itemsize;
+    char format;                /* struct module format code */
+    int readonly;
+} LuaPyArray;
+
+/* Whether a number converts to an integer element type with limits lo..hi;
+ * the cast truncates, so anything strictly within one of them does. */
+#define LUA_ARR_FITS(n, lo, hi) ((n) > (lua_Number)(lo) - 1 \
+        && (n) < (lua_Number)(hi) + 1)
+
+/* Functions installed with LuaState.register() are C closures over a
+ * LuaPyFunction, which converts arguments by their declared types. */
+#define LUA_REGISTER_MAXARGS 32
+
+enum
+{
+    LUA_ARG_OBJECT,             /* the usual conversion */
+    LUA_ARG_INT,
+    LUA_ARG_FLOAT,
+    LUA_ARG_STR,
+    LUA_ARG_BOOL,
+    LUA_ARG_NONE                /* restype only: return nothing */
+};
+
+typedef struct
+{
+    PyObject *func;
+    PyObject *args;             /* argument tuple reused while nothing
+                                   else holds on to it, or NULL */
+    int nargs;                  /* number of argtypes, or -1 to pass all
+                                   arguments with the usual conversion */
+    char argtypes[LUA_REGISTER_MAXARGS];
+    char restype;
+} LuaPyFunction;
+
+/* A Channel carries values between states and threads as flat messages,
+ * each a tag byte per value followed by its payload.  Messages are plain
+ * malloc'd blocks, so Lua code packs, queues and unpacks them without
+ * the GIL. */
+#define LUA_CHANNEL_CAPACITY 64
+#define LUA_PACK_MAXDEPTH 64    /* nesting limit, which also stops cycles */
+
+enum
+{
+    LUA_PACK_NIL = 'n',
+    LUA_PACK_FALSE = 'f',
+    LUA_PACK_TRUE = 't',
+    LUA_PACK_NUMBER = 'd',      /* a lua_Number */
+    LUA_PACK_STRING = 's',      /* a size_t length, then the bytes */
+    LUA_PACK_TABLE = 'T'        /* size_t narr and nrec, the values at 1 to
+                                   narr, then nrec key-value pairs */
+};
+
+typedef struct
+{
+    char *data;
+    size_t len, size;
+    int badtype;                /* Lua type that could not be packed, or
+                                   LUA_TNONE when out of memory */
+    int badkey;                 /* it was a table used as a key, which
+                                   Python could not take back */
+} LuaPacker;
+
+enum
+{
+    LUA_CHANNEL_OK,
+    LUA_CHANNEL_WOULDBLOCK,     /* full or empty, and not waiting */
+    LUA_CHANNEL_CLOSED
+};
+
+typedef struct
+{
+    PyObject_HEAD
+    PyThread_type_lock mutex;   /* guards the fields below */
+    PyThread_type_lock notempty; /* held exactly while the channel is open
+                                    and empty, or by the popping thread */
+    PyThread_type_lock notfull; /* held exactly while the channel is open
+                                   and full, or by the pushing thread */
+    char **slots;               /* ring buffer of messages */
+    Py_ssize_t capacity;
+    Py_ssize_t head;            /* slot of the oldest message */
+    Py_ssize_t count;
+    int closed;
+} LuaChannel;
+
+/* The userdata through which Lua code uses a Channel. */
+typedef struct
+{
+    LuaChannel *channel;        /* owned */
+    char *pending;              /* message being unpacked; freed by the next
+                                   pop or __gc if unpacking raised */
+} LuaChannelEnd;
+
 /* Utility functions ********************************************************/
 
 static void lua_pushluaobject(lua_State *L, LuaObject *f);
-static PyObject *lua_topyobject(lua_State *L, int index);
+static PyObject **Lua_topyslot(LuaState *lua, int index);
+static PyObject *Lua_topyobject(LuaState *lua, int index);
 static PyObject *Lua_toluaobject(LuaState *lua, int index);
 static int lua_obj_gc(lua_State *L);
 static int lua_obj_call(lua_State *L);
 static int lua_obj_index(lua_State *L);
 static int lua_obj_newindex(lua_State *L);
+static int Lua_pushattr(LuaState *lua, PyObject *o, PyObject *key);
+static int Lua_parsetype(PyObject *t, int allownone);
+static PyObject *Lua_toargtuple(LuaState *lua, LuaPyFunction *f, int nargs);
+static int Lua_pushresult(LuaState *lua, LuaPyFunction *f, PyObject *ret);
+static int lua_func_call(lua_State *L);
+static int lua_func_gc(lua_State *L);
+static int Lua_packgrow(LuaPacker *p, size_t n);
+static int Lua_packbytes(LuaPacker *p, const void *src, size_t n);
+static int Lua_packlua(LuaPacker *p, lua_State *L, int index, int depth);
+static int Lua_packkey(PyObject *key);
+static int Lua_packpython(LuaPacker *p, PyObject *o, int depth);
+static void Lua_unpacklua(lua_State *L, const char **p);
+static PyObject *Lua_unpackpython(const char **p);
+static int Lua_pushchannel(LuaState *lua, PyObject *o);
+static int Lua_chanpush(lua_State *L, int blocking);
+static int Lua_chanpop(lua_State *L, int blocking);
+static int lua_chan_push(lua_State *L);
+static int lua_chan_trypush(lua_State *L);
+static int lua_chan_pop(lua_State *L);
+static int lua_chan_trypop(lua_State *L);
+static int lua_chan_close(lua_State *L);
+static int lua_chan_closed(lua_State *L);
+static int lua_chan_len(lua_State *L);
+static int lua_chan_tostring(lua_State *L);
+static int lua_chan_gc(lua_State *L);
+static PyObject *Lua_tokeystring(LuaState *lua, int index);
+static int Lua_ismethodcacheable(PyObject *o, PyObject *key);
+static int Lua_getcachedmethod(LuaState *lua, PyObject *o);
+static void Lua_cachemethod(LuaState *lua, PyObject *o);
+static LuaPyBuffer *lua_tobuffer(lua_State *L, int index);
+static ptrdiff_t lua_buf_posrelat(ptrdiff_t pos, size_t len);
+static PyThreadState *lua_buf_enter(lua_State *L, LuaState *lua,
+        LuaPyBuffer *b);
+static void lua_buf_leave(LuaState *lua, LuaPyBuffer *b,
+        PyThreadState *tstate);
+static int lua_buf_gc(lua_State *L);
+static int lua_buf_len(lua_State *L);
+static int lua_buf_tostring(lua_State *L);
+static int lua_buf_index(lua_State *L);
+static int lua_buf_sub(lua_State *L);
+static int lua_buf_byte(lua_State *L);
+static int lua_buf_find(lua_State *L);
+static Py_ssize_t lua_arr_itemsize(char format);
+static lua_Number lua_arr_get(char format, const char *p);
+static int lua_arr_fits(char format, lua_Number n);
+static void lua_arr_set(char format, char *p, lua_Number n);
+static LuaPyArray *lua_toarray(lua_State *L, int index);
+static PyThreadState *lua_arr_enter(lua_State *L, LuaState *lua,
+        LuaPyArray *a);
+static void lua_arr_leave(LuaState *lua, LuaPyArray *a,
+        PyThreadState *tstate);
+static int lua_arr_gc(lua_State *L);
+static int lua_arr_len(lua_State *L);
+static int lua_arr_index(lua_State *L);
+static int lua_arr_newindex(lua_State *L);
+static int lua_dict_index(lua_State *L);
+static int lua_dict_newindex(lua_State *L);
+static int lua_dict_len(lua_State *L);
+static int lua_dict_pairs(lua_State *L);
+static int lua_dict_next(lua_State *L);
+static int lua_dict_ipairs(lua_State *L);
+static int lua_dict_inext(lua_State *L);
+static int Lua_pushlistitem(LuaState *lua, PyObject *o, lua_Integer i);
+static int lua_list_index(lua_State *L);
+static int lua_list_newindex(lua_State *L);
+static int lua_list_len(lua_State *L);
+static int lua_list_ipairs(lua_State *L);
+static int lua_list_inext(lua_State *L);
+static int lua_pairs(lua_State *L);
+static void Lua_installpairs(LuaState *lua);
+static int lua_co_resume(lua_State *L);
+static int lua_co_wrap(lua_State *L);
+static void Lua_installresume(LuaState *lua);
 void Lua_settable_cfunction(LuaState *lua, int index, const char *name,
         lua_CFunction fn);
+static void Lua_newpymetatable(LuaState *lua);
+static int Lua_isbuffertype(PyTypeObject *type);
+static int Lua_isbufferobject(PyObject *o);
+static int Lua_pushbuffer(LuaState *lua, PyObject *o);
+static PyObject *Lua_tobuffer(LuaState *lua, int index);
+static int Lua_pusharray(LuaState *lua, PyObject *o);
+static PyObject *Lua_toarray(LuaState *lua, int index, char format);
 static int Lua_pushpyobject_tuple(LuaState *lua, PyObject *o);
 static int Lua_pushpyobject(LuaState *lua, PyObject *o);
+static int Lua_dopushpyobject(LuaState *lua, PyObject *o);
+static int Lua_pushuserdata(LuaState *lua, PyObject *o, int metatable);
+static int Lua_pushconverted(LuaState *lua, PyObject *o, PyObject *func);
+static int Lua_convkind(LuaState *lua, PyTypeObject *type, PyObject **func);
+static LuaConverter *Lua_getconverter(LuaState *lua, PyTypeObject *type);
+static void Lua_clearconverters(LuaState *lua);
 static PyObject *Lua_topython(LuaState *lua, int index);
+static PyObject *Lua_dotopython(LuaState *lua, int index);
+static int Lua_pushtable(LuaState *lua, PyObject *o, int depth, int memo);
+static PyObject *Lua_tonested(LuaState *lua, int index, int depth, PyObject
+        *memo);
+static PyObject *Lua_todict(LuaState *lua, int index, int depth, PyObject
+        *memo);
+static PyObject *Lua_tolist(LuaState *lua, int index, int depth, PyObject
+        *memo);
 static PyObject *Lua_topython_tuple(LuaState *lua, int n);
 static PyObject *Lua_topython_multiple(LuaState *lua, int n);
 static int lua_iscallable(lua_State *L, int index);
+static int lua_issequence(lua_State *L, int index);
 static int lua_isindexable(lua_State *L, int index);
+static int lua_nextbatch(lua_State *L);
+static PyObject *Lua_callfunction(LuaState *lua, PyObject *args);
+static PyObject *Lua_callvector(LuaState *lua, PyObject *const *argv,
+        Py_ssize_t n);
+static PyObject *Lua_callitem(LuaObject *fn, PyObject *item, int spread);
+static int Lua_loadchunk(LuaState *lua, const char *code, size_t len);
+static int Lua_loadbuffer(LuaState *lua, const char *code, size_t len,
+        const char *name);
+static int Lua_loadsource(LuaState *lua, const char *code, size_t len);
+static int Lua_loadreader(LuaState *lua, LuaReader *r, const char *name);
+static const char *lua_streamreader(lua_State *L, void *ud, size_t *sz);
+static int Lua_addmodule(LuaState *lua, PyObject *name, PyObject *code,
+        int frompath);
+static int Lua_addzipbundle(LuaState *lua, PyObject *o);
+static void Lua_installsearcher(LuaState *lua);
+static int lua_bundle_searcher(lua_State *L);
+static int Lua_loadbytecodefile(LuaState *lua, const char *path,
+        const char *code, size_t len);
+static void Lua_dumpfile(LuaState *lua, const char *path, const char *code,
+        size_t len);
+static int lua_dumpwriter(lua_State *L, const void *p, size_t sz, void *ud);
+static int lua_filewriter(lua_State *L, const void *p, size_t sz, void *ud);
+static void Lua_seterror(LuaState *lua, int status, PyObject *exc,
+        const char *prefix);
+static void Lua_lock(LuaState *lua);
+static void Lua_unlock(LuaState *lua);
+static int Lua_pcall(LuaState *lua, int nargs, int nresults);
+static PyThreadState *Lua_enterpython(LuaState *lua);
+static void Lua_leavepython(LuaState *lua, PyThreadState *tstate);
+static double Lua_clock(void);
+static unsigned PY_LONG_LONG Lua_nanotime(void);
+static int Lua_pytypestat(PyObject *o);
+static PyObject *Lua_counter(LuaCounter *c);
+static void lua_profile_sample(lua_State *L, int lines);
+static int Lua_parselimit(PyObject *kwds, long *budget, double *timeout);
+static int Lua_parselimitkw(PyObject *const *values, PyObject *kwnames,
+        long *budget, double *timeout);
+static int Lua_parselimitarg(PyObject *key, PyObject *value, long *budget,
+        double *timeout);
+#ifdef LUA_FASTCALL
+static int Lua_fastcode(const char *func, PyObject *const *args,
+        Py_ssize_t nargs, const char **code, Py_ssize_t *len);
+#endif
+static void Lua_setlimit(LuaState *lua, LuaLimit *saved, long budget,
+        double timeout, lua_State *slice);
+static void Lua_restorelimit(LuaState *lua, LuaLimit *saved);
+static void Lua_updatehook(LuaState *lua, lua_State *L);
+static LuaState *lua_getstate(lua_State *L);
+static void lua_hook(lua_State *L, lua_Debug *ar);
+static int lua_canyield(lua_State *L);
+static int Lua_resume(LuaState *lua, lua_State *co, int nargs);
+static PyObject *Lua_resumecoroutine(LuaObject *co, PyObject *args);
 
 /* LuaObject type *********************************************************/
 
 static void LuaObject_dealloc(LuaObject *self);
 static int LuaObject_init(LuaObject *self, PyObject *args, PyObject
         *kwds);
+static PyObject *LuaObject_callvector(LuaObject *self, PyObject *const *argv,
+        Py_ssize_t n, long budget, double timeout);
+#ifdef LUA_FASTCALL
+static PyObject *LuaObject_vectorcall(PyObject *self, PyObject *const *args,
+        size_t nargsf, PyObject *kwnames);
+#endif
 static PyObject *LuaObject_call(LuaObject *self, PyObject *args, PyObject
         *kwds);
 static PyObject *LuaObject_getattro(LuaObject *self, PyObject *name);
@@ -55,6 +689,25 @@ static int LuaObject_setattro(LuaObject *self, PyObject *name, PyObject *o);
 static PyObject *LuaObject_subscript(LuaObject *self, PyObject *ss);
 static int LuaObject_ass_subscript(LuaObject *self, PyObject *ss, PyObject
         *o);
+static PyObject *LuaObject_convert(LuaObject *self, PyObject *args,
+        PyObject *kwds, int aslist);
+static PyObject *LuaObject_to_dict(LuaObject *self, PyObject *args, PyObject
+        *kwds);
+static PyObject *LuaObject_to_list(LuaObject *self, PyObject *args, PyObject
+        *kwds);
+static PyObject *LuaObject_to_array(LuaObject *self, PyObject *args);
+static int LuaObject_nonzero(LuaObject *self);
+static Py_ssize_t LuaObject_length(LuaObject *self);
+static PyObject *LuaObject_iter(LuaObject *self);
+static PyObject *LuaObject_keys(LuaObject *self);
+static PyObject *LuaObject_values(LuaObject *self);
+static PyObject *LuaObject_items(LuaObject *self);
+static PyObject *LuaObject_callbatch(LuaObject *self, PyObject *args,
+        PyObject *kwds, int spread);
+static PyObject *LuaObject_map(LuaObject *self, PyObject *args, PyObject
+        *kwds);
+static PyObject *LuaObject_call_many(LuaObject *self, PyObject *args,
+        PyObject *kwds);
 
 /* LuaState type ************************************************************/
 
@@ -63,7 +716,96 @@ static int LuaState_init(LuaState *self, PyObject *args, PyObject *kwds);
 static PyObject *LuaState_openlibs(LuaState *self);
 static PyObject *LuaState_openlib(LuaState *self, PyObject *args);
 static PyObject *LuaState_gettop(LuaState *self);
-static PyObject *LuaState_eval(LuaState *self, PyObject *args);
+static PyObject *LuaState_eval(LuaState *self, LUA_FASTARGS_KW);
+static PyObject *LuaState_compile(LuaState *self, LUA_FASTARGS);
 static PyObject *LuaState_globals(LuaState *self, PyObject *args);
+static PyObject *LuaState_table(LuaState *self, PyObject *args, PyObject
+        *kwds);
+static PyObject *LuaState_memstats(LuaState *self);
+static PyObject *LuaState_load(LuaState *self, PyObject *args, PyObject
+        *kwds);
+static PyObject *LuaState_dump(LuaState *self, PyObject *args);
+static PyObject *LuaState_register(LuaState *self, PyObject *args,
+        PyObject *kwds);
+static PyObject *LuaState_add_converter(LuaState *self, PyObject *args);
+static PyObject *LuaState_add_bundle(LuaState *self, PyObject *args);
+static PyObject *LuaState_profile_start(LuaState *self, PyObject *args,
+        PyObject *kwds);
+static PyObject *LuaState_profile_stop(LuaState *self);
+static PyObject *LuaState_stats(LuaState *self, PyObject *args, PyObject
+        *kwds);
+static PyObject *LuaState_spawn(LuaState *self, PyObject *args);
+static PyObject *LuaState_coroutine(LuaState *self, PyObject *args);
+static PyObject *LuaState_load_bytecode(LuaState *self, PyObject *args,
+        PyObject *kwds);
+
+/* LuaStatePool type ********************************************************/
+
+static void LuaStatePool_dealloc(LuaStatePool *self);
+static int LuaStatePool_init(LuaStatePool *self, PyObject *args, PyObject
+        *kwds);
+static PyObject *LuaStatePool_take(LuaStatePool *self, int blocking);
+static void LuaStatePool_give(LuaStatePool *self, PyObject *state);
+static PyObject *LuaStatePool_acquire(LuaStatePool *self, PyObject *args);
+static PyObject *LuaStatePool_release(LuaStatePool *self, PyObject *state);
+static PyObject *LuaStatePool_call(LuaStatePool *self, LUA_FASTARGS);
+static PyObject *LuaStatePool_size(LuaStatePool *self);
+
+/* LuaBuffer type ***********************************************************/
+
+static void LuaBuffer_dealloc(LuaBuffer *self);
+static Py_ssize_t LuaBuffer_length(LuaBuffer *self);
+static PyObject *LuaBuffer_str(LuaBuffer *self);
+#ifndef PY3
+static Py_ssize_t LuaBuffer_getreadbuffer(LuaBuffer *self, Py_ssize_t segment,
+        void **ptr);
+static Py_ssize_t LuaBuffer_getsegcount(LuaBuffer *self, Py_ssize_t *lenp);
+#endif
+static int LuaBuffer_getbuffer(LuaBuffer *self, Py_buffer *view, int flags);
+
+/* Channel type *************************************************************/
+
+static void LuaChannel_dealloc(LuaChannel *self);
+static int LuaChannel_init(LuaChannel *self, PyObject *args, PyObject *kwds);
+static int LuaChannel_wait(PyThread_type_lock gate, int blocking, int gil);
+static int LuaChannel_put(LuaChannel *self, char *msg, int blocking, int gil);
+static int LuaChannel_get(LuaChannel *self, char **msg, int blocking,
+        int gil);
+static void LuaChannel_doclose(LuaChannel *self);
+static Py_ssize_t LuaChannel_length(LuaChannel *self);
+static PyObject *LuaChannel_push(LuaChannel *self, PyObject *args);
+static PyObject *LuaChannel_pop(LuaChannel *self, PyObject *args);
+static PyObject *LuaChannel_close(LuaChannel *self);
+
+/* LuaIter type *************************************************************/
+
+static PyObject *LuaIter_new(LuaObject *obj, int mode);
+static void LuaIter_dealloc(LuaIter *self);
+static int LuaIter_fill(LuaIter *self);
+static PyObject *LuaIter_next(LuaIter *self);
+
+/* LuaCallIter type *********************************************************/
+
+static void LuaCallIter_dealloc(LuaCallIter *self);
+static PyObject *LuaCallIter_next(LuaCallIter *self);
+
+/* LuaCoroutine type *******************************************************/
+
+static PyObject *LuaCoroutine_resume(LuaObject *self, PyObject *args);
+static PyObject *LuaCoroutine_send(LuaObject *self, PyObject *value);
+static PyObject *LuaCoroutine_next(LuaObject *self);
+static PyObject *LuaCoroutine_status(LuaObject *self);
+#ifdef PY3
+static PyObject *LuaCoroutine_await(LuaObject *self);
+static void LuaAwait_dealloc(LuaAwait *self);
+static PyObject *LuaAwait_send(LuaAwait *self, PyObject *value);
+static PyObject *LuaAwait_next(LuaAwait *self);
+static PyObject *LuaAwait_throw(LuaAwait *self, PyObject *args);
+#endif
+
+/* LuaTask type *************************************************************/
+
+static void LuaTask_dealloc(LuaTask *self);
+static PyObject *LuaTask_step(LuaTask *self, PyObject *args, PyObject *kwds);
 
 #endif
@@ -1,7 +1,15 @@
 #!/usr/bin/env python
 
 import sys
-from lua import LuaState
+import array
+import io
+import mmap
+import os
+import shutil
+import tempfile
+import threading
+import zipfile
+from lua import LuaState, LuaStatePool, LuaLimitError, LuaCoroutine, Channel
 
 def pydouble(x):
     return 2 * x
@@ -87,6 +95,924 @@ def test(L):
     L.eval('print(x.pr)')
     L.eval('x.pr()')
 
+def test_identity(L):
+    print '-- identity'
+    print L.globals() is L.globals()
+    L.eval('shared = {}')
+    a = L.globals().shared
+    print a is L.eval('return shared'), a is L.globals()['shared']
+    cache = {a: 'cached'}
+    print cache[L.eval('return shared')]
+    del a, cache
+    print L.eval('return shared') is not None
+
+def test_iteration(L):
+    print '-- iteration'
+    t = L.eval('''
+        local t = {}
+        for i = 1, 200 do t[i] = i * i end
+        t.name = 'squares'
+        return t
+        ''')
+    print len(t), len(list(t))
+    print sum(v for v in t.values() if isinstance(v, float))
+    print sorted(k for k in t.keys() if isinstance(k, str))
+    print dict(t.items())['name'], dict(t.items())[3]
+    print bool(L.eval('return {}')), list(L.eval('return {}'))
+    try:
+        len(L.eval('return print'))
+    except TypeError, e:
+        print e
+    it = iter(t)
+    it.next()
+    L.globals().t = t
+    L.eval('for k in pairs(t) do t[k] = nil end collectgarbage()')
+    # whether lua_next still accepts the cleared key depends on where it
+    # hashed to; either way the iterator must stop cleanly
+    try:
+        stopped = len(list(it)) <= 200
+    except RuntimeError, e:
+        stopped = 'next' in str(e)
+    print stopped
+
+def test_compile(L):
+    print '-- compile'
+    for i in xrange(3):
+        print L.eval('return 1 + 2')
+    add = L.compile('local x, y = ... return x + y')
+    print add
+    print add(3, 4), add(5, 6)
+    try:
+        L.compile('return +')
+    except SyntaxError, e:
+        print e
+
+    print '-- chunk cache eviction'
+    C = LuaState(cache_size=2)
+    C.eval('n = 0')
+    for code in ['n = n + 1', 'n = n + 2', 'n = n + 3', 'n = n + 1']:
+        C.eval(code)
+    print C.eval('return n')
+    U = LuaState(cache_size=0)
+    print U.eval('return 7')
+
+def test_buffers():
+    print '-- buffers'
+    L = LuaState(buffer_threshold=4)
+    L.openlibs()
+    print repr(L.eval('return "abc"'))
+    big = L.eval('return string.rep("xy", 4)')
+    print type(big).__name__, len(big), str(big), memoryview(big)[2:5].tobytes()
+    L.globals().big = big
+    print L.eval('return big == string.rep("xy", 4), #big')
+
+    data = bytearray('hello, world')
+    L.globals().data = data
+    print L.eval('return #data, data[1], data[100]')
+    print map(str, L.eval('return data:sub(-5), data:sub(1, 5)'))
+    print L.eval('return data:byte(1, 3)')
+    print L.eval('return data:find("world")'), L.eval('return data:find("no")')
+    print str(L.eval('return tostring(data)'))
+    print L.eval('return data') is data
+    m = mmap.mmap(-1, 16)
+    m.write('mapped memory!')
+    L.globals().m = m
+    print str(L.eval('return m:sub(1, 6)')), L.eval('return #m')
+    L.globals().v = memoryview('view')
+    print L.eval('return v:len(), v[4]')
+    m.close()
+    try:
+        L.eval('return m:byte(1)')
+    except RuntimeError, e:
+        print e
+    print L.eval('data.__gc(data); return #data, data:byte(1), data[1]')
+
+def test_arrays():
+    print '-- arrays'
+    L = LuaState()
+    L.openlibs()
+    for typecode in 'bBhHiIlLfd':
+        a = array.array(typecode, [1, 2, 3])
+        L.globals().a = a
+        L.eval('for i = 1, #a do a[i] = a[i] * 2 end')
+        print typecode, a.tolist(), L.eval('return a[0], a[4]')
+    print L.eval('return a') is a
+    try:
+        L.eval('a[4] = 1')
+    except RuntimeError, e:
+        print e
+    a.extend(range(1000))
+    print L.eval('return #a, a[1003]')
+    L.globals().i = array.array('i', [0])
+    for code in ['i[1] = 0/0', 'i[1] = 1e300', 'i[1] = 2^31']:
+        try:
+            L.eval(code)
+        except RuntimeError, e:
+            print e
+    b = array.array('B', [0])
+    L.globals().b = b
+    L.eval('b[1] = 255.5')
+    try:
+        L.eval('b[1] = 256')
+    except RuntimeError, e:
+        print e
+    print b.tolist()
+    f = array.array('f', [0])
+    L.globals().f = f
+    L.eval('f[1] = 1/0')
+    print f.tolist()
+    L.eval('a.__gc(a)')
+    print L.eval('return #a, a[1]')
+    v = L.eval('''
+        local t = {}
+        for i = 1, 5 do t[i] = i / 2 end
+        return t
+        ''').to_array()
+    print v
+    print L.eval('return {1, 2, 300}').to_array('i')
+    try:
+        L.eval('return {1, "x"}').to_array()
+    except TypeError, e:
+        print e
+    for code, fmt in [('{1e300}', 'i'), ('{1, 0/0}', 'i'), ('{300}', 'B'),
+                      ('{-5}', 'B')]:
+        try:
+            L.eval('return ' + code).to_array(fmt)
+        except OverflowError, e:
+            print e
+    print L.eval('return {0/0, 1e300}').to_array('d')[1]
+
+def test_threads():
+    print '-- threads'
+    states = [LuaState() for i in xrange(4)]
+    results = [None] * len(states)
+    def work(i):
+        L = states[i]
+        L.globals().inc = lambda x: x + 1
+        results[i] = L.eval('''
+            local n = 0
+            for i = 1, 100000 do n = n + 1 end
+            for i = 1, 100 do n = inc(n) end
+            return n
+            ''')
+    threads = [threading.Thread(target=work, args=(i,))
+            for i in xrange(len(states))]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    print results
+
+    print '-- shared state'
+    L = LuaState()
+    L.eval('n = 0')
+    bump = L.compile('for i = 1, 1000 do n = n + 1 end')
+    def hammer():
+        for i in xrange(50):
+            bump()
+    threads = [threading.Thread(target=hammer) for i in xrange(4)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    print L.eval('return n')
+
+    print '-- reentry'
+    L.globals().reenter = lambda: L.eval('return n + 1')
+    print L.eval('return reenter()')
+
+def test_pool():
+    print '-- pool'
+    pool = LuaStatePool(3, init='''
+        function square(x) return x * x end
+        ''', cache_size=8)
+    print pool.size()
+    states = [pool.acquire() for i in xrange(3)]
+    print pool.acquire(False)
+    for L in states:
+        pool.release(L)
+    for L in [states[0], LuaState()]:
+        try:
+            pool.release(L)
+        except ValueError, e:
+            print e
+    # a state that call() is using isn't the caller's to release
+    for L in states:
+        L.globals().me = L
+        L.globals().release = pool.release
+        L.eval('function give() release(me) end')
+    try:
+        pool.call('give')
+    except RuntimeError, e:
+        print e
+    L = pool.acquire()
+    pool.release(L)
+    results = []
+    def work(x):
+        results.append(pool.call('square', x))
+    threads = [threading.Thread(target=work, args=(i,)) for i in xrange(10)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    print sorted(results)
+    L = pool.acquire()
+    print L.eval('return string.rep("ab", 2)')
+    pool.release(L)
+
+def test_channels():
+    print '-- channels'
+    ch = Channel(2)
+    print ch.capacity, len(ch), ch.push([1, 'a', {'b': True}]), ch.pop()
+    print ch.push(1), ch.push(2), ch.push(3, False), ch.pop(), ch.pop()
+    print ch.pop(False)
+    for value in [None, object(), {None: 1}, {float('nan'): 1},
+            {(1, 2): 3}]:
+        try:
+            ch.push(value)
+        except (TypeError, ValueError), e:
+            print e
+    # items that change their container while it is being sent
+    class Shrink(int):
+        def __float__(self):
+            del xs[1:]
+            d.clear()
+            return 1.0
+    xs, d = [Shrink(1), 2, 3], {}
+    print ch.push(xs), ch.pop(), xs
+    d = {'a': Shrink(1), 'b': 2}
+    print ch.push(d), sorted(ch.pop().items()), d
+
+    L = LuaState()
+    L.globals().ch = ch
+    print L.eval('return ch') is ch
+    L.eval('ch:push({1, 2, x = "y"})')
+    print ch.pop()
+    ch.push({'k': 'v'})
+    print L.eval('return ch:pop().k, ch:try_pop(), #ch')
+    for code in ['ch:push(ch.pop)', 'ch:push(nil)',
+            'local t = {} t[1] = t ch:push(t)', 'ch:push({[{}] = 1})']:
+        try:
+            L.eval(code)
+        except RuntimeError, e:
+            print e
+    print len(ch)
+
+    print '-- pipeline'
+    lines, records = Channel(8), Channel(8)
+    parse = LuaState()
+    parse.openlibs()
+    parse.globals().inp, parse.globals().out = lines, records
+    parse = parse.compile('''
+        while true do
+            local line = inp:pop()
+            if line == nil then break end
+            local a, b = line:match("(%d+) (%d+)")
+            out:push({a = a + 0, b = b + 0})
+        end
+        out:close()
+        ''')
+    score = LuaState()
+    score.globals().inp = records
+    score = score.compile('''
+        local total, n = 0, 0
+        for r in inp.pop, inp do
+            total, n = total + r.a * r.b, n + 1
+        end
+        return total, n
+        ''')
+    results = []
+    threads = [threading.Thread(target=parse),
+            threading.Thread(target=lambda: results.append(score()))]
+    for t in threads:
+        t.start()
+    for i in xrange(1000):
+        lines.push('%d 3' % i)
+    lines.close()
+    for t in threads:
+        t.join()
+    print results, lines.closed, records.pop()
+    try:
+        lines.push('x')
+    except ValueError, e:
+        print e
+
+def test_memory():
+    print '-- memory'
+    for allocator in ['system', 'pool']:
+        L = LuaState(allocator=allocator, memory_limit=1 << 20)
+        L.openlibs()
+        L.eval('t = {} for i = 1, 1000 do t[i] = "x" .. i end')
+        stats = L.memstats()
+        print allocator, stats['live'] > 0, stats['peak'] >= stats['live'],
+        print stats['allocs'] > stats['frees'], stats['limit']
+        try:
+            L.eval('local s = "x" while true do s = s .. s end')
+        except MemoryError, e:
+            print 'MemoryError', e
+        L.eval('t = nil collectgarbage()')
+        L.eval('collectgarbage()')
+        print L.memstats()['live'] < stats['live'], L.eval('return 1 + 1')
+    # Python callbacks are not held to the limit, which they could only
+    # hit outside of a protected call
+    L.globals().make = lambda: L.table(range(100000))
+    print L.eval('return #make()')
+    try:
+        LuaState(allocator='bogus')
+    except ValueError, e:
+        print e
+
+def test_convert(L):
+    print '-- bulk conversion'
+    data = {'name': 'x', 'tags': ['a', 'b'], 'nested': {'n': (1, 2)}}
+    data['self'] = data
+    t = L.table(data)
+    L.globals().t = t
+    print L.eval('return t.name, t.tags[2], t.nested.n[1], #t.tags')
+    print L.eval('return t.self == t')
+    shallow = L.table([[1], [2]], deep=False)
+    L.globals().shallow = shallow
+    print L.eval('return type(shallow[1])')
+    for bad in [{float('nan'): 1}, {'ok': {None: 1}}]:
+        try:
+            L.table(bad)
+        except ValueError, e:
+            print e
+    print L.gettop()
+
+    d = L.eval('''
+        local c = {list = {10, 20, 30}, map = {a = 1}, empty = {}}
+        c.loop = c
+        return c
+        ''').to_dict()
+    print sorted(d.keys()), d['list'], d['map'], d['empty']
+    print d['loop'] is d
+    print L.eval('return {1, 2, {3, 4}, x = 5}').to_list()
+    print L.eval('return {{1}, {2}}').to_list(depth=1)
+    try:
+        L.eval('return print').to_dict()
+    except ValueError, e:
+        print e
+
+def test_map(L):
+    print '-- batched calls'
+    f = L.eval('return function(x, y) return x * 2, y end')
+    print f.map([1, 2, 3])
+    print f.map(xrange(3), stream=True)
+    print list(f.map(xrange(3), stream=True))
+    print f.call_many([(1, 'a'), (2, 'b'), [3, 'c']])
+    print list(f.call_many(iter([(4, 'd')]), stream=True))
+    print len(f.call_many([tuple(xrange(100))])[0])
+    try:
+        f.call_many([tuple(xrange(10**6))])
+    except OverflowError, e:
+        print e
+    print L.gettop()
+    try:
+        L.eval('return function(x) error("bad " .. x) end').map([1, 2])
+    except RuntimeError, e:
+        print e
+    try:
+        L.eval('return {}').map([1])
+    except ValueError, e:
+        print e
+    print L.gettop()
+    def produce():
+        # the state isn't locked while the iterator runs, so another
+        # thread can use it in between calls
+        for i in xrange(3):
+            out = []
+            t = threading.Thread(target=lambda: out.append(
+                L.eval('return 10')))
+            t.start()
+            t.join()
+            yield out[0] + i
+    print f.map(produce())
+
+def test_bytecode(L):
+    print '-- bytecode'
+    f = L.eval('return function(x) return x + 1 end')
+    code = L.dump(f)
+    print type(code), code[:4] == '\x1bLua'
+    print L.load_bytecode(code)(1)
+    print L.load_bytecode(buffer(code))(2)
+    print LuaState().load_bytecode(bytearray(code))(3)
+    try:
+        L.dump(L.globals()['print'])
+    except TypeError, e:
+        print e
+    try:
+        L.load_bytecode('return 1')
+    except ValueError, e:
+        print e
+
+    m = mmap.mmap(-1, len(code))
+    m.write(code)
+    print L.load_bytecode(m)(4)
+    m.close()
+
+    cache = tempfile.mkdtemp()
+    try:
+        src = 'function warm(x) return x * 3 end'
+        cold = LuaState(bytecode_cache=cache)
+        cold.openlibs()
+        cold.eval(src)
+        print len(os.listdir(cache)), cold.eval('return warm(2)')
+        # a planted file proves the warm state skips compilation
+        path = os.path.join(cache, os.listdir(cache)[0])
+        other = LuaState()
+        chunk = other.compile('function warm(x) return x * 100 end')
+        open(path, 'wb').write(src + other.dump(chunk))
+        warm = LuaState(bytecode_cache=cache, cache_size=0)
+        warm.compile(src)()
+        print warm.eval('return warm(3)')
+        # but only while it was compiled from the same source
+        open(path, 'wb').write(src.upper() + other.dump(chunk))
+        warm.compile(src)()
+        print warm.eval('return warm(3)')
+        open(path, 'wb').write('\x1bLua garbage')
+        fresh = LuaState(bytecode_cache=cache)
+        fresh.eval(src)
+        print fresh.eval('return warm(4)'), os.path.getsize(path) > 20
+    finally:
+        shutil.rmtree(cache)
+
+class Socketish(object):
+    def __init__(self, data):
+        self.data = data
+    def recv(self, size):
+        chunk, self.data = self.data[:size], self.data[size:]
+        return chunk
+
+class Failing(object):
+    def read(self, size):
+        raise IOError('disk on fire')
+
+def test_load(L):
+    print '-- streaming load'
+    src = 'local t = {}\n' + 't[#t + 1] = 1\n' * 5000 + 'return #t'
+    fd, path = tempfile.mkstemp(suffix='.lua')
+    try:
+        os.write(fd, src)
+        os.close(fd)
+        print L.load(path)()
+        print L.load(unicode(path))()
+        print L.load(open(path, 'rb'))()
+        print L.load(io.open(path, 'rb'))()
+        open(path, 'w').write('x = 1\nerror("boom")')
+        try:
+            L.load(path)()
+        except RuntimeError, e:
+            print str(e).replace(path, 'PATH')
+    finally:
+        os.remove(path)
+    print L.load(Socketish(src))()
+    print L.load(bytearray('return 42'))()
+    print L.load(io.BytesIO('error("x")'), chunkname='=generated').__class__
+    try:
+        L.load(io.BytesIO('error("x")'), chunkname='=generated')()
+    except RuntimeError, e:
+        print e
+    try:
+        L.load('return 1 +', chunkname='=inline')
+    except IOError, e:
+        print e.errno is not None
+    try:
+        L.load(io.BytesIO('return 1 +'), chunkname='=broken')
+    except SyntaxError, e:
+        print e
+    try:
+        L.load(Failing())
+    except IOError, e:
+        print e
+    try:
+        L.load(42)
+    except TypeError, e:
+        print e
+    print L.gettop()
+
+def test_bundle():
+    print '-- module bundles'
+    B = LuaState()
+    B.openlibs()
+    other = LuaState()
+    B.add_bundle({
+        'greet': 'return {hello = function(n) return "hi " .. n end}',
+        'compiled': other.dump(other.compile('return 7')),
+    })
+    print B.eval('return require("greet").hello("bob")')
+    print B.eval('return require("compiled")')
+
+    data = 'return "from an mmap"'
+    m = mmap.mmap(-1, len(data) + 10)
+    m.seek(10)
+    m.write(data)
+    B.add_bundle({'mapped': buffer(m, 10, len(data))})
+    print B.eval('return require("mapped")')
+    B.add_bundle({'unmapped': buffer(m, 10, len(data))})
+    m.close()
+    try:
+        B.eval('require("unmapped")')
+    except RuntimeError, e:
+        print e
+
+    fd, path = tempfile.mkstemp(suffix='.zip')
+    os.close(fd)
+    try:
+        zf = zipfile.ZipFile(path, 'w', zipfile.ZIP_DEFLATED)
+        zf.writestr('pkg/init.lua', 'return {name = "pkg"}')
+        zf.writestr('pkg/util.lua', 'return {name = "pkg.util"}')
+        zf.writestr('bad.lua', 'return +')
+        zf.writestr('README', 'not a module')
+        zf.close()
+        B.add_bundle(path)
+        print B.eval('return require("pkg").name, require("pkg.util").name')
+        try:
+            B.eval('require("bad")')
+        except RuntimeError, e:
+            print e
+    finally:
+        os.remove(path)
+    try:
+        B.eval('require("missing")')
+    except RuntimeError, e:
+        print "no module 'missing' in bundle" in str(e)
+
+    # a bundle added before the package library still takes effect
+    C = LuaState()
+    C.add_bundle({'early': 'return 1'})
+    C.openlib('base')
+    C.openlib('package')
+    C.add_bundle({'late': 'return 2'})
+    print C.eval('return require("early"), require("late")')
+    print C.eval('return #package.loaders')
+    try:
+        C.add_bundle({'x': 1})
+    except TypeError, e:
+        print e
+
+def test_profile():
+    print '-- profiler'
+    P = LuaState()
+    P.openlibs()
+    P.globals().pywork = lambda n: sum(xrange(int(n)))
+    P.eval('''
+        function inner(n) local s = 0 for i = 1, n do s = s + i end return s end
+        function outer() for i = 1, 200 do inner(1000) end pywork(1e5) end
+        ''')
+    P.profile_start(interval=100)
+    P.eval('outer()')
+    prof = P.profile_stop()
+    print sorted(prof.keys())
+    print prof['samples'] > 100, prof['samples'] == sum(prof['stacks'].values())
+    print prof['python_calls'], prof['python_time'] > 0
+    hot = max(prof['stacks'], key=prof['stacks'].get)
+    print [frame.split('@')[0] for frame in hot.split(';')]
+    print all(line.rsplit(' ', 1)[1].isdigit()
+              for line in prof['collapsed'].splitlines())
+
+    P.profile_start(interval=50, lines=True)
+    P.eval('inner(10000)')
+    leaves = set(s.split(';')[-1] for s in P.profile_stop()['stacks'])
+    print sorted(set(l.split('@')[0] + ':' + l.rsplit(':', 1)[1]
+                     for l in leaves))
+    try:
+        P.profile_stop()
+    except RuntimeError, e:
+        print e
+    P.eval('outer()')
+    print P.gettop()
+
+def test_stats():
+    print '-- stats'
+    S = LuaState()
+    if not S.stats():
+        print 'built without STATS'
+        return
+    S.globals().twice = lambda x: 2 * x
+    f = S.eval('return function(x) return twice(x) end')
+    for i in range(3):
+        f(i)
+    S.eval('return 1')
+    S.eval('return 1')
+    st = S.stats()
+    print sorted(st.keys())
+    print st['call'][0], st['callback'][0], st['compile'][0], st['cachehits']
+    print st['push']['int'][0] >= 3, st['topython']['number'][0] >= 3
+    print st['wrapped'] >= 1, st['call'][1] > 0
+    del f
+    print S.stats(reset=True)['unwrapped'] >= 1, S.stats()['call']
+    # calls that fail before reaching Lua are counted as well
+    try:
+        S.eval('return {}')()
+    except ValueError, e:
+        print e, S.stats()['call'][0]
+
+def test_limits():
+    print '-- limits'
+    T = LuaState()
+    T.openlibs()
+    try:
+        T.eval('while true do end', max_instructions=100000)
+    except LuaLimitError, e:
+        print e
+    try:
+        T.eval('while true do end', timeout=0.05)
+    except LuaLimitError, e:
+        print e
+    try:
+        T.eval('while true do pcall(function() while true do end end) end',
+               timeout=0.05)
+    except LuaLimitError, e:
+        print e
+    print T.eval('local n = 0 for i = 1, 100 do n = n + i end return n',
+                 max_instructions=10000)
+    spin = T.eval('return function(n) for i = 1, n do end return n end')
+    print spin(10, max_instructions=1000)
+    try:
+        spin(1e9, max_instructions=1000)
+    except LuaLimitError, e:
+        print e
+    try:
+        spin(1, bogus=1)
+    except TypeError, e:
+        print e
+    try:
+        T.eval('error("plain")', timeout=1)
+    except LuaLimitError:
+        print 'wrong exception'
+    except RuntimeError, e:
+        print e
+    print T.eval('return 1 + 1'), T.gettop()
+
+    # cooperative time slicing between two long-running scripts
+    T.eval('''
+        log = {}
+        function worker(name, n)
+            local x = 0
+            for i = 1, n do x = x + 1 end
+            log[#log + 1] = name
+            return name, x
+        end
+        ''')
+    worker = T.globals().worker
+    tasks = [T.spawn(worker, 'a', 200000), T.spawn(worker, 'b', 100000)]
+    steps = {0: 0, 1: 0}
+    while not all(t.done for t in tasks):
+        for i, t in enumerate(tasks):
+            if not t.done:
+                t.step(max_instructions=20000)
+                steps[i] += 1
+    print steps[0] > steps[1] > 1, [t.result for t in tasks]
+    print T.eval('return log[1], log[2]')
+    print T.spawn(worker, 'c', 10).step(), T.gettop()
+    count = T.eval('return function(...) return select("#", ...) end')
+    t = T.spawn(count, *range(100))
+    print t.step(), t.result, T.gettop()
+    try:
+        T.spawn(count, *range(10**6))
+    except OverflowError, e:
+        print e
+    bad = T.spawn(T.eval('return function() error("in task") end'))
+    try:
+        bad.step(timeout=1)
+    except RuntimeError, e:
+        print type(e).__name__, e
+    print bad.done
+    try:
+        bad.step()
+    except RuntimeError, e:
+        print e
+
+    # coroutines made before a limit is set are held to it as well
+    T.eval('co = coroutine.wrap(function() while true do end end)')
+    T.eval('cr = coroutine.create(function() while true do end end)')
+    for code in ['co()', 'coroutine.resume(cr)']:
+        try:
+            T.eval(code, timeout=0.05)
+        except LuaLimitError, e:
+            print e
+    print T.eval('return coroutine.wrap(function(a, b) return a + b end)(1, 2)')
+
+def test_coroutines():
+    print '-- coroutines'
+    C = LuaState()
+    C.openlibs()
+    gen = C.eval('''
+        return coroutine.create(function(n)
+            for i = 1, n do coroutine.yield(i, i * i) end
+            return "done"
+        end)
+        ''')
+    print isinstance(gen, LuaCoroutine), gen.status()
+    print gen.resume(3)
+    print list(gen), gen.status()
+    try:
+        gen.next()
+    except StopIteration, e:
+        print 'stopped', e.args
+
+    # Lua asks the host for I/O by yielding a request; the reply is sent in
+    f = C.eval('''
+        return function(name)
+            local data = coroutine.yield("read", name)
+            local n = coroutine.yield("write", data:upper())
+            return n
+        end
+        ''')
+    co = C.coroutine(f)
+    request = co.send('a.txt')
+    replies = []
+    try:
+        while True:
+            op, arg = request
+            replies.append((op, arg))
+            request = co.send('contents' if op == 'read' else len(arg))
+    except StopIteration, e:
+        print replies, e.args[0]
+    print co.status(), C.coroutine(f) is not co
+
+    same = C.eval('co = coroutine.create(function() end) return co')
+    print same is C.eval('return co')
+    bad = C.coroutine(C.eval('return function() error("oops") end'))
+    try:
+        bad.next()
+    except RuntimeError, e:
+        print e
+    print bad.status()
+    try:
+        C.coroutine(C.eval('return 1'))
+    except TypeError, e:
+        print e
+    many = C.coroutine(C.eval('''
+        return function(...)
+            local t = {}
+            for i = 1, select("#", ...) do t[i] = i end
+            coroutine.yield(unpack(t))
+        end
+        '''))
+    print len(many.resume(*range(1000)))
+    try:
+        many.resume(*range(10**6))
+    except OverflowError, e:
+        print e
+    print C.gettop()
+
+class Counter(object):
+    def __init__(self):
+        self.n = 0
+    def add(self, k):
+        self.n += k
+        return self.n
+    @property
+    def broken(self):
+        raise ValueError('broken property')
+
+def test_attrcache(L):
+    print '-- attribute lookups'
+    c = Counter()
+    L.globals().c = c
+    print L.eval('for i = 1, 1000 do c.add(1) c.add(1) end return c.n')
+    print L.eval('return c.add == c.add, c.missing')
+    c.add = lambda k: 'shadowed'
+    print L.eval('return c.add(1)')
+    del c.add
+    print L.eval('return c.add(1)')
+    Counter.add = lambda self, k: 'replaced'
+    print L.eval('return c.add(1)')
+    xs = []
+    L.globals().xs = xs
+    L.eval('xs.append(1) xs.append(2) xs.extend(xs) xs.append(xs)')
+    print xs[:4], xs[4] is xs
+    try:
+        L.eval('return c.broken')
+    except RuntimeError, e:
+        print e
+    print L.gettop()
+
+def test_containers(L):
+    print '-- dict and list proxies'
+    d = {'a': 1, 'b': 'two', 3: 'three'}
+    xs = [10, 20, 30]
+    g = L.globals()
+    g.d = d
+    g.xs = xs
+    g.t = (1, 2)
+    print L.eval('return d.a, d["b"], d[3], d.missing, #d')
+    L.eval('d.c = xs d.a = nil')
+    print sorted(d.items())
+    print L.eval('return xs[1], xs[3], xs[4], xs[0], xs[1.5], #xs, #t, t[2]')
+    L.eval('xs[#xs + 1] = 40 xs[1] = "x" xs[#xs] = nil xs.append(50)')
+    print xs
+    print L.eval('local n = 0 for i, v in ipairs(xs) do n = n + i end '
+                 'return n')
+    print sorted(L.eval('local ks = {} for k, v in pairs(d) do '
+                        'ks[tostring(k)] = v end return ks').keys())
+    print L.eval('local s = 0 for i, v in pairs(t) do s = s + v end return s')
+    print L.eval('local s = 0 for k, v in pairs({5, 6}) do s = s + v end '
+                 'return s')
+    print L.eval('return d') is d, L.eval('return xs') is xs
+    # keys may be removed while iterating, but swapping one for another can
+    # resize the dict all the same
+    g.e = dict.fromkeys('abcde')
+    L.eval('for k in pairs(e) do e[k] = nil end')
+    print len(g.e)
+    g.e = dict.fromkeys('abcde', 0)
+    for code in ['xs[9] = 1', 't[1] = 5',
+                 'for k in pairs(d) do d[k .. "!"] = 1 end',
+                 'for k in pairs(e) do e[k] = nil e[k .. "!"] = 1 end']:
+        try:
+            L.eval(code)
+        except RuntimeError, e:
+            print e
+    print L.gettop()
+
+class Point(object):
+    def __init__(self, x, y):
+        self.x, self.y = x, y
+
+class Point3(Point):
+    pass
+
+class MyInt(int):
+    pass
+
+def test_converters():
+    print '-- converters'
+    C = LuaState(integers=True)
+    C.openlibs()
+    print C.eval('return 1, -2, 2^40, 0.5, 1e300, "s", true')
+    C.globals().big = 10**30
+    C.globals().n = MyInt(7)
+    print C.eval('return big > 1e29, n + 1, type(n)')
+    C.add_converter(Point, lambda p: C.table({'x': p.x, 'y': p.y}))
+    C.globals().p = Point(1, 2)
+    C.globals().q = Point3(3, 4)
+    print C.eval('return type(p), p.x + p.y, q.y')
+    C.add_converter(Point3, lambda p: 'point3')
+    C.globals().q = Point3(3, 4)
+    print C.eval('return q')
+    C.add_converter(Point, None)
+    C.globals().p = Point(1, 2)
+    print C.eval('return type(p)')
+    C.add_converter(Point, lambda p: p)
+    C.globals().p = Point(5, 6)
+    print C.eval('return p.x')
+    try:
+        C.add_converter(Point, 1)
+    except TypeError, e:
+        print e
+    # a converter that empties the container being converted
+    for box in [[Point(1, 2), Point(3, 4)],
+                {'a': Point(5, 6), 'b': Point(7, 8)}]:
+        def clear(p):
+            if isinstance(box, dict):
+                box.clear()
+            else:
+                del box[:]
+            return p.x
+        C.add_converter(Point, clear)
+        print sorted(C.table(box).to_dict().items())
+    print C.gettop()
+
+def test_register():
+    print '-- registered functions'
+    R = LuaState()
+    R.openlibs()
+    seen = []
+    R.register('add', lambda a, b: a + b, argtypes=[int, int], restype=int)
+    R.register('fmt', lambda s, x, b: '%s=%r %r' % (s, x, b),
+               argtypes=(str, float, bool), restype=str)
+    R.register('note', seen.append, argtypes=[object], restype=None)
+    R.register('pair', lambda *a: (len(a), a[-1]))
+    R.register('keep', lambda *a: seen.append(a), argtypes=[int])
+    print R.eval('local s = 0 for i = 1, 1000 do s = add(s, i) end return s')
+    print R.eval('return fmt("x", 2, nil)')
+    print R.eval('return note({1}), note("a")'), len(seen)
+    print R.eval('return fmt("y", 3)'), R.eval('note()'), seen[-1]
+    print R.eval('return pair(1, "two", 3)')
+    R.eval('keep(1) keep(2)')
+    print seen[-2:]
+    R.register('again', lambda n: n and R.eval('return again(%d)' % (n - 1))
+               + n, argtypes=[int], restype=int)
+    print R.eval('return again(3)')
+    for code in ['add(1)', 'add(1, "x")', 'fmt({}, 2, 3)', 'fmt("z")']:
+        try:
+            R.eval(code)
+        except RuntimeError, e:
+            print e
+    R.register('bad', lambda: 'x', restype=int)
+    try:
+        R.eval('bad()')
+    except RuntimeError, e:
+        print e
+    for args in [('f', 1), ('f', len, [list]), ('f', len, None, tuple)]:
+        try:
+            R.register(*args)
+        except TypeError, e:
+            print e
+    print R.gettop()
+
 def main():
     L = LuaState()
 
@@ -99,6 +1025,28 @@ def main():
             test(L)
     else:
         test(L)
+        test_identity(L)
+        test_iteration(L)
+        test_compile(L)
+        test_convert(L)
+        test_converters()
+        test_map(L)
+        test_register()
+        test_attrcache(L)
+        test_containers(L)
+        test_bytecode(L)
+        test_load(L)
+        test_bundle()
+        test_profile()
+        test_stats()
+        test_limits()
+        test_coroutines()
+        test_buffers()
+        test_arrays()
+        test_threads()
+        test_pool()
+        test_channels()
+        test_memory()
 
 if __name__ == '__main__':
     main()
@@ -0,0 +1,116 @@
+#!/usr/bin/env python3
+
+# The parts of the module that only exist on Python 3: bytes and str
+# conversions, and the vectorcall and fastcall entry points from 3.8 on.
+# test.py covers everything else under Python 2.
+
+import asyncio
+import sys
+from lua import LuaState, LuaStatePool, LuaLimitError
+
+def test_strings(L):
+    print('-- strings')
+    print(repr(L.eval('return "abc"')))
+    L.globals().s = 'héllo'
+    print(L.eval('return #s, s'))
+    L.globals().b = b'\x00\xff'
+    print(L.eval('return #b, b:byte(2)'))
+    print(L.eval(b'return 1 + 1'), L.eval('return 1 + 1'))
+    t = L.eval('return {name = "x", list = {1, 2}}')
+    print(t['name'], t[b'name'], t.name)
+    print(sorted(t.to_dict().items()))
+    print(L.compile(b'return "compiled"')())
+    for bad in [42, bytearray(b'return 1')]:
+        try:
+            L.eval(bad)
+        except TypeError as e:
+            print(e)
+
+def test_calls(L):
+    print('-- calls')
+    add = L.eval('return function(a, b) return a + b end')
+    vectorcall = bool(type(add).__flags__ & (1 << 11))    # HAVE_VECTORCALL
+    print(vectorcall == (sys.version_info >= (3, 8)))
+    print(add(1, 2), add(*[3, 4]))
+    spin = L.eval('return function(n) for i = 1, n do end return n end')
+    print(spin(10, max_instructions=1000), spin(10, timeout=1.0))
+    print(spin(10, max_instructions=1000, timeout=1.0))
+    try:
+        spin(1e9, max_instructions=1000)
+    except LuaLimitError as e:
+        print(e)
+    for kwargs in [{'bogus': 1}, {'timeout': -1}]:
+        try:
+            spin(1, **kwargs)
+        except (TypeError, ValueError) as e:
+            print(e)
+    try:
+        L.eval('return {}')()
+    except ValueError as e:
+        print(e)
+    print(L.eval('return 7', timeout=1),
+          L.eval('return 8', max_instructions=10))
+    for args in [(), ('x', 'y')]:
+        try:
+            L.eval(*args)
+        except TypeError as e:
+            print(e)
+    try:
+        L.compile()
+    except TypeError as e:
+        print(e)
+
+def test_register(L):
+    print('-- registered functions')
+    L.register('shout', lambda s: s.upper() + '!', argtypes=[str],
+               restype=str)
+    L.register('add', lambda a, b: a + b, argtypes=[int, int], restype=int)
+    print(L.eval('return shout("hi"), add(2, 3)'))
+
+def test_pool():
+    print('-- pool')
+    pool = LuaStatePool(2, init='function square(x) return x * x end')
+    print(pool.call('square', 7))
+    for args in [(), (b'square', 8)]:
+        try:
+            pool.call(*args)
+        except TypeError as e:
+            print(e)
+
+def test_await(L):
+    print('-- await')
+    async def fetch(x):
+        await asyncio.sleep(0)
+        return x * 10
+    async def fail():
+        raise KeyError('gone')
+    co = L.eval('return coroutine.create(function() '
+                'local x = coroutine.yield(first) '
+                'coroutine.yield() '
+                'return x + coroutine.yield(second) end)')
+    async def run():
+        L.globals().first = fetch(1)
+        L.globals().second = fetch(2)
+        return await co
+    print(asyncio.run(run()), co.status())
+    co = L.eval('return coroutine.create(function() '
+                'coroutine.yield(bad) end)')
+    async def run_failing():
+        L.globals().bad = fail()
+        try:
+            await co
+        except KeyError as e:
+            print('KeyError', e)
+    asyncio.run(run_failing())
+
+def main():
+    L = LuaState()
+    L.openlibs()
+    test_strings(L)
+    test_calls(L)
+    test_register(L)
+    test_await(L)
+    test_pool()
+
+if __name__ == '__main__':
+    main()